@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <sys/select.h>
 #include <sys/time.h>
@@ -8,11 +9,13 @@
 #include <unistd.h>
 
 
-#define MSP_PORT_INBUF_SIZE 64
+#define MSP_PORT_INBUF_SIZE 255         // large enough for any MSP v1 payload so client mode ports can take full replies
 #define MSP_PORT_OUTBUF_SIZE 256
 #define MAX_MSP_PORT_COUNT 2
 #define SELECT_TIMEOUT 0
 #define SELECT_TIMEOUT_US 75000
+#define MSP_MAX_SUBSCRIPTIONS 8
+#define MSP_PORT_TX_QUEUE_SIZE 16
 #define CLEANFLIGHT_IDENTIFIER "CLFL"
 #define FC_VERSION_MAJOR 1
 #define FC_VERSION_MINOR 14
@@ -83,6 +86,14 @@ typedef struct {
     bool buffering;
 } uartPort_t;
 
+#define FD_PORT_RX_BUFFER_SIZE 256
+
+// serial port backed by an arbitrary non-blocking file descriptor (socket, pipe, pty)
+typedef struct {
+    uartPort_t uart;
+    uint8_t rxBuf[FD_PORT_RX_BUFFER_SIZE];
+} fdPort_t;
+
 
 struct serialPortVTable {
     void (*serialWrite)(serialPort_t *instance, uint8_t ch);
@@ -113,6 +124,9 @@ typedef enum {
 
 typedef bool (*mspCommandSenderFuncPtr)(); // msp command sender function prototype
 
+struct mspPacket_s;
+typedef void (*mspReplyHandlerFuncPtr)(struct mspPacket_s *reply);    // msp client reply handler prototype
+
 typedef enum {
     IDLE,
     HEADER_M,
@@ -125,11 +139,97 @@ typedef enum {
 
 
 
+typedef enum {
+    MSP_TX_PRIORITY_CONTROL,                 // replies to requests, always drained first
+    MSP_TX_PRIORITY_TELEMETRY,               // pushed telemetry
+    MSP_TX_PRIORITY_BULK,                    // background bulk producers
+    MSP_TX_PRIORITY_COUNT
+} mspTxPriority_e;
+
+// bounded multi-producer single-consumer queue of encoded frames, see mspSerialSubmitFrame()
+typedef struct mspTxQueueSlot_s {
+    atomic_uint sequence;
+    struct mspFrame_s *frame;
+} mspTxQueueSlot_t;
+
+typedef struct mspTxQueue_s {
+    mspTxQueueSlot_t slots[MSP_PORT_TX_QUEUE_SIZE];
+    atomic_uint tail;                        // next slot producers claim
+    uint32_t head;                           // next slot the drainer takes, drainer only
+} mspTxQueue_t;
+
+typedef struct mspSubscription_s {
+    uint8_t cmd;
+    uint16_t periodMs;                       // 0 when the slot is unused
+    uint32_t nextDueAt;
+} mspSubscription_t;
+
+typedef struct mspParserStats_s {
+    uint32_t checksumErrors;
+    uint32_t framingErrors;                  // bad 'M', direction or size byte
+    uint32_t resyncs;
+    uint32_t bytesDropped;                   // bytes that ended up in no valid frame
+} mspParserStats_t;
+
+#define MSP_PORT_RESYNC_BUF_SIZE (MSP_PORT_INBUF_SIZE + 6)  // everything after the '$' of the largest frame
+
+#define MSP_PORT_RX_QUEUE_SIZE 16                // parsed commands per class waiting for dispatch
+#define MSP_SCHED_QUANTUM_BYTES 256              // request + reply bytes a weight 1 port may handle per round
+#define MSP_PORT_REPLY_WINDOW 16                 // commands per port that may be executing or waiting to be answered
+#define MSP_LATENCY_BUCKETS 24                   // log2 microseconds, the last bucket catches everything above 8 s
+
+typedef enum {
+    MSP_CLASS_CONTROL,                       // pilot and motor input, dispatched before anything else
+    MSP_CLASS_NORMAL,
+    MSP_CLASS_BULK,                          // font uploads, flash access, eeprom writes, calibrations
+    MSP_CLASS_COUNT
+} mspCommandClass_e;
+
+typedef struct mspRxCommand_s {
+    uint8_t cmd;
+    uint8_t dataSize;
+    uint8_t data[MSP_PORT_INBUF_SIZE];
+    uint32_t receivedUs;
+    uint32_t traceRxStartUs;
+} mspRxCommand_t;
+
+// a dispatched command and its reply, replies leave the port in the order the slots were taken
+typedef struct mspReplySlot_s {
+    mspRxCommand_t command;
+    struct mspFrame_s *frame;                // reply is encoded here
+    int status;                              // 0 when the command has no reply
+    atomic_bool done;
+} mspReplySlot_t;
+
+typedef struct mspRxQueue_s {
+    mspRxCommand_t commands[MSP_PORT_RX_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+} mspRxQueue_t;
+
+// time from a command being parsed to its reply being queued for the port
+typedef struct mspClassLatency_s {
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t sumUs;
+    uint32_t histogram[MSP_LATENCY_BUCKETS];
+} mspClassLatency_t;
+
+// battery and link state in host order, MSP_ANALOG and the OSD both report it from here
+typedef struct mspAnalogState_s {
+    uint8_t vbat;                            // 0.1 V
+    uint16_t mAhDrawn;                       // milliamp hours drawn from battery
+    uint16_t rssi;                           // 0..1023
+    int16_t amperage;                        // 0.001 A steps
+} mspAnalogState_t;
+
 typedef struct mspPort_s {
     serialPort_t *port;                      // NULL when unused.
     mspPortMode_e mode;
+    uint16_t traceId;                        // unique per resetMspPort(), names the port's track in traces
 
     mspCommandSenderFuncPtr commandSenderFn;   // NULL when unused.
+    mspReplyHandlerFuncPtr replyHandlerFn;     // NULL when unused.
 
     mspState_e c_state;
     uint8_t offset;
@@ -137,6 +237,34 @@ typedef struct mspPort_s {
     uint8_t cmdMSP;
     uint8_t inBuf[MSP_PORT_INBUF_SIZE];
     //uint8_t tempBuf[MSP_PORT_INBUF_SIZE];
+    uint8_t direction;                       // header direction byte of the frame being parsed
+
+    // bytes of a failed frame that still have to be rescanned for the next frame start
+    uint8_t resyncBuf[MSP_PORT_RESYNC_BUF_SIZE];
+    uint16_t resyncPos;
+    uint16_t resyncLen;
+    mspParserStats_t parserStats;
+
+    // server side scheduling, see mspSerialProcess()
+    mspRxQueue_t rxQueues[MSP_CLASS_COUNT];
+    bool rxHeld;                             // MSP_PASSTHROUGH is queued, later bytes are left for the bridge
+    uint8_t schedWeight;                     // share of the loop relative to other ports, 1 by default
+    int32_t schedDeficit;                    // deficit round-robin byte credit
+    mspClassLatency_t classLatency[MSP_CLASS_COUNT];
+    mspReplySlot_t replySlots[MSP_PORT_REPLY_WINDOW];
+    uint32_t replySeqNext;                   // slot the next dispatched command takes
+    uint32_t replySeqEmit;                   // oldest slot whose reply has not been queued yet
+
+    uint8_t compressThreshold;               // smallest reply sent as MSP_COMPRESSED, 0 until negotiated
+
+    uint32_t traceRxStartUs;                 // micros() of the first header byte, 0 when not tracing
+    uint32_t lastActivityAt;                 // millis() of the last valid frame, used to expire subscriptions
+    mspSubscription_t subscriptions[MSP_MAX_SUBSCRIPTIONS];
+
+    // encoded frames waiting for the serial port, each holds a reference until fully written
+    mspTxQueue_t txQueues[MSP_TX_PRIORITY_COUNT];
+    struct mspFrame_s *txCurrent;            // frame being written, finished before any other is started
+    uint16_t txFrameOffset;                  // bytes of txCurrent already written
 } mspPort_t;
 
 
@@ -162,13 +290,18 @@ uint8_t usbTxBytesFree(serialPort_t *instance);
 uint8_t serial_waiting(serialPort_t *instance);
 bool usb_txbuffer_empty(serialPort_t *instance);
 
+serialPort_t* fdSerialOpen(fdPort_t *fdPort, int fd);
+bool fdSerialIsConnected(serialPort_t *instance);
+
 
 void serialBeginWrite(serialPort_t *instance);
 void serialWriteBuf(serialPort_t *instance, uint8_t *data, int count);
 void serialWrite(serialPort_t *instance, uint8_t ch);
 void serialEndWrite(serialPort_t *instance);
 uint8_t serialRxBytesWaiting(serialPort_t *instance);
+uint8_t serialTxBytesFree(serialPort_t *instance);
 uint8_t serialRead(serialPort_t *instance);
+bool isSerialTransmitBufferEmpty(serialPort_t *instance);
 
 
 typedef struct {
@@ -190,14 +323,53 @@ typedef enum _DEVICE_STATE {
 
 serialPort_t* usartInitAllIOSignals(void);
 void usbInit(void);
+void usbSetDevice(const char *path);
+bool usbOpen(void);
+void usbClose(void);
+void usbWaitForDevice(void);
+void usbSetRxWaitTimeout(uint32_t timeoutUs);
+void usbCapRxWaitTimeout(uint32_t timeoutUs);
+void usbSetWakeFd(int fd);
+void usbSetBusyPoll(uint32_t idleUs);
+void usbTxDrain(void);
 
 void mspSerialProcess(void);
 void resetMspPort(mspPort_t *mspPortToReset, serialPort_t *serialPort);
-
-
-mspPort_t mspPorts[MAX_MSP_PORT_COUNT];
+bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c);
+void mspSerialProcessResyncBytes(mspPort_t *msp);
+bool mspSerialEncode(mspPort_t *msp, mspPacket_t *packet);
+void mspSerialEncodeFrame(struct mspFrame_s *frame, uint8_t direction, mspPacket_t *packet);
+uint8_t mspSerialReplyDirection(mspPort_t *msp, mspPacket_t *packet);
+void mspSerialInitTxQueues(mspPort_t *msp);
+bool mspSerialSubmitFrame(mspPort_t *msp, struct mspFrame_s *frame, mspTxPriority_e priority);
+bool mspSerialTxQueueFull(mspPort_t *msp, mspTxPriority_e priority);
+void mspSerialFlushTxQueue(mspPort_t *msp);
+void mspSerialDiscardTxQueue(mspPort_t *msp);
+bool mspCommandIsReadOnly(uint8_t cmd);
+mspCommandClass_e mspCommandClass(uint8_t cmd);
+uint32_t mspClassLatencyPercentileUs(const mspClassLatency_t *latency, uint32_t permille);
+void mspSerialReportLatency(void);
+int mspProcessCommand(mspPacket_t *command, mspPacket_t *reply);
+void mspGetAnalogState(mspAnalogState_t *state);
+void mspSerialExecuteCommand(mspPort_t *msp, mspReplySlot_t *slot);
+void mspConditionalReadSerializeRequest(sbuf_t *dst, uint8_t cmd, uint32_t hash);
+bool mspConditionalReadUnchanged(mspPacket_t *reply, uint8_t cmd);
+void mspMultipleMspSerializeRequest(sbuf_t *dst, const uint8_t *cmds, int count);
+int mspMultipleMspSplitReply(mspPacket_t *reply, const uint8_t *cmds, int count, mspPacket_t *subReplies);
+
+uint32_t millis(void);
+uint32_t micros(void);
+
+
+extern mspPort_t mspPorts[MAX_MSP_PORT_COUNT];
 
 void sbufWriteU8(sbuf_t *dst, uint8_t val);
 void sbufWriteU16(sbuf_t *dst, uint16_t val);
 void sbufWriteU32(sbuf_t *dst, uint32_t val);
-void sbufWriteData(sbuf_t *dst, const void *data, int len);
\ No newline at end of file
+void sbufWriteData(sbuf_t *dst, const void *data, int len);
+uint8_t sbufReadU8(sbuf_t *src);
+uint16_t sbufReadU16(sbuf_t *src);
+uint32_t sbufReadU32(sbuf_t *src);
+void sbufSwitchToReader(sbuf_t *buf, uint8_t *base);
+uint8_t* sbufPtr(sbuf_t *buf);
+int sbufBytesRemaining(sbuf_t *buf);
\ No newline at end of file
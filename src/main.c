@@ -1,15 +1,389 @@
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
 #include "lib.h"
+#include "msp_proxy.h"
+#include "msp_frame.h"
+#include "msp_checksum.h"
+#include "msp_trace.h"
+#include "msp_workers.h"
+#include "msp_recorder.h"
+#include "msp_passthrough.h"
+#include "msp_realtime.h"
+#include "msp_osd.h"
+#include "serial_channel.h"
+#include "msp_ahrs.h"
+#include "msp_bulk.h"
+#include "msp_telemetry.h"
 
-void main()
+static volatile sig_atomic_t stopRequested;
+static volatile sig_atomic_t traceDumpRequested;
+
+static void onStopSignal(int sig)
+{
+	UNUSED(sig);
+	stopRequested = 1;
+}
+
+static void onTraceDumpSignal(int sig)
+{
+	UNUSED(sig);
+	traceDumpRequested = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d <device>] [-p tcp:<port>|tcp:<host>:<port>|unix:<path>] [-c <cache>] [-t <trace.json>] [-j <threads>] [-R <file>[:<rows>]] [-b <target>]... [-r <cpu>[,<cpu>...][:<priority>] [-B]] [-L <channel>] [-i <hz>] [-F <font> | -D <file>:<size>[@<address>] [-W <window>]]\n", name);
+	fprintf(stderr, "  -d  serial device to talk MSP on, /dev/ttyMFD2 by default\n");
+	fprintf(stderr, "  -p  proxy mode, share the FC link between clients on the given socket\n");
+	fprintf(stderr, "  -c  proxy mode, keep the FC identification in this file for fast reconnects\n");
+	fprintf(stderr, "  -t  record per frame latency spans, written as Chrome trace JSON on SIGUSR1 and on exit\n");
+	fprintf(stderr, "  -j  run read-only commands on this many worker threads, replies keep dispatch order\n");
+	fprintf(stderr, "  -b  passthrough target for MSP_PASSTHROUGH, <device>[@<baud>], tcp:<host>:<port> or unix:<path>, up to %d\n", MSP_PASSTHROUGH_MAX_TARGETS);
+	fprintf(stderr, "  -R  recorder mode, poll the FC and append its telemetry to a columnar file of <rows> rows\n");
+	fprintf(stderr, "  -r  real-time mode, lock memory and run at SCHED_FIFO <priority> (%d) on the first cpu, workers on the others\n", MSP_REALTIME_DEFAULT_PRIORITY);
+	fprintf(stderr, "  -L  emulate a radio link on the device, e.g. baud=57600,latency=20,jitter=5,ber=1e-5,drop=1e-4,burst=1e-4,burstlen=20,seed=1\n");
+	fprintf(stderr, "  -i  simulate an IMU sampling at <hz> and serve MSP_ATTITUDE and MSP_RAW_IMU from it\n");
+	fprintf(stderr, "  -F  client mode, upload an OSD font of %d bytes per character to the FC and exit\n", MSP_OSD_CHAR_SIZE);
+	fprintf(stderr, "  -D  client mode, download <size> bytes of dataflash from <address> (0) into <file> and exit\n");
+	fprintf(stderr, "  -W  with -F or -D, keep up to <window> requests outstanding (%d), 1 is stop-and-wait\n", MSP_BULK_DEFAULT_WINDOW);
+	fprintf(stderr, "  -B  with -r, busy-poll the port while it is active, blocking again after %d us idle\n", MSP_REALTIME_BUSY_POLL_IDLE_US);
+}
+
+static uint8_t *loadFont(const char *path, uint16_t *charCount)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *font = NULL;
+	long size;
+
+	if (!file)
+	{
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && size % MSP_OSD_CHAR_SIZE == 0 &&
+		size / MSP_OSD_CHAR_SIZE <= UINT16_MAX && (font = malloc(size)))
+	{
+		rewind(file);
+		if (fread(font, 1, size, file) == (size_t)size)
+		{
+			*charCount = size / MSP_OSD_CHAR_SIZE;
+		}
+		else
+		{
+			free(font);
+			font = NULL;
+		}
+	}
+	fclose(file);
+	return font;
+}
+
+static bool saveDownload(const char *path, const uint8_t *data, uint32_t size)
+{
+	FILE *file = fopen(path, "wb");
+	bool written;
+
+	if (!file)
+	{
+		return false;
+	}
+	written = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && written;
+}
+
+int main(int argc, char *argv[])
 {
 	int result;
-	serialPort_t* port = (serialPort_t*)(malloc(sizeof(serialPort_t)));
-	port = usartInitAllIOSignals();
+	int opt;
+	const char *proxyListen = NULL;
+	const char *tracePath = NULL;
+	const char *handshakeCachePath = NULL;
+	int workerCount = 0;
+	const char *recordPath = NULL;
+	uint64_t recordRows = MSP_RECORDER_DEFAULT_CAPACITY;
+	bool realtime = false;
+	bool busyPoll = false;
+	static channelPort_t channel;
+	channelConfig_t channelConfig;
+	bool emulateChannel = false;
+	uint32_t imuRateHz = 0;
+	const char *fontPath = NULL;
+	const char *downloadPath = NULL;
+	uint32_t downloadSize = 0;
+	uint32_t downloadAddress = 0;
+	int bulkWindow = MSP_BULK_DEFAULT_WINDOW;
+	static mspBulkTransfer_t bulk;
+	uint8_t *bulkData = NULL;
+
+	while ((opt = getopt(argc, argv, "d:p:c:t:j:R:b:r:BL:i:F:D:W:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':
+				usbSetDevice(optarg);
+				break;
+			case 'p':
+				proxyListen = optarg;
+				break;
+			case 'c':
+				handshakeCachePath = optarg;
+				break;
+			case 't':
+				tracePath = optarg;
+				break;
+			case 'j':
+				workerCount = atoi(optarg);
+				break;
+			case 'b':
+				if (!mspPassthroughAddTarget(optarg))
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'r':
+				if (!mspRealtimeConfigure(optarg))
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				realtime = true;
+				break;
+			case 'B':
+				busyPoll = true;
+				break;
+			case 'L':
+				if (!channelConfigParse(&channelConfig, optarg))
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				emulateChannel = true;
+				break;
+			case 'i':
+				imuRateHz = strtoul(optarg, NULL, 10);
+				if (!imuRateHz)
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'F':
+				fontPath = optarg;
+				break;
+			case 'D': {
+				char *address = strrchr(optarg, '@');
+				char *size;
+				if (address)
+				{
+					*address++ = '\0';
+					downloadAddress = strtoul(address, NULL, 0);
+				}
+				size = strrchr(optarg, ':');
+				if (!size || !(downloadSize = strtoul(size + 1, NULL, 0)))
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				*size = '\0';
+				downloadPath = optarg;
+				break;
+			}
+			case 'W':
+				bulkWindow = atoi(optarg);
+				if (bulkWindow < 1 || bulkWindow > MSP_BULK_MAX_WINDOW)
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'R': {
+				char *rows = strrchr(optarg, ':');
+				if (rows)
+				{
+					*rows++ = '\0';
+					recordRows = strtoull(rows, NULL, 10);
+				}
+				recordPath = optarg;
+				break;
+			}
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	mspChecksumInit();
+	mspFramePoolInit();
+
+	signal(SIGINT, onStopSignal);
+	signal(SIGTERM, onStopSignal);
+
+	if (tracePath)
+	{
+		mspTraceStart(tracePath);
+		signal(SIGUSR1, onTraceDumpSignal);
+	}
+
+	if (proxyListen && recordPath)
+	{
+		fprintf(stderr, "-p and -R both drive the FC link, pick one\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((fontPath || downloadPath) && (proxyListen || recordPath || (fontPath && downloadPath)))
+	{
+		fprintf(stderr, "-F and -D drive the FC link on their own, pick one of -p, -R, -F and -D\n");
+		return EXIT_FAILURE;
+	}
+
+	if (fontPath)
+	{
+		uint16_t charCount;
+		bulkData = loadFont(fontPath, &charCount);
+		if (!bulkData)
+		{
+			fprintf(stderr, "unable to read a font of %d byte characters from %s\n", MSP_OSD_CHAR_SIZE, fontPath);
+			return EXIT_FAILURE;
+		}
+		mspBulkInitOsdFontUpload(&bulk, bulkData, charCount);
+		bulk.window = bulkWindow;
+	}
+	else if (downloadPath)
+	{
+		bulkData = malloc(downloadSize);
+		if (!bulkData)
+		{
+			return EXIT_FAILURE;
+		}
+		mspBulkInitDataflashDownload(&bulk, bulkData, downloadAddress, downloadSize);
+		bulk.window = bulkWindow;
+	}
 
-	resetMspPort(&mspPorts[0],port);
+	if (busyPoll && !realtime)
+	{
+		fprintf(stderr, "-B spins on the cpu given with -r, it needs -r\n");
+		return EXIT_FAILURE;
+	}
 
-	while(1)
+	// before any thread or buffer is created, so both inherit the locked memory and the policy
+	if (realtime)
+	{
+		if (busyPoll)
+		{
+			mspRealtimeSetBusyPoll(MSP_REALTIME_BUSY_POLL_IDLE_US);
+		}
+		if (!mspRealtimeStart(workerCount))
+		{
+			fprintf(stderr, "real-time mode is only partly in effect\n");
+		}
+	}
+
+	if (workerCount > 0 && !mspWorkersStart(workerCount))
+	{
+		fprintf(stderr, "unable to start %d worker threads, running commands inline\n", workerCount);
+	}
+
+	if (imuRateHz)
+	{
+		mspImuSimStart(imuRateHz);
+		mspAhrsStart(imuRateHz, mspImuSimRead);
+	}
+
+	serialPort_t* port = usartInitAllIOSignals();
+	if (emulateChannel)
+	{
+		port = channelSerialWrap(&channel, port, &channelConfig);
+	}
+
+	if (proxyListen)
+	{
+		if (!mspProxyInit(&mspPorts[0], port, proxyListen, handshakeCachePath))
+		{
+			fprintf(stderr, "unable to listen on %s\n", proxyListen);
+			return EXIT_FAILURE;
+		}
+	}
+	else if (recordPath)
+	{
+		resetMspPort(&mspPorts[0], port);
+		mspPorts[0].mode = MSP_MODE_CLIENT;
+		if (!mspRecorderStart(recordPath, recordRows) || !mspRecorderAddLink(&mspPorts[0], 0, MSP_RECORDER_DEFAULT_PERIOD_MS))
+		{
+			fprintf(stderr, "unable to record to %s\n", recordPath);
+			return EXIT_FAILURE;
+		}
+	}
+	else if (bulkData)
+	{
+		resetMspPort(&mspPorts[0], port);
+		mspPorts[0].mode = MSP_MODE_CLIENT;
+		if (!mspBulkStart(&mspPorts[0], &bulk))
+		{
+			fprintf(stderr, "unable to start the transfer\n");
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		resetMspPort(&mspPorts[0],port);
+	}
+
+	while(!stopRequested)
 	{
 		mspSerialProcess();
+		if (proxyListen)
+		{
+			mspProxyProcess();
+		}
+		if (recordPath)
+		{
+			mspRecorderProcess();
+		}
+		if (bulkData)
+		{
+			mspBulkProcess();
+			if (bulk.state != MSP_BULK_RUNNING)
+			{
+				break;
+			}
+		}
+		if (traceDumpRequested)
+		{
+			traceDumpRequested = 0;
+			mspTraceDump();
+		}
+	}
+
+	result = EXIT_SUCCESS;
+	if (bulkData)
+	{
+		mspBulkCancel();
+		mspBulkReport(&bulk);
+		if (bulk.state != MSP_BULK_DONE || (downloadPath && !saveDownload(downloadPath, bulkData, downloadSize)))
+		{
+			result = EXIT_FAILURE;
+		}
+		free(bulkData);
+	}
+
+	mspWorkersStop();
+	mspRecorderStop();
+	mspTraceDump();
+	mspSerialReportLatency();
+	mspFramePoolReport();
+	if (proxyListen)
+	{
+		mspProxyReport();
+	}
+	mspTelemetryReport();
+	mspOsdReport();
+	mspAhrsReport();
+	if (emulateChannel)
+	{
+		channelSerialReport(&channel);
 	}
+	mspRealtimeReport();
+	return result;
 }
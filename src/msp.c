@@ -8,6 +8,18 @@
 #include <fcntl.h>
 #include "msp_protocol.h"
 #include "lib.h"
+#include "msp_telemetry.h"
+#include "msp_messages.h"
+#include "msp_frame.h"
+#include "msp_checksum.h"
+#include "msp_probes.h"
+#include "msp_trace.h"
+#include "msp_compress.h"
+#include "msp_workers.h"
+#include "msp_recorder.h"
+#include "msp_passthrough.h"
+#include "msp_osd.h"
+#include "msp_ahrs.h"
 
 #define BUILD_DATE_LENGTH 11
 #define BUILD_TIME_LENGTH 8
@@ -15,6 +27,9 @@
 #define MAX_VOLTAGE_METERS 2
 #define TARGET_BOARD_IDENTIFIER "EDISON"
 #define BOARD_IDENTIFIER_LENGTH 6
+#define MSP_V1_MAX_PAYLOAD_SIZE 255
+#define MSP_V1_FRAME_OVERHEAD 6                     // $ M direction size cmd ... checksum
+#define MSP_MULTIPLE_MSP_SUBREPLY_RESERVE 64    // headroom for a variable size handler, sub-commands stop when less is left
 
 
 const char * const buildDate = __DATE__;
@@ -22,6 +37,8 @@ const char * const buildTime = __TIME__;
 const char * const shortGitRevision = "1234567";
 static const char * const boardIdentifier = TARGET_BOARD_IDENTIFIER;
 
+mspPort_t mspPorts[MAX_MSP_PORT_COUNT];
+
 static uint8_t mspSerialChecksum(uint8_t checksum, uint8_t byte)
 {
     return checksum ^ byte;
@@ -29,11 +46,7 @@ static uint8_t mspSerialChecksum(uint8_t checksum, uint8_t byte)
 
 static uint8_t mspSerialChecksumBuf(uint8_t checksum, uint8_t *data, int len)
 {
-    while(len-- > 0) {
-        checksum = mspSerialChecksum(checksum, *data++);
-    }
-
-    return checksum;
+    return mspChecksumBuf(checksum, data, len);
 }
 
 
@@ -62,6 +75,148 @@ void sbufWriteString(sbuf_t *dst, const char *string)
 
 
 
+// this host has no battery or receiver: 0 V and all ones for the rest, as MSP_ANALOG always sent
+void mspGetAnalogState(mspAnalogState_t *state)
+{
+    state->vbat = 0;
+    state->mAhDrawn = 65535;
+    state->rssi = 65535;
+    state->amperage = -1;
+}
+
+
+int mspServerCommandHandler(mspPacket_t *cmd, mspPacket_t *reply);
+
+// Runs every listed read-only command through the dispatcher in one pass, writing each reply
+// in place behind its length byte. Setters are answered with an empty entry so a batch can
+// never trigger side effects.
+static void mspServerMultipleMsp(sbuf_t *src, sbuf_t *dst)
+{
+    uint8_t *payloadStart = dst->ptr;
+
+    while (sbufBytesRemaining(src) > 0) {
+        uint8_t subCmd = *src->ptr++;
+        uint8_t *lenPtr = dst->ptr;
+        int subReplySize = mspFixedReplySize(subCmd);
+
+        if (subReplySize == MSP_REPLY_SIZE_UNKNOWN) {
+            subReplySize = MSP_MULTIPLE_MSP_SUBREPLY_RESERVE;
+        }
+        if (sbufBytesRemaining(dst) < subReplySize + 1 ||
+            lenPtr + 1 - payloadStart > MSP_V1_MAX_PAYLOAD_SIZE) {
+            break;
+        }
+
+        mspPacket_t subCommand = {
+            .buf = {
+                .ptr = src->end,
+                .end = src->end,
+            },
+            .cmd = subCmd,
+            .result = 0,
+        };
+
+        mspPacket_t subReply = {
+            .buf = {
+                .ptr = lenPtr + 1,
+                .end = dst->end,
+            },
+            .cmd = subCmd,
+            .result = 0,
+        };
+
+        if (subCmd != MSP_MULTIPLE_MSP && subCmd != MSP_CONDITIONAL_READ && mspCommandIsReadOnly(subCmd)) {
+            mspServerCommandHandler(&subCommand, &subReply);
+        }
+
+        if (subReply.buf.ptr - payloadStart > MSP_V1_MAX_PAYLOAD_SIZE) {
+            break;                          // would not fit in the frame, drop this and later entries
+        }
+
+        *lenPtr = subReply.buf.ptr - (lenPtr + 1);
+        dst->ptr = subReply.buf.ptr;
+    }
+}
+
+
+// Replies that only change when a setter runs. Their hash stays valid until the next
+// successful setter, so a conditional read of one is answered without running its handler.
+static bool mspCommandIsConfigRead(uint8_t cmd)
+{
+    switch (cmd) {
+        case MSP_API_VERSION:
+        case MSP_FC_VARIANT:
+        case MSP_BOARD_INFO:
+        case MSP_BUILD_INFO:
+        case MSP_IDENT:
+        case MSP_UID:
+        case MSP_BATTERY_CONFIG:
+        case MSP_ACC_TRIM:
+        case MSP_BOXNAMES:
+        case MSP_MISC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// configGeneration the hash was taken at in the high half, the hash in the low half. Generation 0
+// means never hashed. One word so a worker never sees a hash paired with the wrong generation.
+static _Atomic uint64_t replyHashes[256];
+static uint32_t configGeneration = 1;       // setters run alone, see mspSerialProcessReceivedCommand()
+
+// MSP_CONDITIONAL_READ: runs the wrapped read-only command and, when its payload hashes to what
+// the client already holds, replaces the reply with just the command byte under
+// MSP_CONDITIONAL_READ. A changed payload goes out in full under the wrapped command.
+static int mspServerConditionalRead(mspPacket_t *command, mspPacket_t *reply)
+{
+    sbuf_t *src = &command->buf;
+    uint8_t *payloadStart = reply->buf.ptr;
+
+    if (sbufBytesRemaining(src) < 5) {
+        return -1;
+    }
+
+    uint8_t subCmd = sbufReadU8(src);
+    uint32_t clientHash = sbufReadU32(src);
+    uint64_t known = atomic_load_explicit(&replyHashes[subCmd], memory_order_relaxed);
+    bool config = mspCommandIsConfigRead(subCmd);
+
+    if (!mspCommandIsReadOnly(subCmd) || subCmd == MSP_MULTIPLE_MSP || subCmd == MSP_CONDITIONAL_READ) {
+        return -1;
+    }
+
+    if (!config || known != ((uint64_t)configGeneration << 32 | clientHash)) {
+        mspPacket_t subCommand = {
+            .buf = {
+                .ptr = src->end,
+                .end = src->end,
+            },
+            .cmd = subCmd,
+            .result = 0,
+        };
+
+        int status = mspProcessCommand(&subCommand, reply);
+        if (status <= 0) {
+            return status;
+        }
+
+        uint32_t hash = mspReplyHash(payloadStart, reply->buf.ptr - payloadStart);
+        if (config) {
+            atomic_store_explicit(&replyHashes[subCmd], (uint64_t)configGeneration << 32 | hash, memory_order_relaxed);
+        }
+        if (hash != clientHash) {
+            return 1;
+        }
+    }
+
+    reply->buf.ptr = payloadStart;
+    reply->cmd = MSP_CONDITIONAL_READ;
+    sbufWriteU8(&reply->buf, subCmd);
+    return 1;
+}
+
+
 int mspServerCommandHandler(mspPacket_t *cmd, mspPacket_t *reply)
 {
     sbuf_t *dst = &reply->buf;
@@ -73,85 +228,111 @@ int mspServerCommandHandler(mspPacket_t *cmd, mspPacket_t *reply)
     int i;
 
     int len = sbufBytesRemaining(src);
-    //printf("%d\n",MSP_BOXNAMES);        
-    printf("command code: %d\n",cmd->cmd);
     switch (cmd->cmd) 
     {
-        case MSP_API_VERSION:
+        case MSP_API_VERSION: {
             //printf("code 1\n");
-            sbufWriteU8(dst, MSP_PROTOCOL_VERSION);
-            sbufWriteU8(dst, API_VERSION_MAJOR);
-            sbufWriteU8(dst, API_VERSION_MINOR);
+            const mspApiVersion_t msg = {
+                .protocolVersion = MSP_PROTOCOL_VERSION,
+                .apiVersionMajor = API_VERSION_MAJOR,
+                .apiVersionMinor = API_VERSION_MINOR,
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_FC_VARIANT:
-            sbufWriteData(dst, flightControllerIdentifier, FLIGHT_CONTROLLER_IDENTIFIER_LENGTH);
-            sbufWriteU8(dst, FC_VERSION_MAJOR);
-            sbufWriteU8(dst, FC_VERSION_MINOR);
-            sbufWriteU8(dst, FC_VERSION_PATCH_LEVEL);
+        case MSP_FC_VARIANT: {
+            mspFcVariant_t msg = {
+                .versionMajor = FC_VERSION_MAJOR,
+                .versionMinor = FC_VERSION_MINOR,
+                .versionPatchLevel = FC_VERSION_PATCH_LEVEL,
+            };
+            memcpy(msg.identifier, flightControllerIdentifier, FLIGHT_CONTROLLER_IDENTIFIER_LENGTH);
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_BOARD_INFO:
-            sbufWriteData(dst, boardIdentifier, BOARD_IDENTIFIER_LENGTH);
-
-
+        case MSP_BOARD_INFO: {
+            mspBoardInfo_t msg = {
 #ifdef USE_HARDWARE_REVISION_DETECTION
-            sbufWriteU16(dst, hardwareRevision);
+                .hardwareRevision = htole16(hardwareRevision),
 #else
-            sbufWriteU16(dst, 0); // No hardware revision available.
+                .hardwareRevision = 0,              // No hardware revision available.
 #endif
-            sbufWriteU8(dst, 0);  // 0 == FC, 1 == OSD, 2 == FC with OSD
+                .boardType = 0,
+            };
+            memcpy(msg.boardIdentifier, boardIdentifier, BOARD_IDENTIFIER_LENGTH);
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_BUILD_INFO:
-            printf("date\n");
-            sbufWriteData(dst, buildDate, BUILD_DATE_LENGTH);
-            sbufWriteData(dst, buildTime, BUILD_TIME_LENGTH);
-            sbufWriteData(dst, shortGitRevision, GIT_SHORT_REVISION_LENGTH);
+        case MSP_BUILD_INFO: {
+            mspBuildInfo_t msg;
+            memcpy(msg.buildDate, buildDate, BUILD_DATE_LENGTH);
+            memcpy(msg.buildTime, buildTime, BUILD_TIME_LENGTH);
+            memcpy(msg.gitRevision, shortGitRevision, GIT_SHORT_REVISION_LENGTH);
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
             // DEPRECATED - Use MSP_API_VERSION
-        case MSP_IDENT:
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 255);
-            sbufWriteU32(dst, 65535); // "capability"
+        case MSP_IDENT: {
+            const mspIdent_t msg = {
+                .version = 255,
+                .multiType = 255,
+                .mspVersion = 255,
+                .capability = htole32(65535),
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_STATUS:
+        case MSP_STATUS: {
             //printf("MSP_STATUS\n");
-            sbufWriteU16(dst, 0);
+            const mspStatus_t msg = {
+                .cycleTime = 0,
 #ifdef USE_I2C
-            sbufWriteU16(dst, i2cGetErrorCounter());
+                .i2cErrors = htole16(i2cGetErrorCounter()),
 #else
-            sbufWriteU16(dst, 0);
+                .i2cErrors = 0,
 #endif
-            sbufWriteU16(dst, 3);           //Sensors in the system
-            sbufWriteU32(dst, 127);
-            sbufWriteU8(dst, 127);
-            sbufWriteU16(dst, 30000);
+                .sensors = htole16(3),          //Sensors in the system
+                .flightModeFlags = htole32(127),
+                .currentProfile = 127,
+                .systemLoad = htole16(30000),
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_UID:
-            sbufWriteU32(dst, 0);
-            sbufWriteU32(dst, 0);
-            sbufWriteU32(dst, 0);
+        case MSP_UID: {
+            const mspUid_t msg = { .uid = { 0, 0, 0 } };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_BATTERY_CONFIG:
+        case MSP_BATTERY_CONFIG: {
             //Showing battery to be full for now
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 255);
-            sbufWriteU16(dst, 65535);
-            sbufWriteU8(dst, 255);
+            const mspBatteryConfig_t msg = {
+                .vbatMinCellVoltage = 255,
+                .vbatMaxCellVoltage = 255,
+                .vbatWarningCellVoltage = 255,
+                .batteryCapacity = htole16(65535),
+                .amperageMeterSource = 255,
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
-        case MSP_ACC_TRIM:
+        case MSP_ACC_TRIM: {
             //printf("MSP_ACC_TRIM\n");
-            sbufWriteU16(dst, 1000);            //pitch
-            sbufWriteU16(dst, 1000);            //roll
+            const mspAccTrim_t msg = {
+                .pitch = htole16(1000),
+                .roll = htole16(1000),
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
         
         case MSP_BOXNAMES:
             sbufWriteString(dst, "None");
@@ -170,92 +351,603 @@ int mspServerCommandHandler(mspPacket_t *cmd, mspPacket_t *reply)
             break;
 
 
-        case MSP_MISC:
-            sbufWriteU16(dst, 65535);
-
-            sbufWriteU16(dst, 65535);
-            sbufWriteU16(dst, 65535);
-            sbufWriteU16(dst, 65535);
-
-            sbufWriteU16(dst, 65535);
-
-            sbufWriteU8(dst, 0); // gps_type
-            sbufWriteU8(dst, 0); // TODO gps_baudrate (an index, cleanflight uses a uint32_t
-            sbufWriteU8(dst, 0); // gps_ubx_sbas
-
-            
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 255);
-            sbufWriteU8(dst, 0);
-
-            sbufWriteU16(dst, 65535);
-            
+        case MSP_MISC: {
+            const mspMisc_t msg = {
+                .midrc = htole16(65535),
+                .minthrottle = htole16(65535),
+                .maxthrottle = htole16(65535),
+                .mincommand = htole16(65535),
+                .failsafeThrottle = htole16(65535),
+                .gpsType = 0,
+                .gpsBaudrate = 0,               // TODO gps_baudrate (an index, cleanflight uses a uint32_t
+                .gpsUbxSbas = 0,
+                .multiwiiCurrentMeterOutput = 255,
+                .rssiChannel = 255,
+                .placeholder = 0,
+                .magDeclination = htole16(65535),
+            };
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
         
-        case MSP_ATTITUDE:
-            
-            sbufWriteU16(dst, 120);     //roll
-            sbufWriteU16(dst, 120);     //pitch
-            sbufWriteU16(dst, 340);     //yaw
+        case MSP_ATTITUDE: {
+            mspAhrsAttitude_t attitude;
+            mspAhrsGetAttitude(&attitude);      // fuses only the samples since the last request
+            const mspAttitude_t msg = {
+                .roll = htole16(attitude.roll),
+                .pitch = htole16(attitude.pitch),
+                .yaw = htole16(attitude.heading),
+            };
+            sbufWriteMessage(dst, msg);
+            break;
+        }
+
+        case MSP_RAW_IMU: {
+            mspImuSample_t sample = { 0 };
+            mspAhrsGetLatestSample(&sample);
+            mspRawImu_t msg;
+            for (i = 0; i < 3; i++) {
+                msg.acc[i] = htole16((int16_t)(sample.acc[i] * MSP_IMU_RAW_ACC_1G / MSP_IMU_ACC_LSB_PER_G));
+                msg.gyro[i] = htole16((int16_t)(sample.gyro[i] / MSP_IMU_GYRO_LSB_PER_DPS));
+                msg.mag[i] = htole16(sample.mag[i]);
+            }
+            sbufWriteMessage(dst, msg);
             break;
+        }
 
 
         case MSP_ANALOG: {
-            sbufWriteU8(dst, 0);
-            sbufWriteU16(dst, 65535); // milliamp hours drawn from battery
-            sbufWriteU16(dst, 65535);
-
-            sbufWriteU16(dst, 65535); // send amperage in 0.001 A steps. Negative range is truncated to zero
-            
+            mspAnalogState_t analog;
+            mspGetAnalogState(&analog);
+            const mspAnalog_t msg = {
+                .vbat = analog.vbat,
+                .mAhDrawn = htole16(analog.mAhDrawn),
+                .rssi = htole16(analog.rssi),
+                .amperage = htole16(analog.amperage),
+            };
+            sbufWriteMessage(dst, msg);
             break;
         }
 
+        case MSP_MULTIPLE_MSP:
+            mspServerMultipleMsp(src, dst);
+            break;
+
+        case MSP_CONDITIONAL_READ:
+            return mspServerConditionalRead(cmd, reply);
+
+        case MSP_OSD_CONFIG:
+        case MSP_SET_OSD_CONFIG:
+        case MSP_OSD_CHAR_READ:
+        case MSP_OSD_CHAR_WRITE:
+        case MSP_OSD_LAYOUT_CONFIG:
+        case MSP_SET_OSD_LAYOUT_CONFIG:
+            return mspOsdCommandHandler(cmd, reply);
+
     }
 
     return 1;     // message was handled successfully
 }
 
 
+// Commands that change FC state or trigger an action. Everything else only reads state
+// and may be cached or coalesced by intermediaries such as the proxy.
+bool mspCommandIsReadOnly(uint8_t cmd)
+{
+    switch (cmd) {
+        case MSP_SET_NAME:
+        case MSP_SET_BATTERY_CONFIG:
+        case MSP_SET_MODE_RANGE:
+        case MSP_SET_FEATURE:
+        case MSP_SET_BOARD_ALIGNMENT:
+        case MSP_SET_AMPERAGE_METER_CONFIG:
+        case MSP_SET_MIXER:
+        case MSP_SET_RX_CONFIG:
+        case MSP_SET_LED_COLORS:
+        case MSP_SET_LED_STRIP_CONFIG:
+        case MSP_SET_RSSI_CONFIG:
+        case MSP_SET_ADJUSTMENT_RANGE:
+        case MSP_SET_CF_SERIAL_CONFIG:
+        case MSP_SET_VOLTAGE_METER_CONFIG:
+        case MSP_SET_PID_CONTROLLER:
+        case MSP_SET_ARMING_CONFIG:
+        case MSP_SET_RX_MAP:
+        case MSP_SET_BF_CONFIG:
+        case MSP_REBOOT:
+        case MSP_DATAFLASH_ERASE:
+        case MSP_SET_LOOP_TIME:
+        case MSP_SET_FAILSAFE_CONFIG:
+        case MSP_SET_RXFAIL_CONFIG:
+        case MSP_SET_BLACKBOX_CONFIG:
+        case MSP_SET_TRANSPONDER_CONFIG:
+        case MSP_SET_OSD_CONFIG:
+        case MSP_OSD_CHAR_WRITE:
+        case MSP_SET_VTX_CONFIG:
+        case MSP_SET_PID_ADVANCED_CONFIG:
+        case MSP_SET_FILTER_CONFIG:
+        case MSP_SET_ADVANCED_TUNING:
+        case MSP_SET_SENSOR_CONFIG:
+        case MSP_SET_SPECIAL_PARAMETERS:
+        case MSP_SET_OSD_VIDEO_CONFIG:
+        case MSP_SET_OSD_LAYOUT_CONFIG:
+        case MSP_SET_RAW_RC:
+        case MSP_SET_RAW_GPS:
+        case MSP_SET_PID:
+        case MSP_SET_BOX:
+        case MSP_SET_RC_TUNING:
+        case MSP_ACC_CALIBRATION:
+        case MSP_MAG_CALIBRATION:
+        case MSP_SET_MISC:
+        case MSP_RESET_CONF:
+        case MSP_SET_WP:
+        case MSP_SELECT_SETTING:
+        case MSP_SET_HEAD:
+        case MSP_SET_SERVO_CONFIGURATION:
+        case MSP_SET_MOTOR:
+        case MSP_SET_NAV_CONFIG:
+        case MSP_SET_3D:
+        case MSP_SET_RC_DEADBAND:
+        case MSP_SET_RESET_CURR_PID:
+        case MSP_SET_SENSOR_ALIGNMENT:
+        case MSP_SET_LED_STRIP_MODECOLOR:
+        case MSP_SET_PILOT:
+        case MSP_EEPROM_WRITE:
+        case MSP_SET_ACC_TRIM:
+        case MSP_SET_SERVO_MIX_RULE:
+        case MSP_SET_4WAY_IF:
+        case MSP_TELEMETRY_SUBSCRIBE:
+        case MSP_COMPRESSION:
+        case MSP_PASSTHROUGH:
+        case MSP_DISPLAYPORT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+
+// Decides which receive queue a command waits in. Control input is dispatched first so a queued
+// font upload or flash read never delays a stick update by more than the command in progress.
+mspCommandClass_e mspCommandClass(uint8_t cmd)
+{
+    switch (cmd) {
+        case MSP_SET_RAW_RC:
+        case MSP_SET_MOTOR:
+        case MSP_SET_HEAD:
+            return MSP_CLASS_CONTROL;
+        case MSP_OSD_CHAR_WRITE:
+        case MSP_DATAFLASH_READ:
+        case MSP_DATAFLASH_ERASE:
+        case MSP_EEPROM_WRITE:
+        case MSP_RESET_CONF:
+        case MSP_ACC_CALIBRATION:
+        case MSP_MAG_CALIBRATION:
+        case MSP_BOXNAMES:
+            return MSP_CLASS_BULK;
+        default:
+            return MSP_CLASS_NORMAL;
+    }
+}
+
+
 int mspProcessCommand(mspPacket_t *command, mspPacket_t *reply)
 {
     // initialize reply by default
     reply->cmd = command->cmd;
 
+    // fixed size replies are validated against the buffer before any handler runs
+    int replySize = mspFixedReplySize(command->cmd);
+    if (replySize != MSP_REPLY_SIZE_UNKNOWN && sbufBytesRemaining(&reply->buf) < replySize) {
+        reply->result = -1;
+        return -1;
+    }
+
+    mspProbe1(handler_entry, command->cmd);
     int status = mspServerCommandHandler(command, reply);
     reply->result = status;
+    mspProbe2(handler_exit, command->cmd, status);
+
+    if (status > 0 && !mspCommandIsReadOnly(command->cmd)) {
+        configGeneration++;                 // any setter may have changed a config reply
+    }
 
     return status;
 }
 
 
-void mspSerialEncode(mspPort_t *msp, mspPacket_t *packet)
+// client side helpers for MSP_CONDITIONAL_READ, hash is mspReplyHash() of the payload the client holds
+void mspConditionalReadSerializeRequest(sbuf_t *dst, uint8_t cmd, uint32_t hash)
+{
+    sbufWriteU8(dst, cmd);
+    sbufWriteU32(dst, hash);
+}
+
+
+// True when reply says the payload of cmd the client holds is still current
+bool mspConditionalReadUnchanged(mspPacket_t *reply, uint8_t cmd)
+{
+    return reply->result >= 0 && reply->cmd == MSP_CONDITIONAL_READ &&
+           sbufBytesRemaining(&reply->buf) == 1 && *reply->buf.ptr == cmd;
+}
+
+
+// client side helpers for MSP_MULTIPLE_MSP
+void mspMultipleMspSerializeRequest(sbuf_t *dst, const uint8_t *cmds, int count)
+{
+    sbufWriteData(dst, cmds, count);
+}
+
+
+// Points each subReplies[i] at its slice of a MSP_MULTIPLE_MSP reply, returns how many entries
+// the server fitted into the frame. Entries beyond that were not answered and must be re-requested.
+int mspMultipleMspSplitReply(mspPacket_t *reply, const uint8_t *cmds, int count, mspPacket_t *subReplies)
+{
+    sbuf_t *src = &reply->buf;
+    int i;
+
+    for (i = 0; i < count && sbufBytesRemaining(src) > 0; i++) {
+        uint8_t len = *src->ptr++;
+        if (len > sbufBytesRemaining(src)) {
+            break;
+        }
+
+        subReplies[i].buf.ptr = src->ptr;
+        subReplies[i].buf.end = src->ptr + len;
+        subReplies[i].cmd = cmds[i];
+        subReplies[i].result = reply->result;
+        src->ptr += len;
+    }
+
+    return i;
+}
+
+
+uint8_t mspSerialReplyDirection(mspPort_t *msp, mspPacket_t *packet)
+{
+    return packet->result < 0 ? '!' : (msp->mode == MSP_MODE_SERVER ? '>' : '<');
+}
+
+
+// Encodes packet into frame. A payload that was built in place at mspFramePayload() is not copied.
+void mspSerialEncodeFrame(mspFrame_t *frame, uint8_t direction, mspPacket_t *packet)
 {
-    //printf("here\n");
-    serialBeginWrite(msp->port);
     int len = sbufBytesRemaining(&packet->buf);
-    uint8_t hdr[] = {'$', 'M', packet->result < 0 ? '!' : (msp->mode == MSP_MODE_SERVER ? '>' : '<'), len, packet->cmd};
+    uint8_t *hdr = frame->data;
+    uint8_t *payload = mspFramePayload(frame);
     uint8_t csum = 0;                                       // initial checksum value
-    serialWriteBuf(msp->port, hdr, sizeof(hdr));
-    csum = mspSerialChecksumBuf(csum, hdr + 3, 2);          // checksum starts from len field
+
+    hdr[0] = '$';
+    hdr[1] = 'M';
+    hdr[2] = direction;
+    hdr[3] = len;
+    hdr[4] = packet->cmd;
+    csum = mspSerialChecksum(csum, hdr[3]);                 // checksum starts from len field
+    csum = mspSerialChecksum(csum, hdr[4]);
     if(len > 0) {
-        serialWriteBuf(msp->port, sbufPtr(&packet->buf), len);
-        csum = mspSerialChecksumBuf(csum, sbufPtr(&packet->buf), len);
+        if (sbufPtr(&packet->buf) != payload) {
+            csum = mspChecksumCopy(csum, payload, sbufPtr(&packet->buf), len);
+        } else {
+            csum = mspSerialChecksumBuf(csum, payload, len);
+        }
         //printf("checksum:%d\n",csum);
     }
-    serialWrite(msp->port, csum);
-    serialEndWrite(msp->port);
+    payload[len] = csum;
+    frame->length = MSP_FRAME_HEADER_SIZE + len + 1;
+    frame->traceEncodedUs = mspTraceNow();
+}
+
+
+/*
+ * Frame submission.
+ *
+ * Any thread may submit whole encoded frames to a port, one bounded lock-free queue per priority
+ * class (Vyukov style, each slot carries a sequence number). A single drainer, the msp loop,
+ * writes them out; a frame that has started is always finished before the next one so frames
+ * never interleave, and between frames the highest priority class with work goes first.
+ */
+void mspSerialInitTxQueues(mspPort_t *msp)
+{
+    int priority;
+    uint32_t i;
+
+    for (priority = 0; priority < MSP_TX_PRIORITY_COUNT; priority++) {
+        mspTxQueue_t *queue = &msp->txQueues[priority];
+        for (i = 0; i < MSP_PORT_TX_QUEUE_SIZE; i++) {
+            atomic_store(&queue->slots[i].sequence, i);
+        }
+        atomic_store(&queue->tail, 0);
+        queue->head = 0;
+    }
+    msp->txCurrent = NULL;
+    msp->txFrameOffset = 0;
+}
+
+
+bool mspSerialTxQueueFull(mspPort_t *msp, mspTxPriority_e priority)
+{
+    mspTxQueue_t *queue = &msp->txQueues[priority];
+    uint32_t tail = atomic_load(&queue->tail);
+
+    return (int32_t)(atomic_load(&queue->slots[tail % MSP_PORT_TX_QUEUE_SIZE].sequence) - tail) < 0;
+}
+
+
+// takes its own reference, the caller keeps (and must release) the one it has
+bool mspSerialSubmitFrame(mspPort_t *msp, mspFrame_t *frame, mspTxPriority_e priority)
+{
+    mspTxQueue_t *queue = &msp->txQueues[priority];
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    mspTxQueueSlot_t *slot;
+
+    for (;;) {
+        slot = &queue->slots[tail % MSP_PORT_TX_QUEUE_SIZE];
+        int32_t diff = atomic_load_explicit(&slot->sequence, memory_order_acquire) - tail;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;                                   // full
+        } else {
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    mspFrameRetain(frame);
+    slot->frame = frame;
+    atomic_store_explicit(&slot->sequence, tail + 1, memory_order_release);
+    mspProbe4(tx_enqueue, msp->traceId, frame->data[4], frame->length, priority);
+    return true;
+}
+
+
+static mspFrame_t *mspSerialTakeFrame(mspTxQueue_t *queue)
+{
+    mspTxQueueSlot_t *slot = &queue->slots[queue->head % MSP_PORT_TX_QUEUE_SIZE];
+    mspFrame_t *frame;
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != queue->head + 1) {
+        return NULL;
+    }
+
+    frame = slot->frame;
+    atomic_store_explicit(&slot->sequence, queue->head + MSP_PORT_TX_QUEUE_SIZE, memory_order_release);
+    queue->head++;
+    return frame;
+}
+
+
+static mspFrame_t *mspSerialNextFrame(mspPort_t *msp)
+{
+    int priority;
+    mspFrame_t *frame;
+
+    for (priority = 0; priority < MSP_TX_PRIORITY_COUNT; priority++) {
+        if ((frame = mspSerialTakeFrame(&msp->txQueues[priority]))) {
+            return frame;
+        }
+    }
+    return NULL;
+}
+
+
+// drainer side: writes as much as the port will take without blocking
+void mspSerialFlushTxQueue(mspPort_t *msp)
+{
+    bool writing = false;
+
+    for (;;) {
+        if (!msp->txCurrent && !(msp->txCurrent = mspSerialNextFrame(msp))) {
+            break;
+        }
+
+        mspFrame_t *frame = msp->txCurrent;
+        int remaining = frame->length - msp->txFrameOffset;
+        int chunk = serialTxBytesFree(msp->port);
+
+        if (!chunk) {
+            break;
+        }
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+
+        if (!writing) {
+            serialBeginWrite(msp->port);
+            writing = true;
+        }
+        serialWriteBuf(msp->port, frame->data + msp->txFrameOffset, chunk);
+        msp->txFrameOffset += chunk;
+
+        if (msp->txFrameOffset == frame->length) {
+            mspTraceSpan(MSP_TRACE_SPAN_TX, msp, frame->data[4], frame->traceEncodedUs);
+            mspTraceSpan(MSP_TRACE_SPAN_REQUEST, msp, frame->data[4], frame->traceRequestUs);
+            mspProbe3(tx_complete, msp->traceId, frame->data[4], frame->length);
+            msp->txFrameOffset = 0;
+            msp->txCurrent = NULL;
+            mspFrameRelease(frame);
+        }
+    }
+
+    if (writing) {
+        serialEndWrite(msp->port);
+    }
+}
+
+
+// drainer side only
+void mspSerialDiscardTxQueue(mspPort_t *msp)
+{
+    mspFrame_t *frame;
+
+    if (msp->txCurrent) {
+        mspFrameRelease(msp->txCurrent);
+        msp->txCurrent = NULL;
+    }
+    while ((frame = mspSerialNextFrame(msp))) {
+        mspFrameRelease(frame);
+    }
+    msp->txFrameOffset = 0;
+}
+
+
+// Queues and sends one reply. False when it could not be queued: the pool is exhausted, or the
+// tx queue is still full after flushing what the port takes now.
+bool mspSerialEncode(mspPort_t *msp, mspPacket_t *packet)
+{
+    mspFrame_t *frame = mspFrameAlloc();
+    bool queued;
+
+    if (!frame) {
+        return false;                                       // pool exhausted, counted in the pool stats
+    }
+
+    uint8_t packed[MSP_PORT_OUTBUF_SIZE];
+    mspCompressReply(msp, packet, packed);
+
+    mspSerialEncodeFrame(frame, mspSerialReplyDirection(msp, packet), packet);
+    queued = mspSerialSubmitFrame(msp, frame, MSP_TX_PRIORITY_CONTROL);
+    if (!queued) {
+        mspSerialFlushTxQueue(msp);
+        queued = mspSerialSubmitFrame(msp, frame, MSP_TX_PRIORITY_CONTROL);
+    }
+    mspFrameRelease(frame);
+    mspSerialFlushTxQueue(msp);
+    return queued;
+}
+
+
+static void mspSerialRecordLatency(mspClassLatency_t *latency, uint32_t us)
+{
+    int bucket = us ? 32 - __builtin_clz(us) : 0;           // bucket n holds [2^(n-1), 2^n) microseconds
+
+    latency->histogram[bucket < MSP_LATENCY_BUCKETS ? bucket : MSP_LATENCY_BUCKETS - 1]++;
+    latency->count++;
+    latency->sumUs += us;
+    if (us > latency->maxUs) {
+        latency->maxUs = us;
+    }
+}
+
+
+// upper edge of the bucket holding the given fraction of samples, so it never understates
+uint32_t mspClassLatencyPercentileUs(const mspClassLatency_t *latency, uint32_t permille)
+{
+    uint64_t target = ((uint64_t)latency->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < MSP_LATENCY_BUCKETS - 1; bucket++) {
+        seen += latency->histogram[bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return bucket == MSP_LATENCY_BUCKETS - 1 || (1u << bucket) - 1 > latency->maxUs ? latency->maxUs : (1u << bucket) - 1;
+}
+
+
+void mspSerialReportLatency(void)
+{
+    static const char *classNames[MSP_CLASS_COUNT] = { "control", "normal", "bulk" };
+    int i, c;
+
+    for (i = 0; i < MAX_MSP_PORT_COUNT; i++) {
+        for (c = 0; c < MSP_CLASS_COUNT; c++) {
+            const mspClassLatency_t *latency = &mspPorts[i].classLatency[c];
+            if (!latency->count) {
+                continue;
+            }
+            fprintf(stderr, "port %d %-7s %8u commands  mean %6u us  p50 <%6u us  p99 <%6u us  max %6u us\n",
+                    i, classNames[c], latency->count, (uint32_t)(latency->sumUs / latency->count),
+                    mspClassLatencyPercentileUs(latency, 500), mspClassLatencyPercentileUs(latency, 990), latency->maxUs);
+        }
+    }
+}
+
+
+// Moves the frame the parser just finished into its class queue. Returns false, leaving the
+// parser in MESSAGE_RECEIVED, when that queue is full, which stops reading from the port.
+static bool mspSerialQueueReceivedCommand(mspPort_t *msp)
+{
+    mspRxQueue_t *queue = &msp->rxQueues[mspCommandClass(msp->cmdMSP)];
+    mspRxCommand_t *command;
+
+    if (queue->count == MSP_PORT_RX_QUEUE_SIZE) {
+        return false;
+    }
+
+    command = &queue->commands[(queue->head + queue->count++) % MSP_PORT_RX_QUEUE_SIZE];
+    command->cmd = msp->cmdMSP;
+    command->dataSize = msp->dataSize;
+    memcpy(command->data, msp->inBuf, msp->dataSize);
+    command->receivedUs = micros();
+    command->traceRxStartUs = msp->traceRxStartUs;
+    if (command->cmd == MSP_PASSTHROUGH) {
+        msp->rxHeld = true;                 // what follows may be bridge data, see mspPassthroughProcess()
+    }
+
+    msp->c_state = IDLE;
+    return true;
+}
+
+
+static mspRxQueue_t *mspSerialNextQueuedCommand(mspPort_t *msp)
+{
+    int class;
+
+    for (class = 0; class < MSP_CLASS_COUNT; class++) {
+        if (msp->rxQueues[class].count) {
+            return &msp->rxQueues[class];
+        }
+    }
+    return NULL;
 }
 
 
-void mspSerialProcessReceivedCommand(mspPort_t *msp)
+typedef void (*mspPortCommandFnPtr)(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply);
+
+typedef struct mspPortCommandHook_s {
+    uint8_t cmd;
+    mspPortCommandFnPtr fn;
+} mspPortCommandHook_t;
+
+// Commands that act on the port they arrive on rather than on FC state. They never reach
+// mspProcessCommand(), so MSP_MULTIPLE_MSP cannot batch them, and mspCommandIsReadOnly() lists
+// them so they always run on the main loop.
+static const mspPortCommandHook_t mspPortCommandHooks[] = {
+    { MSP_TELEMETRY_SUBSCRIBE, mspTelemetryProcessCommand },
+    { MSP_COMPRESSION,         mspCompressionProcessCommand },
+    { MSP_PASSTHROUGH,         mspPassthroughProcessCommand },
+    { MSP_DISPLAYPORT,         mspOsdProcessCommand },
+};
+
+
+static mspPortCommandFnPtr mspSerialPortCommand(uint8_t cmd)
 {
-   uint8_t outBuf[MSP_PORT_OUTBUF_SIZE];
+    const mspPortCommandHook_t *hook;
+
+    for (hook = mspPortCommandHooks; hook < ARRAYEND(mspPortCommandHooks); hook++) {
+        if (hook->cmd == cmd) {
+            return hook->fn;
+        }
+    }
+    return NULL;
+}
+
+
+// Runs one dispatched command and encodes its reply into the slot's frame. Called from the main
+// loop, or from a worker thread for commands that only read state.
+void mspSerialExecuteCommand(mspPort_t *msp, mspReplySlot_t *slot)
+{
+    mspRxCommand_t *received = &slot->command;
+    mspFrame_t *frame = slot->frame;
 
     mspPacket_t message = {
         .buf = {
-            .ptr = outBuf,
-            .end = ARRAYEND(outBuf),
+            .ptr = mspFramePayload(frame),
+            .end = mspFramePayload(frame) + MSP_PORT_OUTBUF_SIZE,
         },
         .cmd = -1,
         .result = 0,
@@ -263,32 +955,254 @@ void mspSerialProcessReceivedCommand(mspPort_t *msp)
 
     mspPacket_t command = {
         .buf = {
-            .ptr = msp->inBuf,
-            .end = msp->inBuf + msp->dataSize,
+            .ptr = received->data,
+            .end = received->data + received->dataSize,
         },
-        .cmd = msp->cmdMSP,
+        .cmd = received->cmd,
         .result = 0,
     };
 
     mspPacket_t *reply = &message;
 
     uint8_t *outBufHead = reply->buf.ptr;
-    int status = mspProcessCommand(&command, reply);
+
+    printf("command code: %d\n", command.cmd);  // only what arrived on a port, not internal reads
+
+    uint32_t dispatchStartUs = mspTraceNow();
+    mspPortCommandFnPtr portCommand = mspSerialPortCommand(command.cmd);
+    int status = 1;
+    if (portCommand) {
+        portCommand(msp, &command, reply);      // sets reply->result, an error still gets its reply frame
+    } else {
+        status = mspProcessCommand(&command, reply);
+    }
+    mspTraceSpan(MSP_TRACE_SPAN_DISPATCH, msp, received->cmd, dispatchStartUs);
+
+    frame->traceRequestUs = received->traceRxStartUs;
+    slot->status = status;
 
     if (status) {
         //printf("Command code: %d\nWriting to PC\n",command.cmd);
         //printf("Command code: %d\n",command.cmd);
         // reply should be sent back
         sbufSwitchToReader(&reply->buf, outBufHead); // change streambuf direction
-        mspSerialEncode(msp, reply);
+        uint8_t packed[MSP_PORT_OUTBUF_SIZE];
+        mspCompressReply(msp, reply, packed);
+        mspSerialEncodeFrame(frame, mspSerialReplyDirection(msp, reply), reply);
+    }
+}
+
+
+// Takes the next reply slot and runs the command, on a worker when one is free to take it and the
+// command has no side effects. A command with side effects first waits for every command already
+// running on any port, so it never overlaps a read. Returns the request bytes spent or -1.
+static int mspSerialProcessReceivedCommand(mspPort_t *msp, mspRxCommand_t *received)
+{
+    if (msp->replySeqNext - msp->replySeqEmit == MSP_PORT_REPLY_WINDOW || mspSerialTxQueueFull(msp, MSP_TX_PRIORITY_CONTROL)) {
+        return -1;
+    }
+
+    mspFrame_t *frame = mspFrameAlloc();
+    if (!frame) {
+        return -1;
+    }
+
+    mspReplySlot_t *slot = &msp->replySlots[msp->replySeqNext++ % MSP_PORT_REPLY_WINDOW];
+    slot->command = *received;
+    slot->frame = frame;
+    atomic_store_explicit(&slot->done, false, memory_order_relaxed);
+
+    msp->lastActivityAt = millis();
+
+    if (!mspCommandIsReadOnly(received->cmd) || !mspWorkersSubmit(msp, slot)) {
+        mspWorkersWaitIdle();
+        mspSerialExecuteCommand(msp, slot);
+        atomic_store_explicit(&slot->done, true, memory_order_relaxed);
+    }
+
+    return received->dataSize + MSP_V1_FRAME_OVERHEAD;
+}
+
+
+// Queues finished replies in dispatch order, so workers finishing early never reorder them. That is
+// request order within a class only: mspSerialDispatchCommands() takes control commands ahead of
+// queued normal and bulk ones, and clients match replies by command. A reply that finished early
+// waits in its slot for the ones dispatched before it.
+static void mspSerialEmitReplies(mspPort_t *msp)
+{
+    while (msp->replySeqEmit != msp->replySeqNext) {
+        mspReplySlot_t *slot = &msp->replySlots[msp->replySeqEmit % MSP_PORT_REPLY_WINDOW];
+
+        if (!atomic_load_explicit(&slot->done, memory_order_acquire)) {
+            return;
+        }
+        if (slot->status) {
+            if (!mspSerialSubmitFrame(msp, slot->frame, MSP_TX_PRIORITY_CONTROL)) {
+                return;                                     // tx queue full, retried next round
+            }
+            msp->schedDeficit -= slot->frame->length;
+        }
+
+        mspSerialRecordLatency(&msp->classLatency[mspCommandClass(slot->command.cmd)], micros() - slot->command.receivedUs);
+        mspFrameRelease(slot->frame);
+        msp->replySeqEmit++;
     }
+}
+
+
+// Deficit round-robin: every round a port earns its quantum of bytes and spends it on queued
+// commands, highest class first. Control commands are never held back by the budget.
+static void mspSerialDispatchCommands(mspPort_t *msp)
+{
+    mspRxQueue_t *queue;
+
+    msp->schedDeficit += MSP_SCHED_QUANTUM_BYTES * msp->schedWeight;
+
+    while ((queue = mspSerialNextQueuedCommand(msp))) {
+        bool control = queue == &msp->rxQueues[MSP_CLASS_CONTROL];
+        int cost;
+
+        if (msp->schedDeficit <= 0 && !control) {
+            return;                                         // out of credit, the rest waits a round
+        }
+        if ((cost = mspSerialProcessReceivedCommand(msp, &queue->commands[queue->head])) < 0) {
+            return;
+        }
+        queue->head = (queue->head + 1) % MSP_PORT_RX_QUEUE_SIZE;
+        queue->count--;
+        msp->schedDeficit -= cost;
+        mspSerialEmitReplies(msp);
+    }
+
+    // an idle port does not bank credit for a later burst
+    msp->schedDeficit = 0;
+}
+
+
+
+void mspSerialProcessReceivedReply(mspPort_t *msp)
+{
+    mspPacket_t reply = {
+        .buf = {
+            .ptr = msp->inBuf,
+            .end = msp->inBuf + msp->dataSize,
+        },
+        .cmd = msp->cmdMSP,
+        .result = msp->direction == '!' ? -1 : 0,
+    };
+    uint8_t unpacked[MSP_PORT_INBUF_SIZE];
+
+    // a corrupt compressed reply is treated like one that never arrived
+    if (reply.cmd == MSP_COMPRESSED && !mspDecompressReply(&reply, unpacked)) {
+        msp->c_state = IDLE;
+        return;
+    }
+
+    if (msp->replyHandlerFn) {
+        msp->replyHandlerFn(&reply);
+    }
+
+    msp->c_state = IDLE;
+}
+
+
+
+// a client also takes '!', the server's way of saying it does not know or rejected a command
+static bool mspSerialDirectionAccepted(mspPort_t *msp, uint8_t direction)
+{
+    return msp->mode == MSP_MODE_SERVER ? direction == '<' : (direction == '>' || direction == '!');
+}
+
+
+// Could a frame start at bytes[0]? Whatever of the header is present must be valid, and when the
+// whole frame is present its checksum must match too.
+static bool mspSerialPlausibleFrameStart(mspPort_t *msp, const uint8_t *bytes, int len)
+{
+    if (bytes[0] != '$') {
+        return false;
+    }
+    if (len > 1 && bytes[1] != 'M') {
+        return false;
+    }
+    if (len > 2 && !mspSerialDirectionAccepted(msp, bytes[2])) {
+        return false;
+    }
+    if (len > 3 && len >= 6 + bytes[3]) {
+        uint8_t checksum = mspSerialChecksumBuf(0, (uint8_t *)bytes + 3, 2 + bytes[3]);
+        return checksum == bytes[5 + bytes[3]];
+    }
+    return true;
+}
+
+
+// Everything the failed frame consumed after its '$', rebuilt from parser state, c is the byte that failed it.
+static int mspSerialFailedFrameBytes(mspPort_t *msp, uint8_t c, uint8_t *bytes)
+{
+    int n = 0;
+
+    if (msp->c_state != HEADER_M) {
+        bytes[n++] = 'M';
+    }
+    if (msp->c_state == HEADER_SIZE || msp->c_state == HEADER_DATA) {
+        bytes[n++] = msp->direction;
+    }
+    if (msp->c_state == HEADER_DATA) {
+        bytes[n++] = msp->dataSize;
+        bytes[n++] = msp->cmdMSP;
+        memcpy(bytes + n, msp->inBuf, msp->dataSize);
+        n += msp->dataSize;
+    }
+    bytes[n++] = c;
+    return n;
+}
+
+
+/*
+ * Called instead of going straight back to IDLE when a frame fails. The bytes it swallowed are
+ * rescanned for the next plausible frame start, which would otherwise be lost if it began inside
+ * the corrupted frame. Candidates are checked against the buffered bytes only, nothing is re-read
+ * from the port; mspSerialProcessResyncBytes() then feeds them back through the parser.
+ */
+static void mspSerialResync(mspPort_t *msp, uint8_t c)
+{
+    uint8_t bytes[MSP_PORT_RESYNC_BUF_SIZE];
+    int n = mspSerialFailedFrameBytes(msp, c, bytes);
+    int remaining = msp->resyncLen - msp->resyncPos;
+    int start;
+
+    // a failure while replaying keeps the unreplayed tail behind the rebuilt bytes, both came from
+    // the same buffer so they still fit
+    if (n + remaining > MSP_PORT_RESYNC_BUF_SIZE) {
+        remaining = MSP_PORT_RESYNC_BUF_SIZE - n;
+    }
+    memcpy(bytes + n, msp->resyncBuf + msp->resyncPos, remaining);
+    n += remaining;
+
+    for (start = 0; start < n && !mspSerialPlausibleFrameStart(msp, bytes + start, n - start); start++);
 
     msp->c_state = IDLE;
+    msp->parserStats.resyncs++;
+    msp->parserStats.bytesDropped += 1 + start;            // the failed frame's '$' and everything up to the candidate
+
+    memcpy(msp->resyncBuf, bytes + start, n - start);
+    msp->resyncPos = 0;
+    msp->resyncLen = n - start;
 }
 
 
+// Replays rescanned bytes, stops early when they complete a frame so it can be dispatched first.
+void mspSerialProcessResyncBytes(mspPort_t *msp)
+{
+    while (msp->resyncPos < msp->resyncLen && msp->c_state != MESSAGE_RECEIVED) {
+        mspSerialProcessReceivedByte(msp, msp->resyncBuf[msp->resyncPos++]);
+    }
+    if (msp->resyncPos == msp->resyncLen) {
+        msp->resyncPos = msp->resyncLen = 0;
+    }
+}
+
 
-static bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c)
+bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c)
 {
     //printf("char:%c\tstate:%d\n",c,msp->c_state);
     switch(msp->c_state) {
@@ -298,42 +1212,40 @@ static bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c)
             {
                 if(c == 'M')
                 {
+                    msp->traceRxStartUs = mspTraceNow();
+                    mspProbe1(frame_start, msp->traceId);
                     msp->c_state = HEADER_M;
                     mspSerialProcessReceivedByte(msp, 'M');
                     return true;                   
                 }
+                msp->parserStats.bytesDropped++;
                 return false;
             }
+            msp->traceRxStartUs = mspTraceNow();
+            mspProbe1(frame_start, msp->traceId);
             msp->c_state = HEADER_M;
             break;
         case HEADER_M:
-            msp->c_state = (c == 'M') ? HEADER_ARROW : IDLE;
+            if (c == 'M') {
+                msp->c_state = HEADER_ARROW;
+            } else {
+                msp->parserStats.framingErrors++;
+                mspSerialResync(msp, c);
+            }
             break;
         case HEADER_ARROW:
-            msp->c_state = HEADER_ARROW;
-            switch(c) {
-                case '<': // COMMAND
-                    if (msp->mode == MSP_MODE_SERVER) {
-                        msp->c_state = HEADER_SIZE;
-                    }
-                    break;
-                case '>': // REPLY
-                    if (msp->mode == MSP_MODE_CLIENT) {
-                        msp->c_state = HEADER_SIZE;
-                    }
-                    break;
-                default:
-                    break;
+            if (mspSerialDirectionAccepted(msp, c)) {
+                msp->direction = c;
+                msp->c_state = HEADER_SIZE;
+            } else {
+                msp->parserStats.framingErrors++;
+                mspSerialResync(msp, c);
             }
             break;
         case HEADER_SIZE:
-            if (c > MSP_PORT_INBUF_SIZE) {
-                msp->c_state = IDLE;
-            } else {
-                msp->dataSize = c;
-                msp->offset = 0;
-                msp->c_state = HEADER_CMD;
-            }
+            msp->dataSize = c;                  // inBuf takes any size byte
+            msp->offset = 0;
+            msp->c_state = HEADER_CMD;
             break;
         case HEADER_CMD:
             msp->cmdMSP = c;
@@ -350,11 +1262,17 @@ static bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c)
                 //printf("c:%d\tchecksum:%d\n",c,checksum);
                 if(c == checksum)
                 {
+                    mspTraceSpan(MSP_TRACE_SPAN_RX, msp, msp->cmdMSP, msp->traceRxStartUs);
+                    mspProbe3(frame_valid, msp->traceId, msp->cmdMSP, msp->dataSize);
                     msp->c_state = MESSAGE_RECEIVED;
                     //printf("processing received command\n");
                 }
                 else
-                    msp->c_state = IDLE;
+                {
+                    msp->parserStats.checksumErrors++;
+                    mspProbe3(checksum_error, msp->traceId, msp->cmdMSP, msp->dataSize);
+                    mspSerialResync(msp, c);
+                }
             }
             break;
     }
@@ -363,19 +1281,81 @@ static bool mspSerialProcessReceivedByte(mspPort_t *msp, uint8_t c)
 
 
 
+// Reads commands into the class queues until one of them is full or the port has nothing more.
+static void mspSerialReceiveCommands(mspPort_t *msp)
+{
+    uint32_t dueMs = mspTelemetryTimeUntilDueMs(msp);
+    uint32_t osdDueMs = mspOsdTimeUntilDueMs(msp);
+
+    if (osdDueMs < dueMs) {
+        dueMs = osdDueMs;
+    }
+    usbSetRxWaitTimeout(dueMs < SELECT_TIMEOUT_US / 1000 ? dueMs * 1000 : SELECT_TIMEOUT_US);
+
+    while (!msp->rxHeld) {
+        // bytes left over from a failed frame are parsed before anything new is read
+        mspSerialProcessResyncBytes(msp);
+
+        if (msp->c_state == MESSAGE_RECEIVED) {
+            if (!mspSerialQueueReceivedCommand(msp)) {
+                return;
+            }
+            usbSetRxWaitTimeout(0);                         // work is queued, do not sleep on the port
+            continue;
+        }
+
+        if (!serialRxBytesWaiting(msp->port)) {
+            return;
+        }
+        mspSerialProcessReceivedByte(msp, serialRead(msp->port));
+    }
+}
+
+
 void mspSerialProcess(void)
 {
-    int* fd;
+    static uint8_t roundStart;
     int flag = 0;
-    int i;
+    int n;
     //printf("Processing\n");
-    for (i = 0; i < MAX_MSP_PORT_COUNT; i++) {
-        mspPort_t *msp = &mspPorts[i];
+    // the starting port rotates so no port is always served first
+    roundStart = (roundStart + 1) % MAX_MSP_PORT_COUNT;
+
+    mspWorkersCollect();
+
+    for (n = 0; n < MAX_MSP_PORT_COUNT; n++) {
+        mspPort_t *msp = &mspPorts[(roundStart + n) % MAX_MSP_PORT_COUNT];
         if (!msp->port) {
             continue;
         }
-        uint8_t bytesWaiting;
-        while ((bytesWaiting = serialRxBytesWaiting(msp->port))) {
+        uint8_t bytesWaiting = 0;
+
+        mspSerialFlushTxQueue(msp);
+
+        if (msp->mode == MSP_MODE_SERVER) {
+            mspSerialEmitReplies(msp);
+            mspSerialReceiveCommands(msp);
+            mspSerialDispatchCommands(msp);
+            mspTelemetryProcess(msp);
+            mspOsdProcess(msp);
+            mspSerialFlushTxQueue(msp);
+            mspPassthroughProcess(msp);
+            continue;
+        }
+
+        if (msp->c_state == MESSAGE_RECEIVED) {
+            continue;
+        }
+
+        // client mode: a request waiting to go out must not sit behind a wait for replies, nor
+        // may the wait outlast the next recorder poll
+        uint32_t dueMs = msp->commandSenderFn ? 0 : mspRecorderTimeUntilDueMs(msp);
+        usbSetRxWaitTimeout(dueMs < SELECT_TIMEOUT_US / 1000 ? dueMs * 1000 : SELECT_TIMEOUT_US);
+
+        // bytes left over from a failed frame are parsed before anything new is read
+        mspSerialProcessResyncBytes(msp);
+
+        while (msp->c_state != MESSAGE_RECEIVED && (bytesWaiting = serialRxBytesWaiting(msp->port))) {
             flag = 1;
             uint8_t c = serialRead(msp->port);
             bool consumed = mspSerialProcessReceivedByte(msp, c);
@@ -384,13 +1364,12 @@ void mspSerialProcess(void)
                 evaluateOtherData(msp->port, c);
             }*/
 
-            if (msp->c_state == MESSAGE_RECEIVED) {
-            	if (msp->mode == MSP_MODE_SERVER) {
-            		mspSerialProcessReceivedCommand(msp);
-            	}
+            mspSerialProcessResyncBytes(msp);
+        }
 
-                break; // process one command at a time so as not to block and handle modal command immediately
-            }
+        if (msp->c_state == MESSAGE_RECEIVED) {
+            mspSerialProcessReceivedReply(msp);
+            // process one reply at a time so as not to block and handle modal command immediately
         }
 
         if(flag == 1)
@@ -401,12 +1380,12 @@ void mspSerialProcess(void)
 
         // TODO consider extracting this outside the loop and create a new loop in mspClientProcess and rename mspProcess to mspServerProcess
         //for msp client
-        if (msp->c_state == IDLE && msp->commandSenderFn && !bytesWaiting) {
-            uint8_t outBuf[MSP_PORT_OUTBUF_SIZE];
+        mspFrame_t *frame;
+        if (msp->c_state == IDLE && msp->commandSenderFn && !bytesWaiting && !mspSerialTxQueueFull(msp, MSP_TX_PRIORITY_CONTROL) && (frame = mspFrameAlloc())) {
             mspPacket_t message = {
                 .buf = {
-                    .ptr = outBuf,
-                    .end = ARRAYEND(outBuf),
+                    .ptr = mspFramePayload(frame),
+                    .end = mspFramePayload(frame) + MSP_PORT_OUTBUF_SIZE,
                 },
                 .cmd = -1,
                 .result = 0,
@@ -421,21 +1400,27 @@ void mspSerialProcess(void)
             if (shouldSend) {
                 sbufSwitchToReader(&command->buf, outBufHead); // change streambuf direction
 
-                mspSerialEncode(msp, command);
+                mspSerialEncodeFrame(frame, mspSerialReplyDirection(msp, command), command);
+                mspSerialSubmitFrame(msp, frame, MSP_TX_PRIORITY_CONTROL);
             }
 
+            mspFrameRelease(frame);
             msp->commandSenderFn = NULL;
         }
 
-        fd = (int*)((void*)mspPorts[0].port + sizeof(serialPort_t));
-        tcflush(*fd,TCIOFLUSH);
+        mspSerialFlushTxQueue(msp);
     }
 }
 
 
 void resetMspPort(mspPort_t *mspPortToReset, serialPort_t *serialPort)
 {
+    static atomic_ushort nextTraceId;
+
     memset(mspPortToReset, 0, sizeof(mspPort_t));
+    mspSerialInitTxQueues(mspPortToReset);
 
+    mspPortToReset->traceId = atomic_fetch_add(&nextTraceId, 1) + 1;
     mspPortToReset->port = serialPort;
+    mspPortToReset->schedWeight = 1;
 }
\ No newline at end of file
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "msp_ahrs.h"
+
+#define MSP_AHRS_QUEUE_MASK (MSP_AHRS_QUEUE_SIZE - 1)
+#define MSP_AHRS_AXES 9                         // gyro xyz, acc xyz, mag xyz
+#define MSP_AHRS_DEG_TO_RAD 0.017453292519943295f
+#define MSP_AHRS_RAD_TO_DEG 57.29577951308232f
+
+#define MSP_IMU_SIM_MAG_INCLINATION_DEG 60.0f
+#define MSP_IMU_SIM_MAG_LSB 1000.0f             // per unit of field, only the direction matters
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one array per axis, so a batch converts with plain loops over contiguous memory
+static int16_t queue[MSP_AHRS_AXES][MSP_AHRS_QUEUE_SIZE];
+static uint64_t queueHead;                      // sequence number of the next sample
+static mspImuReadFnPtr readSource;
+static float samplePeriod = 0.001f;
+
+static float batch[MSP_AHRS_AXES][MSP_AHRS_BATCH];
+
+static float q[4] = { 1, 0, 0, 0 };             // body to earth
+static float integralFeedback[3];
+static bool seeded;
+static uint64_t fusedSeq;                       // samples before this one are in q
+static mspAhrsAttitude_t cached;                // q as of fusedSeq
+
+static mspAhrsStats_t stats;
+
+static uint32_t simRateHz;
+static uint32_t simLastUs;
+static uint64_t simElapsedUs;
+static uint64_t simNext;
+
+
+void mspAhrsStart(uint32_t sampleRateHz, mspImuReadFnPtr source)
+{
+    pthread_mutex_lock(&lock);
+    samplePeriod = 1.0f / (sampleRateHz ? sampleRateHz : 1000);
+    readSource = source;
+    pthread_mutex_unlock(&lock);
+}
+
+
+// lock held
+static void mspAhrsQueueSamples(const mspImuSample_t *samples, uint32_t count)
+{
+    uint32_t i;
+    int axis;
+
+    for (i = 0; i < count; i++) {
+        uint32_t slot = (queueHead + i) & MSP_AHRS_QUEUE_MASK;
+        for (axis = 0; axis < 3; axis++) {
+            queue[axis][slot] = samples[i].gyro[axis];
+            queue[3 + axis][slot] = samples[i].acc[axis];
+            queue[6 + axis][slot] = samples[i].mag[axis];
+        }
+    }
+    queueHead += count;
+    stats.samples += count;
+}
+
+
+void mspAhrsPushSamples(const mspImuSample_t *samples, uint32_t count)
+{
+    pthread_mutex_lock(&lock);
+    mspAhrsQueueSamples(samples, count);
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void mspAhrsDrainSource(void)
+{
+    mspImuSample_t samples[MSP_AHRS_BATCH];
+    uint32_t count;
+
+    if (!readSource) {
+        return;
+    }
+    do {
+        count = readSource(samples, ARRAYLEN(samples));
+        mspAhrsQueueSamples(samples, count);
+    } while (count == ARRAYLEN(samples));
+}
+
+
+static void mspAhrsEulerToQuaternion(float roll, float pitch, float yaw, float *out)
+{
+    float cr = cosf(roll / 2), sr = sinf(roll / 2);
+    float cp = cosf(pitch / 2), sp = sinf(pitch / 2);
+    float cy = cosf(yaw / 2), sy = sinf(yaw / 2);
+
+    out[0] = cr * cp * cy + sr * sp * sy;
+    out[1] = sr * cp * cy - cr * sp * sy;
+    out[2] = cr * sp * cy + sr * cp * sy;
+    out[3] = cr * cp * sy - sr * sp * cy;
+}
+
+
+// restarts the estimate from the gravity and magnetic field directions of one sample
+static void mspAhrsSeed(uint64_t seq)
+{
+    uint32_t slot = seq & MSP_AHRS_QUEUE_MASK;
+    float ax = queue[3][slot], ay = queue[4][slot], az = queue[5][slot];
+    float mx = queue[6][slot], my = queue[7][slot], mz = queue[8][slot];
+    float roll = atan2f(ay, az);
+    float pitch = atan2f(-ax, sqrtf(ay * ay + az * az));
+    float yaw = 0;
+
+    if (mx || my || mz) {
+        float horizontalX = cosf(pitch) * mx + sinf(pitch) * (sinf(roll) * my + cosf(roll) * mz);
+        float horizontalY = cosf(roll) * my - sinf(roll) * mz;
+        yaw = atan2f(-horizontalY, horizontalX);
+    }
+    mspAhrsEulerToQuaternion(roll, pitch, yaw, q);
+    memset(integralFeedback, 0, sizeof(integralFeedback));
+    seeded = true;
+}
+
+
+// converts samples [seq, seq + count) to rad/s and unit vectors, count never crosses the end of the queue
+static void mspAhrsConvertBatch(uint64_t seq, uint32_t count)
+{
+    const uint32_t start = seq & MSP_AHRS_QUEUE_MASK;
+    const float gyroScale = MSP_AHRS_DEG_TO_RAD / MSP_IMU_GYRO_LSB_PER_DPS;
+    uint32_t i;
+    int axis;
+
+    for (axis = 0; axis < 3; axis++) {
+        const int16_t *raw = &queue[axis][start];
+        float *out = batch[axis];
+        for (i = 0; i < count; i++) {
+            out[i] = raw[i] * gyroScale;
+        }
+    }
+    for (axis = 3; axis < MSP_AHRS_AXES; axis++) {
+        const int16_t *raw = &queue[axis][start];
+        float *out = batch[axis];
+        for (i = 0; i < count; i++) {
+            out[i] = raw[i];
+        }
+    }
+
+    // a zero vector stays zero and then contributes no correction, so a missing mag needs no branch
+    for (axis = 3; axis < MSP_AHRS_AXES; axis += 3) {
+        float *x = batch[axis], *y = batch[axis + 1], *z = batch[axis + 2];
+        for (i = 0; i < count; i++) {
+            float norm = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+            float recip = norm > 0 ? 1.0f / sqrtf(norm) : 0;
+            x[i] *= recip;
+            y[i] *= recip;
+            z[i] *= recip;
+        }
+    }
+}
+
+
+// one Mahony step, a and m already normalised
+static void mspAhrsMahonyUpdate(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    float q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+    float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+    float q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+    // measured field in the earth frame, its horizontal part taken as north, then back in the body frame
+    float hx = 2 * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+    float hy = 2 * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+    float bx = sqrtf(hx * hx + hy * hy);
+    float bz = 2 * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+    float halfWx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+    float halfWy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+    float halfWz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+    // expected direction of gravity
+    float halfVx = q1q3 - q0q2;
+    float halfVy = q0q1 + q2q3;
+    float halfVz = q0q0 - 0.5f + q3q3;
+
+    float halfEx = (ay * halfVz - az * halfVy) + (my * halfWz - mz * halfWy);
+    float halfEy = (az * halfVx - ax * halfVz) + (mz * halfWx - mx * halfWz);
+    float halfEz = (ax * halfVy - ay * halfVx) + (mx * halfWy - my * halfWx);
+
+    if (MSP_AHRS_DEFAULT_KI > 0) {
+        integralFeedback[0] += 2 * MSP_AHRS_DEFAULT_KI * halfEx * samplePeriod;
+        integralFeedback[1] += 2 * MSP_AHRS_DEFAULT_KI * halfEy * samplePeriod;
+        integralFeedback[2] += 2 * MSP_AHRS_DEFAULT_KI * halfEz * samplePeriod;
+        gx += integralFeedback[0];
+        gy += integralFeedback[1];
+        gz += integralFeedback[2];
+    }
+    gx = (gx + 2 * MSP_AHRS_DEFAULT_KP * halfEx) * 0.5f * samplePeriod;
+    gy = (gy + 2 * MSP_AHRS_DEFAULT_KP * halfEy) * 0.5f * samplePeriod;
+    gz = (gz + 2 * MSP_AHRS_DEFAULT_KP * halfEz) * 0.5f * samplePeriod;
+
+    q0 += -q[1] * gx - q[2] * gy - q[3] * gz;
+    q1 += q[0] * gx + q[2] * gz - q[3] * gy;
+    q2 += q[0] * gy - q[1] * gz + q[3] * gx;
+    q3 += q[0] * gz + q[1] * gy - q[2] * gx;
+
+    float recip = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q[0] = q0 * recip;
+    q[1] = q1 * recip;
+    q[2] = q2 * recip;
+    q[3] = q3 * recip;
+}
+
+
+static void mspAhrsUpdateCache(void)
+{
+    float roll = atan2f(q[0] * q[1] + q[2] * q[3], 0.5f - q[1] * q[1] - q[2] * q[2]);
+    float sinPitch = 2 * (q[0] * q[2] - q[1] * q[3]);
+    float pitch = asinf(sinPitch > 1 ? 1 : sinPitch < -1 ? -1 : sinPitch);
+    float yaw = atan2f(q[1] * q[2] + q[0] * q[3], 0.5f - q[2] * q[2] - q[3] * q[3]);
+    int heading = (int)lrintf(-yaw * MSP_AHRS_RAD_TO_DEG);  // yaw turns anticlockwise about z up
+
+    cached.roll = lrintf(roll * MSP_AHRS_RAD_TO_DEG * 10);
+    cached.pitch = lrintf(pitch * MSP_AHRS_RAD_TO_DEG * 10);
+    cached.heading = (heading % 360 + 360) % 360;
+}
+
+
+// lock held, integrates every sample that came in since the last request
+static void mspAhrsFuse(void)
+{
+    struct timespec started, finished;
+    uint32_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (!seeded || queueHead - fusedSeq > MSP_AHRS_MAX_CATCHUP) {
+        uint64_t from = queueHead > MSP_AHRS_MAX_CATCHUP ? queueHead - MSP_AHRS_MAX_CATCHUP : 0;
+        stats.skipped += from - fusedSeq;
+        stats.reseeds++;
+        mspAhrsSeed(from);
+        fusedSeq = from;
+    }
+
+    while (fusedSeq < queueHead) {
+        uint32_t count = queueHead - fusedSeq;
+        uint32_t untilEnd = MSP_AHRS_QUEUE_SIZE - (fusedSeq & MSP_AHRS_QUEUE_MASK);
+
+        count = count < MSP_AHRS_BATCH ? count : MSP_AHRS_BATCH;
+        count = count < untilEnd ? count : untilEnd;
+        mspAhrsConvertBatch(fusedSeq, count);
+        for (i = 0; i < count; i++) {
+            mspAhrsMahonyUpdate(batch[0][i], batch[1][i], batch[2][i], batch[3][i], batch[4][i], batch[5][i],
+                                batch[6][i], batch[7][i], batch[8][i]);
+        }
+        fusedSeq += count;
+        stats.fused += count;
+    }
+    mspAhrsUpdateCache();
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats.fusions++;
+    stats.fusionNs += (finished.tv_sec - started.tv_sec) * 1000000000LL + finished.tv_nsec - started.tv_nsec;
+}
+
+
+void mspAhrsGetAttitude(mspAhrsAttitude_t *attitude)
+{
+    pthread_mutex_lock(&lock);
+    stats.requests++;
+    mspAhrsDrainSource();
+    if (fusedSeq != queueHead) {
+        mspAhrsFuse();
+    }
+    *attitude = cached;
+    pthread_mutex_unlock(&lock);
+}
+
+
+bool mspAhrsGetLatestSample(mspImuSample_t *sample)
+{
+    bool available;
+    int axis;
+
+    pthread_mutex_lock(&lock);
+    mspAhrsDrainSource();
+    available = queueHead > 0;
+    if (available) {
+        uint32_t slot = (queueHead - 1) & MSP_AHRS_QUEUE_MASK;
+        for (axis = 0; axis < 3; axis++) {
+            sample->gyro[axis] = queue[axis][slot];
+            sample->acc[axis] = queue[3 + axis][slot];
+            sample->mag[axis] = queue[6 + axis][slot];
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return available;
+}
+
+
+const mspAhrsStats_t *mspAhrsGetStats(void)
+{
+    return &stats;
+}
+
+
+void mspAhrsReport(void)
+{
+    if (!stats.samples) {
+        return;
+    }
+    fprintf(stderr, "ahrs %llu samples, %llu fused in %llu runs for %llu requests, %llu skipped in %llu reseeds, %.0f ns per fused sample\n",
+            (unsigned long long)stats.samples, (unsigned long long)stats.fused, (unsigned long long)stats.fusions,
+            (unsigned long long)stats.requests, (unsigned long long)stats.skipped, (unsigned long long)stats.reseeds,
+            stats.fused ? (double)stats.fusionNs / stats.fused : 0.0);
+}
+
+
+void mspImuSimStart(uint32_t sampleRateHz)
+{
+    simRateHz = sampleRateHz;
+    simLastUs = micros();
+    simElapsedUs = 0;
+    simNext = 0;
+}
+
+
+// rolls +-30 degrees, pitches +-15 degrees and turns right at 20 degrees a second
+void mspImuSimSample(uint64_t n, mspImuSample_t *sample, float *rollDeg, float *pitchDeg, float *headingDeg)
+{
+    const float inclination = MSP_IMU_SIM_MAG_INCLINATION_DEG * MSP_AHRS_DEG_TO_RAD;
+    const float earthMag[3] = { cosf(inclination), 0, -sinf(inclination) };
+    const float earthUp[3] = { 0, 0, 1 };
+    double t = (double)n / (simRateHz ? simRateHz : 1000);
+    float roll = 30 * MSP_AHRS_DEG_TO_RAD * sin(0.5 * t);
+    float pitch = 15 * MSP_AHRS_DEG_TO_RAD * sin(0.3 * t);
+    float heading = fmod(20 * t, 360);
+    float yaw = -heading * MSP_AHRS_DEG_TO_RAD;
+    float rollRate = 30 * MSP_AHRS_DEG_TO_RAD * 0.5 * cos(0.5 * t);
+    float pitchRate = 15 * MSP_AHRS_DEG_TO_RAD * 0.3 * cos(0.3 * t);
+    float yawRate = -20 * MSP_AHRS_DEG_TO_RAD;
+    float cr = cosf(roll), sr = sinf(roll), cp = cosf(pitch), sp = sinf(pitch), cy = cosf(yaw), sy = sinf(yaw);
+    const float r[3][3] = {                     // body to earth, yaw then pitch then roll
+        { cy * cp, cy * sp * sr - sy * cr, cy * sp * cr + sy * sr },
+        { sy * cp, sy * sp * sr + cy * cr, sy * sp * cr - cy * sr },
+        { -sp,     cp * sr,                cp * cr },
+    };
+    float body[3] = {
+        rollRate - yawRate * sp,
+        pitchRate * cr + yawRate * sr * cp,
+        -pitchRate * sr + yawRate * cr * cp,
+    };
+    int axis;
+
+    for (axis = 0; axis < 3; axis++) {
+        float up = r[0][axis] * earthUp[0] + r[1][axis] * earthUp[1] + r[2][axis] * earthUp[2];
+        float mag = r[0][axis] * earthMag[0] + r[1][axis] * earthMag[1] + r[2][axis] * earthMag[2];
+        sample->gyro[axis] = lrintf(body[axis] * MSP_AHRS_RAD_TO_DEG * MSP_IMU_GYRO_LSB_PER_DPS);
+        sample->acc[axis] = lrintf(up * MSP_IMU_ACC_LSB_PER_G);
+        sample->mag[axis] = lrintf(mag * MSP_IMU_SIM_MAG_LSB);
+    }
+
+    if (rollDeg) {
+        *rollDeg = roll * MSP_AHRS_RAD_TO_DEG;
+        *pitchDeg = pitch * MSP_AHRS_RAD_TO_DEG;
+        *headingDeg = heading;
+    }
+}
+
+
+// a FIFO as deep as the queue, samples older than that were overwritten before anyone read them
+uint32_t mspImuSimRead(mspImuSample_t *samples, uint32_t max)
+{
+    uint32_t now = micros();
+    uint64_t due;
+    uint32_t count = 0;
+
+    simElapsedUs += (uint32_t)(now - simLastUs);
+    simLastUs = now;
+    due = simElapsedUs * simRateHz / 1000000;
+    if (due - simNext > MSP_AHRS_QUEUE_SIZE) {
+        simNext = due - MSP_AHRS_QUEUE_SIZE;
+    }
+    while (simNext < due && count < max) {
+        mspImuSimSample(simNext++, &samples[count++], NULL, NULL, NULL);
+    }
+    return count;
+}
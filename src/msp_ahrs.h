@@ -0,0 +1,71 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_AHRS_QUEUE_SIZE 1024                // power of two, raw samples kept for fusion
+#define MSP_AHRS_MAX_CATCHUP 512                // a request fuses at most this many, older ones are skipped
+#define MSP_AHRS_BATCH 64                       // samples converted to float in one pass
+#define MSP_AHRS_DEFAULT_KP 0.5f                // Mahony proportional gain
+#define MSP_AHRS_DEFAULT_KI 0.0f                // Mahony integral gain, gyro bias estimation when not 0
+
+#define MSP_IMU_GYRO_LSB_PER_DPS 16.4f          // +-2000 deg/s
+#define MSP_IMU_ACC_LSB_PER_G 2048.0f           // +-16 g
+#define MSP_IMU_RAW_ACC_1G 512                  // MSP_RAW_IMU reports acceleration with 1 g = 512
+
+// one reading as the sensor delivers it. Body axes x forward, y left, z up, so a level board
+// reads +1 g on z. mag is all zero without a magnetometer.
+typedef struct mspImuSample_s {
+    int16_t gyro[3];
+    int16_t acc[3];
+    int16_t mag[3];
+} mspImuSample_t;
+
+typedef struct mspAhrsAttitude_s {
+    int16_t roll;                               // deci-degrees, right side down positive
+    int16_t pitch;                              // deci-degrees, nose down positive
+    int16_t heading;                            // degrees 0..359, clockwise from magnetic north
+} mspAhrsAttitude_t;
+
+typedef struct mspAhrsStats_s {
+    uint64_t samples;                           // ingested
+    uint64_t fused;
+    uint64_t skipped;                           // never fused, the estimate was reseeded past them
+    uint64_t requests;
+    uint64_t fusions;                           // requests that found new samples
+    uint64_t reseeds;
+    uint64_t fusionNs;
+} mspAhrsStats_t;
+
+// fills up to max samples that arrived since the last call, like draining a sensor FIFO
+typedef uint32_t (*mspImuReadFnPtr)(mspImuSample_t *samples, uint32_t max);
+
+/*
+ * Lazy attitude estimation.
+ *
+ * Raw samples go into a queue kept as one array per axis. Nothing is integrated when they
+ * arrive: a request first drains the source, then runs a Mahony filter over the samples that
+ * came in since the last request, a batch at a time, and caches the result under the sequence
+ * number of the newest sample. Requests that find no new samples get the cached attitude, so any
+ * number of pollers share one fusion per sample, and an attitude nobody asks for costs nothing.
+ * When more than MSP_AHRS_MAX_CATCHUP samples are waiting the older ones are dropped and the
+ * estimate restarts from the accelerometer and magnetometer, which bounds the cost of a request.
+ *
+ * Samples are pushed either by the source given to mspAhrsStart(), called with the estimator
+ * locked, or by one driver through mspAhrsPushSamples(). Requests may come from any thread.
+ */
+void mspAhrsStart(uint32_t sampleRateHz, mspImuReadFnPtr source);
+void mspAhrsPushSamples(const mspImuSample_t *samples, uint32_t count);
+void mspAhrsGetAttitude(mspAhrsAttitude_t *attitude);
+bool mspAhrsGetLatestSample(mspImuSample_t *sample);
+const mspAhrsStats_t *mspAhrsGetStats(void);
+void mspAhrsReport(void);
+
+/*
+ * Simulated IMU.
+ *
+ * Samples of a board that rolls, pitches and turns continuously in a known pattern, as a source
+ * for mspAhrsStart(). mspImuSimSample() gives sample n together with the true attitude, for
+ * benchmarks.
+ */
+void mspImuSimStart(uint32_t sampleRateHz);
+uint32_t mspImuSimRead(mspImuSample_t *samples, uint32_t max);
+void mspImuSimSample(uint64_t n, mspImuSample_t *sample, float *rollDeg, float *pitchDeg, float *headingDeg);
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_protocol.h"
+#include "msp_bulk.h"
+
+/*
+ * Windowed bulk transfers for msp clients.
+ *
+ * Instead of one request per round trip up to `window` chunk requests are kept outstanding. The
+ * server answers them in order, so the link stays busy and throughput is bounded by bandwidth.
+ *
+ * Downloads (MSP_DATAFLASH_READ) get the address back in every reply, so each chunk is matched
+ * and retried on its own. A short reply tells us the FC's real limit: the rest of that chunk is
+ * requested again, and later chunks use the smaller size. A timeout halves the chunk size. Every
+ * full window of clean replies grows it back towards maxPayload.
+ *
+ * Uploads (MSP_OSD_CHAR_WRITE) are only answered with an empty ack. A lost request shifts every
+ * later ack onto the wrong chunk, and that only shows up as a timeout at the end of the pipeline.
+ * So every MSP_BULK_CHECKPOINT_WINDOWS windows the pipeline is allowed to drain. When everything
+ * sent so far has been acked, the chunks before that point are known to be written. A timeout
+ * resends everything since the last checkpoint. The writes are idempotent, so resending is safe.
+ *
+ * The client callbacks carry no context, so one transfer runs at a time.
+ */
+
+static mspPort_t *bulkPort;
+static mspBulkTransfer_t *activeTransfer;
+
+
+static void mspBulkEncodeOsdChar(mspBulkTransfer_t *transfer, uint32_t index, sbuf_t *dst)
+{
+    // fonts beyond 256 characters need the 16 bit address form
+    if (transfer->count > 256) {
+        sbufWriteU16(dst, index);
+    } else {
+        sbufWriteU8(dst, index);
+    }
+    sbufWriteData(dst, transfer->source + index * transfer->elementSize, transfer->elementSize);
+}
+
+
+void mspBulkInitOsdFontUpload(mspBulkTransfer_t *transfer, const uint8_t *font, uint16_t charCount)
+{
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->direction = MSP_BULK_UPLOAD;
+    transfer->cmd = MSP_OSD_CHAR_WRITE;
+    transfer->source = font;
+    transfer->count = charCount;
+    transfer->elementSize = MSP_OSD_CHAR_SIZE;
+    transfer->maxPayload = MSP_PORT_INBUF_SIZE;
+    transfer->window = MSP_BULK_DEFAULT_WINDOW;
+    transfer->encodeFn = mspBulkEncodeOsdChar;
+}
+
+
+void mspBulkInitDataflashDownload(mspBulkTransfer_t *transfer, uint8_t *destination, uint32_t address, uint32_t size)
+{
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->direction = MSP_BULK_DOWNLOAD;
+    transfer->cmd = MSP_DATAFLASH_READ;
+    transfer->destination = destination;
+    transfer->count = size;
+    transfer->baseAddress = address;
+    transfer->maxPayload = MSP_PORT_INBUF_SIZE;
+    transfer->window = MSP_BULK_DEFAULT_WINDOW;
+}
+
+
+static void mspBulkFinish(mspBulkTransfer_t *transfer, mspBulkState_e state)
+{
+    transfer->state = state;
+    transfer->finishedAt = millis();
+    bulkPort->replyHandlerFn = NULL;
+    bulkPort->commandSenderFn = NULL;
+    activeTransfer = NULL;
+}
+
+
+static void mspBulkComplete(mspBulkTransfer_t *transfer, uint32_t amount)
+{
+    transfer->completed += amount;
+    if (transfer->progressFn) {
+        transfer->progressFn(transfer, transfer->completed, transfer->count);
+    }
+    if (transfer->completed == transfer->count) {
+        mspBulkFinish(transfer, MSP_BULK_DONE);
+    }
+}
+
+
+static mspBulkSlot_t *mspBulkOldestSent(mspBulkTransfer_t *transfer)
+{
+    mspBulkSlot_t *oldest = NULL;
+    int i;
+
+    for (i = 0; i < transfer->window; i++) {
+        mspBulkSlot_t *slot = &transfer->slots[i];
+        if (slot->used && slot->sent && (!oldest || slot->seq < oldest->seq)) {
+            oldest = slot;
+        }
+    }
+    return oldest;
+}
+
+
+static bool mspBulkAnyUsed(mspBulkTransfer_t *transfer)
+{
+    int i;
+
+    for (i = 0; i < transfer->window; i++) {
+        if (transfer->slots[i].used) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool mspBulkRetry(mspBulkTransfer_t *transfer, mspBulkSlot_t *slot)
+{
+    if (++slot->retries > MSP_BULK_MAX_RETRIES) {
+        mspBulkFinish(transfer, MSP_BULK_FAILED);
+        return false;
+    }
+    slot->sent = false;
+    transfer->retransmits++;
+    return true;
+}
+
+
+// hands unassigned work to free slots
+static void mspBulkFillSlots(mspBulkTransfer_t *transfer)
+{
+    int i;
+
+    if (transfer->direction == MSP_BULK_UPLOAD &&
+        transfer->nextOffset - transfer->checkpoint >= (uint32_t)transfer->window * MSP_BULK_CHECKPOINT_WINDOWS) {
+        if (mspBulkAnyUsed(transfer)) {
+            return;                             // draining towards the next checkpoint
+        }
+        transfer->checkpoint = transfer->nextOffset;
+        transfer->rewinds = 0;
+    }
+
+    for (i = 0; i < transfer->window && transfer->nextOffset < transfer->count; i++) {
+        mspBulkSlot_t *slot = &transfer->slots[i];
+        if (slot->used) {
+            continue;
+        }
+
+        memset(slot, 0, sizeof(*slot));
+        slot->used = true;
+        slot->offset = transfer->nextOffset;
+        if (transfer->direction == MSP_BULK_DOWNLOAD) {
+            uint32_t left = transfer->count - transfer->nextOffset;
+            slot->length = left < transfer->chunkSize ? left : transfer->chunkSize;
+            transfer->nextOffset += slot->length;
+        } else {
+            transfer->nextOffset++;
+        }
+    }
+}
+
+
+static bool mspBulkSendChunk(mspPacket_t *command)
+{
+    mspBulkTransfer_t *transfer = activeTransfer;
+    mspBulkSlot_t *next = NULL;
+    int i;
+
+    if (!transfer) {
+        return false;
+    }
+
+    // lowest offset first, so a retried chunk does not wait behind new ones
+    for (i = 0; i < transfer->window; i++) {
+        mspBulkSlot_t *slot = &transfer->slots[i];
+        if (slot->used && !slot->sent && (!next || slot->offset < next->offset)) {
+            next = slot;
+        }
+    }
+    if (!next) {
+        return false;
+    }
+
+    command->cmd = transfer->cmd;
+    if (transfer->direction == MSP_BULK_DOWNLOAD) {
+        sbufWriteU32(&command->buf, transfer->baseAddress + next->offset);
+        sbufWriteU16(&command->buf, next->length);
+    } else {
+        transfer->encodeFn(transfer, next->offset, &command->buf);
+    }
+
+    next->sent = true;
+    next->seq = transfer->nextSeq++;
+    next->sentAt = millis();
+    transfer->requests++;
+    return true;
+}
+
+
+static void mspBulkHandleDownloadReply(mspBulkTransfer_t *transfer, mspPacket_t *reply)
+{
+    int len = sbufBytesRemaining(&reply->buf);
+    mspBulkSlot_t *slot = NULL;
+    uint32_t address;
+    int i;
+
+    if (len < 4) {
+        return;
+    }
+    address = sbufReadU32(&reply->buf) - transfer->baseAddress;
+    len -= 4;
+
+    for (i = 0; i < transfer->window; i++) {
+        if (transfer->slots[i].used && transfer->slots[i].sent && transfer->slots[i].offset == address) {
+            slot = &transfer->slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        return;                                 // late reply to a chunk already retried and answered
+    }
+
+    if (reply->result < 0 || len == 0) {
+        mspBulkRetry(transfer, slot);
+        return;
+    }
+
+    if (len > slot->length) {
+        len = slot->length;
+    }
+    memcpy(transfer->destination + slot->offset, sbufPtr(&reply->buf), len);
+
+    if (len < slot->length) {
+        // the FC sends no more than this, ask for the rest and size later chunks to match
+        slot->offset += len;
+        slot->length -= len;
+        slot->sent = false;
+        transfer->chunkSize = len;
+        transfer->chunkLimit = len;
+    } else {
+        slot->used = false;
+        if (transfer->requests % transfer->window == 0 && transfer->chunkSize < transfer->chunkLimit) {
+            uint32_t grown = transfer->chunkSize + transfer->chunkSize / 4;
+            transfer->chunkSize = grown < transfer->chunkLimit ? grown : transfer->chunkLimit;
+        }
+    }
+    mspBulkComplete(transfer, len);
+}
+
+
+static void mspBulkHandleUploadReply(mspBulkTransfer_t *transfer, mspPacket_t *reply)
+{
+    mspBulkSlot_t *slot = mspBulkOldestSent(transfer);
+
+    if (!slot) {
+        return;
+    }
+    if (reply->result < 0) {
+        mspBulkRetry(transfer, slot);
+        return;
+    }
+    slot->used = false;
+    mspBulkComplete(transfer, 1);
+}
+
+
+static void mspBulkHandleReply(mspPacket_t *reply)
+{
+    mspBulkTransfer_t *transfer = activeTransfer;
+
+    if (!transfer || reply->cmd != transfer->cmd) {
+        return;
+    }
+
+    if (transfer->direction == MSP_BULK_DOWNLOAD) {
+        mspBulkHandleDownloadReply(transfer, reply);
+    } else {
+        mspBulkHandleUploadReply(transfer, reply);
+    }
+}
+
+
+static void mspBulkCheckTimeouts(mspBulkTransfer_t *transfer)
+{
+    uint32_t now = millis();
+    int i;
+
+    if (transfer->direction == MSP_BULK_DOWNLOAD) {
+        for (i = 0; i < transfer->window; i++) {
+            mspBulkSlot_t *slot = &transfer->slots[i];
+            if (slot->used && slot->sent && now - slot->sentAt > MSP_BULK_REPLY_TIMEOUT_MS) {
+                if (!mspBulkRetry(transfer, slot)) {
+                    return;
+                }
+                if (transfer->chunkSize / 2 >= MSP_BULK_MIN_CHUNK_SIZE) {
+                    transfer->chunkSize /= 2;
+                }
+            }
+        }
+        return;
+    }
+
+    mspBulkSlot_t *oldest = mspBulkOldestSent(transfer);
+    if (oldest && now - oldest->sentAt > MSP_BULK_REPLY_TIMEOUT_MS) {
+        // some request since the checkpoint was lost, which one cannot be told from the acks
+        if (++transfer->rewinds > MSP_BULK_MAX_RETRIES) {
+            mspBulkFinish(transfer, MSP_BULK_FAILED);
+            return;
+        }
+        transfer->retransmits += transfer->nextOffset - transfer->checkpoint;
+        transfer->completed = transfer->checkpoint;
+        transfer->nextOffset = transfer->checkpoint;
+        for (i = 0; i < transfer->window; i++) {
+            transfer->slots[i].used = false;
+        }
+    }
+}
+
+
+bool mspBulkStart(mspPort_t *msp, mspBulkTransfer_t *transfer)
+{
+    if (activeTransfer || msp->mode != MSP_MODE_CLIENT || !transfer->count || !transfer->window ||
+        transfer->window > MSP_BULK_MAX_WINDOW || (transfer->direction == MSP_BULK_UPLOAD && !transfer->encodeFn) ||
+        transfer->maxPayload <= 4 + MSP_BULK_MIN_CHUNK_SIZE) {
+        return false;
+    }
+
+    memset(transfer->slots, 0, sizeof(transfer->slots));
+    transfer->state = MSP_BULK_RUNNING;
+    transfer->nextOffset = 0;
+    transfer->completed = 0;
+    transfer->nextSeq = 0;
+    transfer->chunkSize = transfer->maxPayload - 4;     // the reply repeats the 4 byte address
+    transfer->chunkLimit = transfer->chunkSize;
+    transfer->checkpoint = 0;
+    transfer->rewinds = 0;
+    transfer->requests = 0;
+    transfer->retransmits = 0;
+    transfer->startedAt = millis();
+
+    bulkPort = msp;
+    activeTransfer = transfer;
+    msp->replyHandlerFn = mspBulkHandleReply;
+    return true;
+}
+
+
+// call once per loop next to mspSerialProcess(), it queues at most one request per call
+void mspBulkProcess(void)
+{
+    mspBulkTransfer_t *transfer = activeTransfer;
+
+    if (!transfer) {
+        return;
+    }
+
+    mspBulkCheckTimeouts(transfer);
+    if (!activeTransfer) {
+        return;
+    }
+
+    mspBulkFillSlots(transfer);
+    if (!bulkPort->commandSenderFn) {
+        bulkPort->commandSenderFn = mspBulkSendChunk;
+    }
+}
+
+
+void mspBulkCancel(void)
+{
+    if (activeTransfer) {
+        mspBulkFinish(activeTransfer, MSP_BULK_FAILED);
+    }
+}
+
+
+void mspBulkReport(const mspBulkTransfer_t *transfer)
+{
+    uint32_t elapsed = transfer->finishedAt - transfer->startedAt;
+
+    fprintf(stderr, "%s %s: %u of %u %s in %.2f s, %u requests, %u retransmits, window %u\n",
+            transfer->direction == MSP_BULK_UPLOAD ? "upload" : "download",
+            transfer->state == MSP_BULK_DONE ? "done" : "failed", transfer->completed, transfer->count,
+            transfer->direction == MSP_BULK_UPLOAD ? "elements" : "bytes", elapsed / 1000.0,
+            transfer->requests, transfer->retransmits, transfer->window);
+}
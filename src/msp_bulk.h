@@ -0,0 +1,76 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_BULK_MAX_WINDOW 16
+#define MSP_BULK_DEFAULT_WINDOW 8
+#define MSP_BULK_REPLY_TIMEOUT_MS 250
+#define MSP_BULK_MAX_RETRIES 5
+#define MSP_BULK_MIN_CHUNK_SIZE 16
+#define MSP_BULK_CHECKPOINT_WINDOWS 4           // ack-only uploads drain the window this often, see msp_bulk.c
+#define MSP_OSD_CHAR_SIZE 54
+
+typedef enum {
+    MSP_BULK_IDLE,
+    MSP_BULK_RUNNING,
+    MSP_BULK_DONE,
+    MSP_BULK_FAILED
+} mspBulkState_e;
+
+typedef enum {
+    MSP_BULK_UPLOAD,                            // one element per request, the reply is a bare ack
+    MSP_BULK_DOWNLOAD                           // address + length requests, the reply carries its address
+} mspBulkDirection_e;
+
+struct mspBulkTransfer_s;
+
+typedef void (*mspBulkEncodeFuncPtr)(struct mspBulkTransfer_s *transfer, uint32_t index, sbuf_t *dst);
+typedef void (*mspBulkProgressFuncPtr)(struct mspBulkTransfer_s *transfer, uint32_t done, uint32_t total);
+
+typedef struct mspBulkSlot_s {
+    bool used;
+    bool sent;
+    uint32_t offset;                            // element index (upload) or byte offset (download)
+    uint16_t length;                            // download only
+    uint8_t retries;
+    uint32_t seq;                               // send order, replies to uploads come back in it
+    uint32_t sentAt;
+} mspBulkSlot_t;
+
+typedef struct mspBulkTransfer_s {
+    // set up by the caller, or by one of the mspBulkInit helpers
+    mspBulkDirection_e direction;
+    uint8_t cmd;
+    const uint8_t *source;                      // upload
+    uint8_t *destination;                       // download
+    uint32_t count;                             // elements (upload) or bytes (download)
+    uint16_t elementSize;                       // upload
+    uint32_t baseAddress;                       // download, address of destination[0]
+    uint16_t maxPayload;                        // largest payload the FC takes, MSP_PORT_INBUF_SIZE for MSP v1
+    uint8_t window;
+    mspBulkEncodeFuncPtr encodeFn;              // upload request payload for one element
+    mspBulkProgressFuncPtr progressFn;          // optional
+    void *userData;
+
+    // engine state
+    mspBulkState_e state;
+    mspBulkSlot_t slots[MSP_BULK_MAX_WINDOW];
+    uint32_t nextOffset;                        // first element or byte not yet given to a slot
+    uint32_t completed;
+    uint32_t nextSeq;
+    uint16_t chunkSize;                         // download request size, adapts to what the link and FC manage
+    uint16_t chunkLimit;                        // download: most the FC returned for one request
+    uint32_t checkpoint;                        // upload: every element before this is known to be written
+    uint8_t rewinds;                            // upload: consecutive rewinds without passing a checkpoint
+    uint32_t requests;
+    uint32_t retransmits;
+    uint32_t startedAt;
+    uint32_t finishedAt;
+} mspBulkTransfer_t;
+
+void mspBulkInitOsdFontUpload(mspBulkTransfer_t *transfer, const uint8_t *font, uint16_t charCount);
+void mspBulkInitDataflashDownload(mspBulkTransfer_t *transfer, uint8_t *destination, uint32_t address, uint32_t size);
+
+bool mspBulkStart(mspPort_t *msp, mspBulkTransfer_t *transfer);
+void mspBulkProcess(void);
+void mspBulkCancel(void);
+void mspBulkReport(const mspBulkTransfer_t *transfer);
@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <string.h>
+#include "msp_checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USE_CHECKSUM_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_CHECKSUM_NEON
+#endif
+
+#define CHECKSUM_SELFTEST_SIZE 300
+
+
+static uint8_t checksumScalar(uint8_t checksum, const uint8_t *data, int len)
+{
+    while (len-- > 0) {
+        checksum ^= *data++;
+    }
+    return checksum;
+}
+
+
+static uint8_t checksumCopyScalar(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len)
+{
+    while (len-- > 0) {
+        checksum ^= *src;
+        *dst++ = *src++;
+    }
+    return checksum;
+}
+
+
+static uint8_t foldU64(uint64_t acc)
+{
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    return acc;
+}
+
+
+// XOR commutes, so 8 bytes at a time and a fold at the end gives the same answer as bytewise
+static uint8_t checksumWord(uint8_t checksum, const uint8_t *data, int len)
+{
+    uint64_t acc = 0;
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, data += 8) {
+        memcpy(&word, data, sizeof(word));
+        acc ^= word;
+    }
+    return checksumScalar(checksum ^ foldU64(acc), data, len);
+}
+
+
+static uint8_t checksumCopyWord(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len)
+{
+    uint64_t acc = 0;
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, src += 8, dst += 8) {
+        memcpy(&word, src, sizeof(word));
+        memcpy(dst, &word, sizeof(word));
+        acc ^= word;
+    }
+    return checksumCopyScalar(checksum ^ foldU64(acc), dst, src, len);
+}
+
+
+#ifdef USE_CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint8_t foldM128(__m128i acc)
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return foldU64(lanes[0] ^ lanes[1]);
+}
+
+
+__attribute__((target("sse2")))
+static uint8_t checksumSse2(uint8_t checksum, const uint8_t *data, int len)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for (; len >= 16; len -= 16, data += 16) {
+        acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)data));
+    }
+    return checksumWord(checksum ^ foldM128(acc), data, len);
+}
+
+
+__attribute__((target("sse2")))
+static uint8_t checksumCopySse2(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for (; len >= 16; len -= 16, src += 16, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, v);
+        acc = _mm_xor_si128(acc, v);
+    }
+    return checksumCopyWord(checksum ^ foldM128(acc), dst, src, len);
+}
+
+
+__attribute__((target("avx2")))
+static uint8_t foldM256(__m256i acc)
+{
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, half);
+    return foldU64(lanes[0] ^ lanes[1]);
+}
+
+
+__attribute__((target("avx2")))
+static uint8_t checksumAvx2(uint8_t checksum, const uint8_t *data, int len)
+{
+    __m256i acc = _mm256_setzero_si256();
+
+    for (; len >= 32; len -= 32, data += 32) {
+        acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)data));
+    }
+    return checksumSse2(checksum ^ foldM256(acc), data, len);
+}
+
+
+__attribute__((target("avx2")))
+static uint8_t checksumCopyAvx2(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len)
+{
+    __m256i acc = _mm256_setzero_si256();
+
+    for (; len >= 32; len -= 32, src += 32, dst += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, v);
+        acc = _mm256_xor_si256(acc, v);
+    }
+    return checksumCopySse2(checksum ^ foldM256(acc), dst, src, len);
+}
+#endif
+
+
+#ifdef USE_CHECKSUM_NEON
+static uint8_t checksumNeon(uint8_t checksum, const uint8_t *data, int len)
+{
+    uint8x16_t acc = vdupq_n_u8(0);
+    uint64_t lanes[2];
+
+    for (; len >= 16; len -= 16, data += 16) {
+        acc = veorq_u8(acc, vld1q_u8(data));
+    }
+    vst1q_u8((uint8_t *)lanes, acc);
+    return checksumWord(checksum ^ foldU64(lanes[0] ^ lanes[1]), data, len);
+}
+
+
+static uint8_t checksumCopyNeon(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len)
+{
+    uint8x16_t acc = vdupq_n_u8(0);
+    uint64_t lanes[2];
+
+    for (; len >= 16; len -= 16, src += 16, dst += 16) {
+        uint8x16_t v = vld1q_u8(src);
+        vst1q_u8(dst, v);
+        acc = veorq_u8(acc, v);
+    }
+    vst1q_u8((uint8_t *)lanes, acc);
+    return checksumCopyWord(checksum ^ foldU64(lanes[0] ^ lanes[1]), dst, src, len);
+}
+#endif
+
+
+typedef struct checksumKernel_s {
+    const char *name;
+    mspChecksumFnPtr checksum;
+    mspChecksumCopyFnPtr checksumCopy;
+    int (*supported)(void);
+} checksumKernel_t;
+
+static int alwaysSupported(void)
+{
+    return 1;
+}
+
+#ifdef USE_CHECKSUM_X86
+static int avx2Supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int sse2Supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+#endif
+
+// widest first, the first one that is supported and passes the self test wins
+static const checksumKernel_t checksumKernels[] = {
+#ifdef USE_CHECKSUM_X86
+    { "avx2", checksumAvx2, checksumCopyAvx2, avx2Supported },
+    { "sse2", checksumSse2, checksumCopySse2, sse2Supported },
+#endif
+#ifdef USE_CHECKSUM_NEON
+    { "neon", checksumNeon, checksumCopyNeon, alwaysSupported },
+#endif
+    { "word", checksumWord, checksumCopyWord, alwaysSupported },
+    { "scalar", checksumScalar, checksumCopyScalar, alwaysSupported },
+};
+
+mspChecksumFnPtr mspChecksumBuf = checksumScalar;
+mspChecksumCopyFnPtr mspChecksumCopy = checksumCopyScalar;
+static const char *kernelName = "scalar";
+
+
+// every length and misalignment up to CHECKSUM_SELFTEST_SIZE must match the scalar reference
+static int checksumKernelMatchesReference(const checksumKernel_t *kernel)
+{
+    uint8_t src[CHECKSUM_SELFTEST_SIZE + 32];
+    uint8_t dst[CHECKSUM_SELFTEST_SIZE + 32];
+    uint32_t seed = 0x12345678;
+    int offset;
+    int len;
+    unsigned i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = seed >> 16;
+    }
+
+    for (offset = 0; offset < 32; offset += 7) {
+        for (len = 0; len <= CHECKSUM_SELFTEST_SIZE; len++) {
+            uint8_t expected = checksumScalar(0x5a, src + offset, len);
+            memset(dst, 0, sizeof(dst));
+            if (kernel->checksum(0x5a, src + offset, len) != expected ||
+                kernel->checksumCopy(0x5a, dst + (31 - offset), src + offset, len) != expected ||
+                memcmp(dst + (31 - offset), src + offset, len) != 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+void mspChecksumInit(void)
+{
+    unsigned i;
+
+    for (i = 0; i < sizeof(checksumKernels) / sizeof(checksumKernels[0]); i++) {
+        const checksumKernel_t *kernel = &checksumKernels[i];
+        if (kernel->supported() && checksumKernelMatchesReference(kernel)) {
+            mspChecksumBuf = kernel->checksum;
+            mspChecksumCopy = kernel->checksumCopy;
+            kernelName = kernel->name;
+            return;
+        }
+    }
+}
+
+
+const char *mspChecksumKernelName(void)
+{
+    return kernelName;
+}
+
+
+// 32 bit FNV-1a
+uint32_t mspReplyHash(const uint8_t *data, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0) {
+        hash = (hash ^ *data++) * 16777619u;
+    }
+    return hash;
+}
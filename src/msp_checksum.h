@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Checksum kernels.
+ *
+ * mspChecksumBuf() is the MSP v1 XOR checksum, mspChecksumCopy() the same fused with the payload
+ * copy so encoding touches the data once. The widest kernel the CPU supports is picked by
+ * mspChecksumInit(), after it has been checked against the scalar reference; until then, and on
+ * any mismatch, the scalar kernels are used.
+ *
+ * mspReplyHash() identifies a reply payload for MSP_CONDITIONAL_READ. It is never vectorised,
+ * client and server must agree on it bit for bit.
+ */
+
+typedef uint8_t (*mspChecksumFnPtr)(uint8_t checksum, const uint8_t *data, int len);
+typedef uint8_t (*mspChecksumCopyFnPtr)(uint8_t checksum, uint8_t *dst, const uint8_t *src, int len);
+
+extern mspChecksumFnPtr mspChecksumBuf;
+extern mspChecksumCopyFnPtr mspChecksumCopy;
+
+void mspChecksumInit(void);
+const char *mspChecksumKernelName(void);
+
+uint32_t mspReplyHash(const uint8_t *data, int len);
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_protocol.h"
+#include "msp_compress.h"
+#include "msp_lz4.h"
+
+/*
+ * Negotiated reply compression.
+ *
+ * A client that can decode LZ4 blocks sends MSP_COMPRESSION with the algorithms it supports and
+ * the smallest payload worth compressing. From then on, replies on that port that are at least
+ * that large and shrink by more than the wrapper's two bytes are sent as MSP_COMPRESSED:
+ *
+ *   U8 original command, U8 original payload size, LZ4 block
+ *
+ * Everything else goes out as before, so a reply is never larger than it would have been. Clients
+ * that never ask are never sent MSP_COMPRESSED. On the client side, mspSerialProcessReceivedReply()
+ * unwraps replies before the reply handler sees them.
+ */
+
+#define MSP_COMPRESSED_HEADER_SIZE 2
+
+
+// MSP_COMPRESSION: sets which algorithms may be used for replies on this port and from which
+// size on, and answers with what was accepted. No algorithm turns compression off again.
+void mspCompressionProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply)
+{
+    sbuf_t *src = &command->buf;
+    uint8_t algorithms = 0;
+    uint8_t threshold = MSP_COMPRESSION_DEFAULT_THRESHOLD;
+
+    if (sbufBytesRemaining(src) >= 1) {
+        algorithms = sbufReadU8(src) & MSP_COMPRESSION_LZ4;
+    }
+    if (sbufBytesRemaining(src) >= 1) {
+        threshold = sbufReadU8(src);
+    }
+    if (threshold < MSP_COMPRESSION_MIN_THRESHOLD) {
+        threshold = MSP_COMPRESSION_MIN_THRESHOLD;
+    }
+
+    msp->compressThreshold = algorithms ? threshold : 0;
+
+    reply->cmd = command->cmd;
+    sbufWriteU8(&reply->buf, algorithms);
+    sbufWriteU8(&reply->buf, msp->compressThreshold);
+    reply->result = 1;
+}
+
+
+void mspCompressionSerializeRequest(sbuf_t *dst, uint8_t threshold)
+{
+    sbufWriteU8(dst, MSP_COMPRESSION_LZ4);
+    sbufWriteU8(dst, threshold);
+}
+
+
+// Rewrites reply into its MSP_COMPRESSED form in scratch (MSP_PORT_OUTBUF_SIZE bytes) when the port
+// negotiated compression and it pays off. Returns false, leaving reply alone, otherwise.
+bool mspCompressReply(mspPort_t *msp, mspPacket_t *reply, uint8_t *scratch)
+{
+    int len = sbufBytesRemaining(&reply->buf);
+    int packedLen;
+
+    if (!msp->compressThreshold || reply->result < 0 || len < msp->compressThreshold || reply->cmd == MSP_COMPRESSION) {
+        return false;
+    }
+
+    // only worth it when the wrapped frame comes out smaller than the plain one
+    packedLen = mspLz4Compress(sbufPtr(&reply->buf), len, scratch + MSP_COMPRESSED_HEADER_SIZE, len - MSP_COMPRESSED_HEADER_SIZE - 1);
+    if (packedLen < 0) {
+        return false;
+    }
+
+    scratch[0] = reply->cmd;
+    scratch[1] = len;
+    reply->cmd = MSP_COMPRESSED;
+    reply->buf.ptr = scratch;
+    reply->buf.end = scratch + MSP_COMPRESSED_HEADER_SIZE + packedLen;
+    return true;
+}
+
+
+// Unwraps an MSP_COMPRESSED reply into scratch (MSP_PORT_INBUF_SIZE bytes), false if it is corrupt.
+bool mspDecompressReply(mspPacket_t *reply, uint8_t *scratch)
+{
+    int len = sbufBytesRemaining(&reply->buf);
+    uint8_t *payload = sbufPtr(&reply->buf);
+
+    if (len < MSP_COMPRESSED_HEADER_SIZE ||
+        mspLz4Decompress(payload + MSP_COMPRESSED_HEADER_SIZE, len - MSP_COMPRESSED_HEADER_SIZE, scratch, MSP_PORT_INBUF_SIZE) != payload[1]) {
+        return false;
+    }
+
+    reply->cmd = payload[0];
+    reply->buf.ptr = scratch;
+    reply->buf.end = scratch + payload[1];
+    return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_COMPRESSION_LZ4 (1 << 0)
+#define MSP_COMPRESSION_MIN_THRESHOLD 16        // below this the wrapper costs more than LZ4 saves
+#define MSP_COMPRESSION_DEFAULT_THRESHOLD 32
+
+void mspCompressionProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply);
+void mspCompressionSerializeRequest(sbuf_t *dst, uint8_t threshold);
+bool mspCompressReply(mspPort_t *msp, mspPacket_t *reply, uint8_t *scratch);
+bool mspDecompressReply(mspPacket_t *reply, uint8_t *scratch);
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_frame.h"
+
+static mspFrame_t framePool[MSP_FRAME_POOL_SIZE];
+
+// Treiber stack of free frames, the upper 32 bits are a generation tag against ABA
+static _Atomic uint64_t freeListHead;
+
+static atomic_uint framesAllocated;
+static atomic_uint framesHighWater;
+static atomic_uint framesExhausted;
+
+
+static void mspFramePush(uint32_t index)
+{
+    uint64_t head = atomic_load(&freeListHead);
+    uint64_t newHead;
+
+    do {
+        atomic_store(&framePool[index].nextFree, (uint32_t)head);
+        newHead = ((head >> 32) + 1) << 32 | (index + 1);
+    } while (!atomic_compare_exchange_weak(&freeListHead, &head, newHead));
+}
+
+
+void mspFramePoolInit(void)
+{
+    uint32_t i;
+
+    atomic_store(&freeListHead, 0);
+    for (i = MSP_FRAME_POOL_SIZE; i > 0; i--) {
+        memset(framePool[i - 1].data, 0, sizeof(framePool[i - 1].data));    // touch every page now, not on the first reply
+        atomic_store(&framePool[i - 1].refCount, 0);
+        mspFramePush(i - 1);
+    }
+}
+
+
+mspFrame_t *mspFrameAlloc(void)
+{
+    uint64_t head = atomic_load(&freeListHead);
+    uint64_t newHead;
+    uint32_t index;
+    uint32_t allocated;
+    uint32_t highWater;
+
+    do {
+        index = (uint32_t)head;
+        if (!index) {
+            atomic_fetch_add(&framesExhausted, 1);
+            return NULL;
+        }
+        newHead = ((head >> 32) + 1) << 32 | atomic_load(&framePool[index - 1].nextFree);
+    } while (!atomic_compare_exchange_weak(&freeListHead, &head, newHead));
+
+    allocated = atomic_fetch_add(&framesAllocated, 1) + 1;
+    highWater = atomic_load(&framesHighWater);
+    while (allocated > highWater && !atomic_compare_exchange_weak(&framesHighWater, &highWater, allocated));
+
+    mspFrame_t *frame = &framePool[index - 1];
+    atomic_store(&frame->refCount, 1);
+    frame->length = 0;
+    frame->traceEncodedUs = 0;
+    frame->traceRequestUs = 0;
+    return frame;
+}
+
+
+void mspFrameRetain(mspFrame_t *frame)
+{
+    atomic_fetch_add(&frame->refCount, 1);
+}
+
+
+void mspFrameRelease(mspFrame_t *frame)
+{
+    if (atomic_fetch_sub(&frame->refCount, 1) == 1) {
+        atomic_fetch_sub(&framesAllocated, 1);
+        mspFramePush(frame - framePool);
+    }
+}
+
+
+mspFramePoolStats_t mspFramePoolGetStats(void)
+{
+    mspFramePoolStats_t stats = {
+        .allocated = atomic_load(&framesAllocated),
+        .highWater = atomic_load(&framesHighWater),
+        .exhausted = atomic_load(&framesExhausted),
+    };
+    return stats;
+}
+
+
+void mspFramePoolReport(void)
+{
+    mspFramePoolStats_t stats = mspFramePoolGetStats();
+
+    fprintf(stderr, "frame pool at most %u of %u frames in use, %u still out, %u allocations failed\n",
+            stats.highWater, MSP_FRAME_POOL_SIZE, stats.allocated, stats.exhausted);
+}
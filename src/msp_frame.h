@@ -0,0 +1,42 @@
+#pragma once
+#include <stdatomic.h>
+#include "lib.h"
+
+#define MSP_FRAME_POOL_SIZE 64
+#define MSP_FRAME_HEADER_SIZE 5                 // '$', 'M', direction, size, command
+#define MSP_FRAME_BUFFER_SIZE (MSP_FRAME_HEADER_SIZE + MSP_PORT_OUTBUF_SIZE + 1)
+
+/*
+ * Encoded MSP frame from a fixed, preallocated pool.
+ *
+ * Frames are reference counted so one encoded reply can sit in the transmit queues of several
+ * ports or subscribers at once, it goes back to the pool when the last holder releases it.
+ * Allocation and release are lock-free and never touch the heap.
+ */
+typedef struct mspFrame_s {
+    atomic_uint refCount;
+    atomic_uint nextFree;                       // pool index + 1 of the next free frame, 0 ends the list
+    uint16_t length;                            // encoded bytes in data
+    uint32_t traceEncodedUs;                    // tracing only, 0 when not traced
+    uint32_t traceRequestUs;                    // first header byte of the request this frame answers
+    uint8_t data[MSP_FRAME_BUFFER_SIZE];
+} mspFrame_t;
+
+typedef struct mspFramePoolStats_s {
+    uint32_t allocated;                         // frames currently out of the pool
+    uint32_t highWater;
+    uint32_t exhausted;                         // allocations that failed
+} mspFramePoolStats_t;
+
+void mspFramePoolInit(void);
+mspFrame_t *mspFrameAlloc(void);
+void mspFrameRetain(mspFrame_t *frame);
+void mspFrameRelease(mspFrame_t *frame);
+mspFramePoolStats_t mspFramePoolGetStats(void);
+void mspFramePoolReport(void);
+
+// replies can be built in place here and encoded without copying the payload
+static inline uint8_t *mspFramePayload(mspFrame_t *frame)
+{
+    return frame->data + MSP_FRAME_HEADER_SIZE;
+}
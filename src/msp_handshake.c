@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_protocol.h"
+#include "msp_handshake.h"
+
+#define MSP_HANDSHAKE_CACHE_MAGIC "MSPHS1"
+
+// the first two are the cache key and are always asked for
+static const uint8_t handshakeCommands[MSP_HANDSHAKE_MAX_COMMANDS] = {
+    MSP_UID,
+    MSP_BUILD_INFO,
+    MSP_API_VERSION,
+    MSP_FC_VARIANT,
+    MSP_FC_VERSION,
+    MSP_BOARD_INFO,
+    MSP_BOXNAMES,
+    MSP_BOXIDS,
+};
+
+#define MSP_HANDSHAKE_KEY_COMMANDS 2
+
+
+static bool mspHandshakeLoadCache(mspHandshake_t *hs)
+{
+    char magic[sizeof(MSP_HANDSHAKE_CACHE_MAGIC)];
+    FILE *f;
+    int i;
+    bool ok;
+
+    if (!hs->cachePath || !(f = fopen(hs->cachePath, "rb"))) {
+        return false;
+    }
+
+    ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, MSP_HANDSHAKE_CACHE_MAGIC, sizeof(magic)) == 0;
+    for (i = 0; ok && i < MSP_HANDSHAKE_MAX_COMMANDS; i++) {
+        mspHandshakeEntry_t *entry = &hs->cached[i];
+        uint8_t header[3];
+        ok = fread(header, sizeof(header), 1, f) == 1 && header[1] == handshakeCommands[i] &&
+             fread(entry->data, 1, header[2], f) == header[2];
+        entry->valid = header[0];
+        entry->cmd = header[1];
+        entry->size = header[2];
+    }
+    fclose(f);
+
+    // without its key a cache can never be validated
+    return ok && hs->cached[0].valid && hs->cached[1].valid;
+}
+
+
+static void mspHandshakeSaveCache(mspHandshake_t *hs)
+{
+    char tmpPath[256];
+    FILE *f;
+    int i;
+    bool ok;
+
+    if (!hs->cachePath || !hs->entries[0].valid || !hs->entries[1].valid) {
+        return;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", hs->cachePath);
+    if (!(f = fopen(tmpPath, "wb"))) {
+        return;
+    }
+
+    ok = fwrite(MSP_HANDSHAKE_CACHE_MAGIC, sizeof(MSP_HANDSHAKE_CACHE_MAGIC), 1, f) == 1;
+    for (i = 0; ok && i < MSP_HANDSHAKE_MAX_COMMANDS; i++) {
+        mspHandshakeEntry_t *entry = &hs->entries[i];
+        uint8_t header[3] = { entry->valid, handshakeCommands[i], entry->valid ? entry->size : 0 };
+        ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(entry->data, 1, header[2], f) == header[2];
+    }
+
+    // rename is atomic, a reader never sees half a cache
+    if (fclose(f) == 0 && ok) {
+        rename(tmpPath, hs->cachePath);
+    } else {
+        remove(tmpPath);
+    }
+}
+
+
+static bool mspHandshakeEntryMatches(const mspHandshakeEntry_t *a, const mspHandshakeEntry_t *b)
+{
+    return a->valid && b->valid && a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+
+static void mspHandshakeComplete(mspHandshake_t *hs)
+{
+    hs->state = MSP_HANDSHAKE_COMPLETE;
+    hs->completedAt = millis();
+}
+
+
+// moves on once the request in flight has been answered (or has timed out)
+static void mspHandshakeAdvance(mspHandshake_t *hs)
+{
+    int i;
+
+    if (hs->awaiting >= 0) {
+        return;
+    }
+
+    if (hs->state == MSP_HANDSHAKE_VALIDATING) {
+        if (!hs->entries[MSP_HANDSHAKE_KEY_COMMANDS - 1].cmd) {
+            return;                             // key not fully asked yet
+        }
+        if (mspHandshakeEntryMatches(&hs->entries[0], &hs->cached[0]) &&
+            mspHandshakeEntryMatches(&hs->entries[1], &hs->cached[1])) {
+            for (i = MSP_HANDSHAKE_KEY_COMMANDS; i < MSP_HANDSHAKE_MAX_COMMANDS; i++) {
+                hs->entries[i] = hs->cached[i];
+            }
+            hs->usedCache = true;
+            mspHandshakeComplete(hs);
+            return;
+        }
+        // different FC or firmware, keep the key replies and fetch the rest
+        hs->state = MSP_HANDSHAKE_FETCHING;
+        return;
+    }
+
+    if (hs->state == MSP_HANDSHAKE_FETCHING) {
+        for (i = 0; i < MSP_HANDSHAKE_MAX_COMMANDS; i++) {
+            if (!hs->entries[i].cmd) {
+                return;                         // not asked yet
+            }
+        }
+        mspHandshakeSaveCache(hs);
+        mspHandshakeComplete(hs);
+    }
+}
+
+
+void mspHandshakeStart(mspHandshake_t *hs, const char *cachePath)
+{
+    memset(hs, 0, sizeof(*hs));
+    hs->cachePath = cachePath;
+    hs->awaiting = -1;
+    hs->startedAt = millis();
+    hs->cacheLoaded = mspHandshakeLoadCache(hs);
+    hs->state = hs->cacheLoaded ? MSP_HANDSHAKE_VALIDATING : MSP_HANDSHAKE_FETCHING;
+}
+
+
+// builds the next request, false when nothing is to be sent right now
+bool mspHandshakeNextRequest(mspHandshake_t *hs, mspPacket_t *request)
+{
+    int limit = hs->state == MSP_HANDSHAKE_VALIDATING ? MSP_HANDSHAKE_KEY_COMMANDS : MSP_HANDSHAKE_MAX_COMMANDS;
+    int i;
+
+    if (hs->awaiting >= 0 || (hs->state != MSP_HANDSHAKE_VALIDATING && hs->state != MSP_HANDSHAKE_FETCHING)) {
+        return false;
+    }
+
+    for (i = 0; i < limit; i++) {
+        if (!hs->entries[i].cmd) {
+            hs->entries[i].cmd = handshakeCommands[i];
+            hs->awaiting = i;
+            hs->requestSentAt = millis();
+            request->cmd = handshakeCommands[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// true if the reply belonged to the handshake
+bool mspHandshakeHandleReply(mspHandshake_t *hs, mspPacket_t *reply)
+{
+    mspHandshakeEntry_t *entry;
+    int len = sbufBytesRemaining(&reply->buf);
+
+    if (hs->awaiting < 0 || reply->cmd != handshakeCommands[hs->awaiting]) {
+        return false;
+    }
+
+    entry = &hs->entries[hs->awaiting];
+    entry->valid = reply->result >= 0;          // a command the FC rejects is left out
+    entry->size = len;
+    memcpy(entry->data, sbufPtr(&reply->buf), len);
+    hs->awaiting = -1;
+
+    mspHandshakeAdvance(hs);
+    return true;
+}
+
+
+// an FC that does not answer a command simply leaves it out of the handshake
+void mspHandshakeCheckTimeout(mspHandshake_t *hs)
+{
+    if (hs->awaiting >= 0 && millis() - hs->requestSentAt > MSP_HANDSHAKE_REPLY_TIMEOUT_MS) {
+        hs->awaiting = -1;
+        mspHandshakeAdvance(hs);
+    }
+}
+
+
+bool mspHandshakeIsComplete(const mspHandshake_t *hs)
+{
+    return hs->state == MSP_HANDSHAKE_COMPLETE;
+}
+
+
+const mspHandshakeEntry_t *mspHandshakeGetReply(const mspHandshake_t *hs, uint8_t cmd)
+{
+    int i;
+
+    if (hs->state != MSP_HANDSHAKE_COMPLETE) {
+        return NULL;
+    }
+    for (i = 0; i < MSP_HANDSHAKE_MAX_COMMANDS; i++) {
+        if (handshakeCommands[i] == cmd && hs->entries[i].valid) {
+            return &hs->entries[i];
+        }
+    }
+    return NULL;
+}
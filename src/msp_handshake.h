@@ -0,0 +1,47 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_HANDSHAKE_REPLY_TIMEOUT_MS 500
+#define MSP_HANDSHAKE_MAX_COMMANDS 8
+
+typedef enum {
+    MSP_HANDSHAKE_IDLE,
+    MSP_HANDSHAKE_VALIDATING,                   // asking only for the cache key, MSP_UID and MSP_BUILD_INFO
+    MSP_HANDSHAKE_FETCHING,                     // full sequence, the cache was missing or stale
+    MSP_HANDSHAKE_COMPLETE
+} mspHandshakeState_e;
+
+typedef struct mspHandshakeEntry_s {
+    bool valid;
+    uint8_t cmd;                                // non-zero once requested
+    uint8_t size;
+    uint8_t data[MSP_PORT_INBUF_SIZE];
+} mspHandshakeEntry_t;
+
+/*
+ * Client side connection handshake with an on-disk cache.
+ *
+ * The identification replies a client needs before doing anything useful are kept in a file
+ * keyed by MSP_UID and MSP_BUILD_INFO. On (re)connect only those two are requested; when they
+ * match the file the rest is taken from it, otherwise the full sequence runs and the file is
+ * rewritten. The handshake only builds requests and consumes replies, the caller owns the port.
+ */
+typedef struct mspHandshake_s {
+    mspHandshakeState_e state;
+    const char *cachePath;                      // NULL keeps the handshake in memory only
+    mspHandshakeEntry_t entries[MSP_HANDSHAKE_MAX_COMMANDS];
+    mspHandshakeEntry_t cached[MSP_HANDSHAKE_MAX_COMMANDS];
+    bool cacheLoaded;
+    bool usedCache;
+    int8_t awaiting;                            // index into entries of the request in flight, -1 when none
+    uint32_t requestSentAt;
+    uint32_t startedAt;
+    uint32_t completedAt;
+} mspHandshake_t;
+
+void mspHandshakeStart(mspHandshake_t *hs, const char *cachePath);
+bool mspHandshakeNextRequest(mspHandshake_t *hs, mspPacket_t *request);
+bool mspHandshakeHandleReply(mspHandshake_t *hs, mspPacket_t *reply);
+void mspHandshakeCheckTimeout(mspHandshake_t *hs);
+bool mspHandshakeIsComplete(const mspHandshake_t *hs);
+const mspHandshakeEntry_t *mspHandshakeGetReply(const mspHandshake_t *hs, uint8_t cmd);
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <string.h>
+#include "msp_lz4.h"
+
+/*
+ * Minimal LZ4 block codec.
+ *
+ * The output is a standard LZ4 block, so any LZ4 decoder on the client side can read it. The
+ * compressor is the greedy single-probe hash matcher of the reference implementation, which is
+ * plenty for payloads of a few hundred bytes. The decoder checks every length and offset against
+ * both buffers, because its input comes off the wire.
+ */
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5                     // the block must end in at least this many literals
+#define LZ4_MF_LIMIT 12                         // no match may start in the last 12 bytes
+#define LZ4_HASH_LOG 8
+#define LZ4_MAX_OFFSET 65535
+
+
+static uint32_t lz4Read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint32_t lz4Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+
+// writes the 255-run length extension used for lengths of 15 and more
+static uint8_t *lz4WriteLength(uint8_t *op, const uint8_t *oend, int length)
+{
+    for (; length >= 255; length -= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = length;
+    return op;
+}
+
+
+static uint8_t *lz4WriteSequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, int literalLen, int offset, int matchLen)
+{
+    uint8_t *token = op++;
+
+    if (token >= oend) {
+        return NULL;
+    }
+
+    *token = (literalLen < 15 ? literalLen : 15) << 4;
+    if (literalLen >= 15 && !(op = lz4WriteLength(op, oend, literalLen - 15))) {
+        return NULL;
+    }
+    if (op + literalLen > oend) {
+        return NULL;
+    }
+    memcpy(op, literals, literalLen);
+    op += literalLen;
+
+    if (!matchLen) {
+        return op;                              // last sequence, literals only
+    }
+
+    if (op + 2 > oend) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    matchLen -= LZ4_MIN_MATCH;
+    *token |= matchLen < 15 ? matchLen : 15;
+    if (matchLen >= 15 && !(op = lz4WriteLength(op, oend, matchLen - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+
+int mspLz4Compress(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity)
+{
+    uint16_t table[1 << LZ4_HASH_LOG];          // position + 1 of the last sequence with this hash
+    const uint8_t *oend = dst + dstCapacity;
+    uint8_t *op = dst;
+    int anchor = 0;
+    int ip = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ4_MF_LIMIT < srcLen) {
+        uint32_t sequence = lz4Read32(src + ip);
+        uint32_t h = lz4Hash(sequence);
+        int ref = table[h] - 1;
+
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || lz4Read32(src + ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        int matchLen = LZ4_MIN_MATCH;
+        while (ip + matchLen < srcLen - LZ4_LAST_LITERALS && src[ref + matchLen] == src[ip + matchLen]) {
+            matchLen++;
+        }
+
+        if (!(op = lz4WriteSequence(op, oend, src + anchor, ip - anchor, ip - ref, matchLen))) {
+            return -1;
+        }
+        ip += matchLen;
+        anchor = ip;
+    }
+
+    if (!(op = lz4WriteSequence(op, oend, src + anchor, srcLen - anchor, 0, 0))) {
+        return -1;
+    }
+    return op - dst;
+}
+
+
+// reads a 255-run length extension, -1 when it runs off the input
+static int lz4ReadLength(const uint8_t **ip, const uint8_t *iend)
+{
+    int length = 0;
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+
+int mspLz4Decompress(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srcLen;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dstCapacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int literalLen = token >> 4;
+        int matchLen = token & 15;
+        int offset;
+        int extra;
+
+        if (literalLen == 15) {
+            if ((extra = lz4ReadLength(&ip, iend)) < 0) {
+                return -1;
+            }
+            literalLen += extra;
+        }
+        if (literalLen > iend - ip || literalLen > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, literalLen);
+        ip += literalLen;
+        op += literalLen;
+
+        if (ip == iend) {
+            break;                              // the last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > op - dst) {
+            return -1;
+        }
+
+        if (matchLen == 15) {
+            if ((extra = lz4ReadLength(&ip, iend)) < 0) {
+                return -1;
+            }
+            matchLen += extra;
+        }
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > oend - op) {
+            return -1;
+        }
+
+        // byte by byte, the match may overlap the bytes it produces
+        const uint8_t *match = op - offset;
+        while (matchLen--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
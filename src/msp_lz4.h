@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+
+// LZ4 block format, sized for MSP payloads. Both return the output length, or -1 when the output
+// would not fit in dstCapacity (or, for decompression, the input is malformed).
+int mspLz4Compress(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity);
+int mspLz4Decompress(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity);
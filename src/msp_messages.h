@@ -0,0 +1,174 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "msp_protocol.h"
+#include "lib.h"
+
+/*
+ * Wire layouts of the fixed size MSP payloads.
+ *
+ * Each message is a packed struct whose size is checked against the protocol at compile time.
+ * Handlers fill the struct with little endian values (htole16/htole32) and write it with a single
+ * sbufWriteMessage(), which the compiler turns into a few unaligned stores. The same descriptors
+ * give the dispatcher the exact reply size up front, see mspFixedReplySize().
+ */
+
+#define MSP_PACKED __attribute__((packed))
+#define MSP_MESSAGE_SIZE(type, size) _Static_assert(sizeof(type) == (size), #type " does not match the protocol")
+
+typedef struct MSP_PACKED {
+    uint8_t protocolVersion;
+    uint8_t apiVersionMajor;
+    uint8_t apiVersionMinor;
+} mspApiVersion_t;
+MSP_MESSAGE_SIZE(mspApiVersion_t, 3);
+
+typedef struct MSP_PACKED {
+    char identifier[FLIGHT_CONTROLLER_IDENTIFIER_LENGTH];
+    uint8_t versionMajor;
+    uint8_t versionMinor;
+    uint8_t versionPatchLevel;
+} mspFcVariant_t;
+MSP_MESSAGE_SIZE(mspFcVariant_t, 7);
+
+typedef struct MSP_PACKED {
+    char boardIdentifier[6];
+    uint16_t hardwareRevision;
+    uint8_t boardType;                      // 0 == FC, 1 == OSD, 2 == FC with OSD
+} mspBoardInfo_t;
+MSP_MESSAGE_SIZE(mspBoardInfo_t, 9);
+
+typedef struct MSP_PACKED {
+    char buildDate[11];
+    char buildTime[8];
+    char gitRevision[7];
+} mspBuildInfo_t;
+MSP_MESSAGE_SIZE(mspBuildInfo_t, 26);
+
+typedef struct MSP_PACKED {
+    uint8_t version;
+    uint8_t multiType;
+    uint8_t mspVersion;
+    uint32_t capability;
+} mspIdent_t;
+MSP_MESSAGE_SIZE(mspIdent_t, 7);
+
+typedef struct MSP_PACKED {
+    uint16_t cycleTime;
+    uint16_t i2cErrors;
+    uint16_t sensors;
+    uint32_t flightModeFlags;
+    uint8_t currentProfile;
+    uint16_t systemLoad;
+} mspStatus_t;
+MSP_MESSAGE_SIZE(mspStatus_t, 13);
+
+typedef struct MSP_PACKED {
+    uint32_t uid[3];
+} mspUid_t;
+MSP_MESSAGE_SIZE(mspUid_t, 12);
+
+typedef struct MSP_PACKED {
+    uint8_t vbatMinCellVoltage;
+    uint8_t vbatMaxCellVoltage;
+    uint8_t vbatWarningCellVoltage;
+    uint16_t batteryCapacity;
+    uint8_t amperageMeterSource;
+} mspBatteryConfig_t;
+MSP_MESSAGE_SIZE(mspBatteryConfig_t, 6);
+
+typedef struct MSP_PACKED {
+    uint16_t pitch;
+    uint16_t roll;
+} mspAccTrim_t;
+MSP_MESSAGE_SIZE(mspAccTrim_t, 4);
+
+typedef struct MSP_PACKED {
+    uint16_t midrc;
+    uint16_t minthrottle;
+    uint16_t maxthrottle;
+    uint16_t mincommand;
+    uint16_t failsafeThrottle;
+    uint8_t gpsType;
+    uint8_t gpsBaudrate;
+    uint8_t gpsUbxSbas;
+    uint8_t multiwiiCurrentMeterOutput;
+    uint8_t rssiChannel;
+    uint8_t placeholder;
+    uint16_t magDeclination;
+} mspMisc_t;
+MSP_MESSAGE_SIZE(mspMisc_t, 18);
+
+typedef struct MSP_PACKED {
+    int16_t roll;                           // deci-degrees
+    int16_t pitch;                          // deci-degrees
+    int16_t yaw;                            // degrees
+} mspAttitude_t;
+MSP_MESSAGE_SIZE(mspAttitude_t, 6);
+
+typedef struct MSP_PACKED {
+    int16_t acc[3];                         // 512 = 1 g
+    int16_t gyro[3];                        // deg/s
+    int16_t mag[3];                         // raw
+} mspRawImu_t;
+MSP_MESSAGE_SIZE(mspRawImu_t, 18);
+
+typedef struct MSP_PACKED {
+    uint8_t vbat;
+    uint16_t mAhDrawn;
+    uint16_t rssi;
+    int16_t amperage;                       // 0.001 A steps
+} mspAnalog_t;
+MSP_MESSAGE_SIZE(mspAnalog_t, 7);
+
+typedef struct MSP_PACKED {
+    uint8_t cmd;
+    uint16_t periodMs;
+} mspTelemetrySubscription_t;
+MSP_MESSAGE_SIZE(mspTelemetrySubscription_t, 3);
+
+// command -> reply layout, for every command whose reply size never changes
+#define MSP_FIXED_SIZE_REPLIES(X) \
+    X(MSP_API_VERSION, mspApiVersion_t) \
+    X(MSP_FC_VARIANT, mspFcVariant_t) \
+    X(MSP_BOARD_INFO, mspBoardInfo_t) \
+    X(MSP_BUILD_INFO, mspBuildInfo_t) \
+    X(MSP_IDENT, mspIdent_t) \
+    X(MSP_STATUS, mspStatus_t) \
+    X(MSP_UID, mspUid_t) \
+    X(MSP_BATTERY_CONFIG, mspBatteryConfig_t) \
+    X(MSP_ACC_TRIM, mspAccTrim_t) \
+    X(MSP_MISC, mspMisc_t) \
+    X(MSP_ATTITUDE, mspAttitude_t) \
+    X(MSP_RAW_IMU, mspRawImu_t) \
+    X(MSP_ANALOG, mspAnalog_t)
+
+#define MSP_REPLY_SIZE_UNKNOWN -1
+
+// exact payload size of the reply to cmd, or MSP_REPLY_SIZE_UNKNOWN when it depends on state
+static inline int mspFixedReplySize(uint8_t cmd)
+{
+    switch (cmd) {
+#define MSP_FIXED_REPLY_SIZE_CASE(command, type) case command: return sizeof(type);
+        MSP_FIXED_SIZE_REPLIES(MSP_FIXED_REPLY_SIZE_CASE)
+#undef MSP_FIXED_REPLY_SIZE_CASE
+        default:
+            return MSP_REPLY_SIZE_UNKNOWN;
+    }
+}
+
+#define sbufWriteMessage(dst, msg) sbufWriteData((dst), &(msg), sizeof(msg))
+
+// copies a whole message out of src, false if the payload is too short for it
+#define sbufReadMessage(src, msg) sbufReadMessageData((src), &(msg), sizeof(msg))
+
+static inline bool sbufReadMessageData(sbuf_t *src, void *msg, int size)
+{
+    if (src->end - src->ptr < size) {
+        return false;
+    }
+    memcpy(msg, src->ptr, size);
+    src->ptr += size;
+    return true;
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_protocol.h"
+#include "msp_frame.h"
+#include "msp_osd.h"
+#include "msp_ahrs.h"
+
+#define MSP_OSD_FRAME_OVERHEAD 6                // $ M direction size cmd ... checksum
+#define MSP_OSD_CLEAR_FRAME_SIZE (MSP_OSD_FRAME_OVERHEAD + 1)
+
+static mspOsdCanvas_t canvas;                   // drawn from scratch every cycle
+static mspOsdCanvas_t shown;                    // what the display has, as far as it was sent
+static mspOsdCanvas_t blank;
+static mspOsdRun_t runs[MSP_OSD_CELLS];
+static mspOsdRun_t blankRuns[MSP_OSD_CELLS];
+
+static mspPort_t *display;
+static bool displayUnknown;                     // next cycle clears the screen and redraws all of it
+static mspFrame_t *lastCycleFrame;              // held until the next cycle, still queued while shared
+static uint8_t fps = MSP_OSD_DEFAULT_FPS;
+static uint32_t nextCycleAt;
+static uint32_t claimedAt;
+
+static void mspOsdDrawHud(mspOsdCanvas_t *target);
+static mspOsdDrawFnPtr drawFn = mspOsdDrawHud;
+
+static mspOsdElement_t layout[MSP_OSD_ELEMENT_COUNT] = {
+    [MSP_OSD_ELEMENT_RSSI]      = { .row = 0,  .col = 1,  .visible = true },
+    [MSP_OSD_ELEMENT_VOLTAGE]   = { .row = 14, .col = 1,  .visible = true },
+    [MSP_OSD_ELEMENT_MAH_DRAWN] = { .row = 14, .col = 10, .visible = true },
+    [MSP_OSD_ELEMENT_TIMER]     = { .row = 14, .col = 23, .visible = true },
+    [MSP_OSD_ELEMENT_CROSSHAIR] = { .row = 7,  .col = 13, .visible = true },
+    [MSP_OSD_ELEMENT_ATTITUDE]  = { .row = 1,  .col = 1,  .visible = true },
+    [MSP_OSD_ELEMENT_HEADING]   = { .row = 0,  .col = 13, .visible = true },
+};
+
+static uint8_t font[MSP_OSD_FONT_CHARS][MSP_OSD_FONT_CHAR_SIZE];
+
+static mspOsdStats_t stats;
+
+
+void mspOsdSetDrawFn(mspOsdDrawFnPtr fn)
+{
+    drawFn = fn ? fn : mspOsdDrawHud;
+}
+
+
+static void mspOsdDrawElement(mspOsdCanvas_t *target, mspOsdElement_e element, const char *text)
+{
+    if (layout[element].visible) {
+        mspOsdCanvasWrite(target, layout[element].row, layout[element].col, 0, text);
+    }
+}
+
+
+static void mspOsdDrawHud(mspOsdCanvas_t *target)
+{
+    mspAnalogState_t analog;
+    mspAhrsAttitude_t attitude;
+    uint32_t seconds = (millis() - claimedAt) / 1000;
+    char text[32];
+
+    // straight from the state MSP_ANALOG and MSP_ATTITUDE report, no command round trip
+    mspGetAnalogState(&analog);
+    snprintf(text, sizeof(text), "%2u", (analog.rssi > 1023 ? 1023 : analog.rssi) * 99 / 1023);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_RSSI, text);
+    snprintf(text, sizeof(text), "%2u.%uV", analog.vbat / 10, analog.vbat % 10);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_VOLTAGE, text);
+    snprintf(text, sizeof(text), "%5uMAH", analog.mAhDrawn);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_MAH_DRAWN, text);
+
+    mspAhrsGetAttitude(&attitude);
+    snprintf(text, sizeof(text), "R%4d P%4d", attitude.roll / 10, attitude.pitch / 10);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_ATTITUDE, text);
+    snprintf(text, sizeof(text), "%03d", (attitude.heading % 360 + 360) % 360);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_HEADING, text);
+
+    snprintf(text, sizeof(text), "%02u:%02u", seconds / 60 % 100, seconds % 60);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_TIMER, text);
+    mspOsdDrawElement(target, MSP_OSD_ELEMENT_CROSSHAIR, "-+-");
+}
+
+
+static void mspOsdRelease(void)
+{
+    display = NULL;
+    if (lastCycleFrame) {
+        mspFrameRelease(lastCycleFrame);
+        lastCycleFrame = NULL;
+    }
+}
+
+
+static void mspOsdClaim(mspPort_t *msp, uint8_t rows, uint8_t cols)
+{
+    if (display != msp || rows != canvas.rows || cols != canvas.cols) {
+        mspOsdRelease();
+        mspOsdCanvasInit(&canvas, rows, cols);
+        mspOsdCanvasInit(&shown, rows, cols);
+        mspOsdCanvasInit(&blank, rows, cols);
+        displayUnknown = true;
+        claimedAt = millis();
+        nextCycleAt = claimedAt;
+    }
+    display = msp;
+}
+
+
+// MSP_DISPLAYPORT from the display: a heartbeat claims the OSD for this port, at the given size,
+// and keeps the claim alive. The reply is the size actually used. A release hands the OSD back.
+void mspOsdProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply)
+{
+    sbuf_t *src = &command->buf;
+
+    reply->cmd = command->cmd;
+    reply->result = 1;
+
+    switch (sbufBytesRemaining(src) ? sbufReadU8(src) : 0xff) {
+        case MSP_DISPLAYPORT_HEARTBEAT: {
+            uint8_t rows = MSP_OSD_DEFAULT_ROWS;
+            uint8_t cols = MSP_OSD_DEFAULT_COLS;
+            if (sbufBytesRemaining(src) >= 2) {
+                rows = sbufReadU8(src);
+                cols = sbufReadU8(src);
+            }
+            if (!rows || !cols) {
+                reply->result = -1;
+                break;
+            }
+            mspOsdClaim(msp, rows, cols);
+            sbufWriteU8(&reply->buf, canvas.rows);
+            sbufWriteU8(&reply->buf, canvas.cols);
+            break;
+        }
+        case MSP_DISPLAYPORT_RELEASE:
+            if (display == msp) {
+                mspOsdRelease();
+            }
+            break;
+        default:
+            reply->result = -1;
+            break;
+    }
+}
+
+
+// the OSD configuration commands, they do not depend on the port
+int mspOsdCommandHandler(mspPacket_t *cmd, mspPacket_t *reply)
+{
+    sbuf_t *dst = &reply->buf;
+    sbuf_t *src = &cmd->buf;
+    int i;
+
+    switch (cmd->cmd) {
+        case MSP_OSD_CONFIG:
+            sbufWriteU8(dst, display != NULL);
+            sbufWriteU8(dst, display ? canvas.rows : MSP_OSD_DEFAULT_ROWS);
+            sbufWriteU8(dst, display ? canvas.cols : MSP_OSD_DEFAULT_COLS);
+            sbufWriteU8(dst, fps);
+            sbufWriteU8(dst, MSP_OSD_ELEMENT_COUNT);
+            break;
+
+        case MSP_SET_OSD_CONFIG: {
+            uint8_t value = sbufBytesRemaining(src) ? sbufReadU8(src) : 0;
+            if (!value || value > MSP_OSD_MAX_FPS) {
+                return -1;
+            }
+            fps = value;
+            break;
+        }
+
+        case MSP_OSD_CHAR_READ: {
+            if (sbufBytesRemaining(src) < 1) {
+                return -1;
+            }
+            uint8_t address = sbufReadU8(src);
+            sbufWriteU8(dst, address);
+            sbufWriteData(dst, font[address], MSP_OSD_FONT_CHAR_SIZE);
+            break;
+        }
+
+        case MSP_OSD_CHAR_WRITE: {
+            if (sbufBytesRemaining(src) < 1 + MSP_OSD_FONT_CHAR_SIZE) {
+                return -1;
+            }
+            uint8_t address = sbufReadU8(src);  // read first, argument evaluation order is unspecified
+            memcpy(font[address], src->ptr, MSP_OSD_FONT_CHAR_SIZE);
+            break;
+        }
+
+        case MSP_OSD_LAYOUT_CONFIG:
+            for (i = 0; i < MSP_OSD_ELEMENT_COUNT; i++) {
+                sbufWriteU8(dst, i);
+                sbufWriteU8(dst, layout[i].row);
+                sbufWriteU8(dst, layout[i].col);
+                sbufWriteU8(dst, layout[i].visible);
+            }
+            break;
+
+        case MSP_SET_OSD_LAYOUT_CONFIG: {
+            if (sbufBytesRemaining(src) < 4) {
+                return -1;
+            }
+            uint8_t element = sbufReadU8(src);
+            if (element >= MSP_OSD_ELEMENT_COUNT) {
+                return -1;
+            }
+            layout[element].row = sbufReadU8(src);
+            layout[element].col = sbufReadU8(src);
+            layout[element].visible = sbufReadU8(src);
+            break;
+        }
+
+        default:
+            return -1;
+    }
+    return 1;
+}
+
+
+// queues a frame whose payload is already in place, the last one queued is kept for backpressure
+static bool mspOsdPush(mspPort_t *msp, mspFrame_t *frame, int length)
+{
+    mspPacket_t packet = {
+        .buf = {
+            .ptr = mspFramePayload(frame),
+            .end = mspFramePayload(frame) + length,
+        },
+        .cmd = MSP_DISPLAYPORT,
+        .result = 0,
+    };
+
+    mspSerialEncodeFrame(frame, '>', &packet);
+    if (!mspSerialSubmitFrame(msp, frame, MSP_TX_PRIORITY_TELEMETRY)) {
+        mspFrameRelease(frame);
+        return false;
+    }
+
+    stats.frames++;
+    stats.bytes += frame->length;
+    if (lastCycleFrame) {
+        mspFrameRelease(lastCycleFrame);
+    }
+    lastCycleFrame = frame;
+    return true;
+}
+
+
+static bool mspOsdPushSubcommand(mspPort_t *msp, uint8_t subcommand)
+{
+    mspFrame_t *frame = mspFrameAlloc();
+
+    if (!frame) {
+        return false;
+    }
+    mspFramePayload(frame)[0] = subcommand;
+    return mspOsdPush(msp, frame, 1);
+}
+
+
+static bool mspOsdPushRuns(mspPort_t *msp, const mspOsdRun_t *cycleRuns, int count)
+{
+    mspOsdPackCursor_t cursor = { 0 };
+
+    for (;;) {
+        mspFrame_t *frame = mspFrameAlloc();
+        if (!frame) {
+            return false;
+        }
+
+        uint8_t *payload = mspFramePayload(frame);
+        payload[0] = MSP_DISPLAYPORT_WRITE_RUNS;
+        int length = mspOsdCanvasPack(&canvas, cycleRuns, count, &cursor, payload + 1, MSP_OSD_MAX_PAYLOAD - 1);
+        if (!length) {
+            mspFrameRelease(frame);
+            return true;
+        }
+        if (!mspOsdPush(msp, frame, 1 + length)) {
+            return false;
+        }
+    }
+}
+
+
+static void mspOsdCycle(mspPort_t *msp)
+{
+    mspOsdUpdate_t update;
+
+    mspOsdCanvasClear(&canvas);
+    drawFn(&canvas);
+
+    // one Betaflight style write string per row and a draw
+    stats.fullRedrawBytes += canvas.rows * (MSP_OSD_FRAME_OVERHEAD + MSP_OSD_RUN_HEADER_SIZE + canvas.cols) + MSP_OSD_FRAME_OVERHEAD + 1;
+
+    mspOsdCanvasPlanUpdate(displayUnknown ? NULL : &shown, &blank, &canvas, MSP_OSD_CLEAR_FRAME_SIZE, runs, blankRuns, &update);
+    if (!update.clear && !update.count) {
+        stats.idleCycles++;
+        return;
+    }
+
+    bool sent = (!update.clear || mspOsdPushSubcommand(msp, MSP_DISPLAYPORT_CLEAR)) &&
+                mspOsdPushRuns(msp, update.runs, update.count) &&
+                mspOsdPushSubcommand(msp, MSP_DISPLAYPORT_DRAW);
+
+    // a cycle that did not fully go out leaves the screen in an unknown state, start over
+    displayUnknown = !sent;
+    if (sent) {
+        memcpy(&shown, &canvas, sizeof(shown));
+    }
+    stats.cycles++;
+    stats.clears += update.clear;
+}
+
+
+void mspOsdProcess(mspPort_t *msp)
+{
+    uint32_t now = millis();
+
+    if (msp != display) {
+        return;
+    }
+
+    if (now - msp->lastActivityAt > MSP_OSD_HEARTBEAT_TIMEOUT_MS) {
+        mspOsdRelease();
+        return;
+    }
+
+    if ((int32_t)(now - nextCycleAt) < 0) {
+        return;
+    }
+    nextCycleAt += 1000 / fps;
+    if ((int32_t)(now - nextCycleAt) >= 0) {
+        nextCycleAt = now + 1000 / fps;         // fell behind, skip rather than burst to catch up
+    }
+
+    if (lastCycleFrame && atomic_load(&lastCycleFrame->refCount) > 1) {
+        stats.deferred++;                       // the link has not caught up with the last cycle
+        return;
+    }
+
+    mspOsdCycle(msp);
+}
+
+
+// how long the receive path may block before the next draw cycle is due
+uint32_t mspOsdTimeUntilDueMs(mspPort_t *msp)
+{
+    uint32_t now = millis();
+
+    if (msp != display) {
+        return UINT32_MAX;
+    }
+    return (int32_t)(nextCycleAt - now) <= 0 ? 0 : nextCycleAt - now;
+}
+
+
+const mspOsdStats_t *mspOsdGetStats(void)
+{
+    return &stats;
+}
+
+
+void mspOsdReport(void)
+{
+    if (!stats.cycles && !stats.idleCycles) {
+        return;
+    }
+    fprintf(stderr, "osd %u cycles sent (%u cleared), %u unchanged, %u deferred, %u frames, %llu bytes, full redraws %llu bytes (%.1fx)\n",
+            stats.cycles, stats.clears, stats.idleCycles, stats.deferred, stats.frames, (unsigned long long)stats.bytes,
+            (unsigned long long)stats.fullRedrawBytes, stats.bytes ? (double)stats.fullRedrawBytes / stats.bytes : 0.0);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "lib.h"
+#include "msp_osd_canvas.h"
+
+#define MSP_OSD_DEFAULT_ROWS 16                 // PAL analog OSD
+#define MSP_OSD_DEFAULT_COLS 30
+#define MSP_OSD_DEFAULT_FPS 10
+#define MSP_OSD_MAX_FPS 50
+#define MSP_OSD_HEARTBEAT_TIMEOUT_MS 3000       // the display is released when its port goes quiet for this long
+#define MSP_OSD_MAX_PAYLOAD 255                 // MSP v1 size byte
+#define MSP_OSD_FONT_CHARS 256
+#define MSP_OSD_FONT_CHAR_SIZE 54               // 12x18 pixels, 2 bits each, as the MAX7456 stores them
+
+// MSP_DISPLAYPORT subcommands, numbered as in Betaflight where they exist there
+#define MSP_DISPLAYPORT_HEARTBEAT 0             // from the display, claims the OSD: optional U8 rows + U8 cols
+#define MSP_DISPLAYPORT_RELEASE 1               // from the display
+#define MSP_DISPLAYPORT_CLEAR 2                 // pushed
+#define MSP_DISPLAYPORT_DRAW 4                  // pushed, ends a draw cycle
+#define MSP_DISPLAYPORT_WRITE_RUNS 5            // pushed, runs as described in msp_osd_canvas.h
+
+typedef enum {
+    MSP_OSD_ELEMENT_RSSI,
+    MSP_OSD_ELEMENT_VOLTAGE,
+    MSP_OSD_ELEMENT_MAH_DRAWN,
+    MSP_OSD_ELEMENT_TIMER,
+    MSP_OSD_ELEMENT_CROSSHAIR,
+    MSP_OSD_ELEMENT_ATTITUDE,
+    MSP_OSD_ELEMENT_HEADING,
+    MSP_OSD_ELEMENT_COUNT
+} mspOsdElement_e;
+
+typedef struct mspOsdElement_s {
+    uint8_t row;
+    uint8_t col;
+    bool visible;
+} mspOsdElement_t;
+
+typedef struct mspOsdStats_s {
+    uint32_t cycles;                            // draw cycles that sent something
+    uint32_t idleCycles;                        // nothing changed, nothing sent
+    uint32_t deferred;                          // skipped, the previous cycle was still queued
+    uint32_t clears;
+    uint32_t frames;
+    uint64_t bytes;                             // on the wire, frame overhead included
+    uint64_t fullRedrawBytes;                   // what one write per row each cycle would have taken
+} mspOsdStats_t;
+
+/*
+ * DisplayPort style OSD server.
+ *
+ * A display claims the OSD by sending MSP_DISPLAYPORT heartbeats. At most fps times a second
+ * the canvas is cleared and handed to the draw function, which by default draws the HUD
+ * elements of the layout. Only the cells that differ from what the display already shows are
+ * pushed, packed as runs into as few MSP_DISPLAYPORT frames as fit, followed by a draw. When
+ * most of the screen changed a clear plus the non-blank cells is sent instead. A cycle is
+ * skipped while the frames of the previous one are still queued for the port.
+ */
+typedef void (*mspOsdDrawFnPtr)(mspOsdCanvas_t *canvas);
+
+void mspOsdSetDrawFn(mspOsdDrawFnPtr fn);
+void mspOsdProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply);
+int mspOsdCommandHandler(mspPacket_t *cmd, mspPacket_t *reply);
+void mspOsdProcess(mspPort_t *msp);
+uint32_t mspOsdTimeUntilDueMs(mspPort_t *msp);
+const mspOsdStats_t *mspOsdGetStats(void);
+void mspOsdReport(void);
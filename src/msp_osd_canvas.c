@@ -0,0 +1,147 @@
+#include <string.h>
+#include "msp_osd_canvas.h"
+
+
+void mspOsdCanvasInit(mspOsdCanvas_t *canvas, uint8_t rows, uint8_t cols)
+{
+    canvas->rows = rows > MSP_OSD_MAX_ROWS ? MSP_OSD_MAX_ROWS : rows;
+    canvas->cols = cols > MSP_OSD_MAX_COLS ? MSP_OSD_MAX_COLS : cols;
+    mspOsdCanvasClear(canvas);
+}
+
+
+void mspOsdCanvasClear(mspOsdCanvas_t *canvas)
+{
+    memset(canvas->chars, MSP_OSD_BLANK, canvas->rows * canvas->cols);
+    memset(canvas->attrs, 0, canvas->rows * canvas->cols);
+}
+
+
+// clipped at the end of the row, text never wraps
+void mspOsdCanvasWrite(mspOsdCanvas_t *canvas, uint8_t row, uint8_t col, uint8_t attr, const char *text)
+{
+    if (row >= canvas->rows) {
+        return;
+    }
+    for (; *text && col < canvas->cols; text++, col++) {
+        canvas->chars[row * canvas->cols + col] = *text;
+        canvas->attrs[row * canvas->cols + col] = attr;
+    }
+}
+
+
+void mspOsdCanvasWriteChar(mspOsdCanvas_t *canvas, uint8_t row, uint8_t col, uint8_t attr, uint8_t c)
+{
+    if (row >= canvas->rows || col >= canvas->cols) {
+        return;
+    }
+    canvas->chars[row * canvas->cols + col] = c;
+    canvas->attrs[row * canvas->cols + col] = attr;
+}
+
+
+static bool mspOsdCellChanged(const mspOsdCanvas_t *from, const mspOsdCanvas_t *to, int cell)
+{
+    return from->chars[cell] != to->chars[cell] || from->attrs[cell] != to->attrs[cell];
+}
+
+
+// Runs that turn from into to. A run is extended over unchanged cells as long as the gap is no
+// longer than a run header, and only over cells with its attribute, so it never rewrites a cell
+// with a different one. There are at most MSP_OSD_CELLS runs.
+int mspOsdCanvasDiff(const mspOsdCanvas_t *from, const mspOsdCanvas_t *to, mspOsdRun_t *runs)
+{
+    int cells = to->rows * to->cols;
+    int count = 0;
+    int cell = 0;
+
+    while (cell < cells) {
+        if (!mspOsdCellChanged(from, to, cell)) {
+            cell++;
+            continue;
+        }
+
+        int start = cell;
+        int last = cell;                        // last changed cell of the run
+        uint8_t attr = to->attrs[start];
+
+        for (cell = start + 1; cell < cells && cell - start < MSP_OSD_MAX_RUN_LENGTH && to->attrs[cell] == attr; cell++) {
+            if (mspOsdCellChanged(from, to, cell)) {
+                last = cell;
+            } else if (cell - last > MSP_OSD_RUN_HEADER_SIZE) {
+                break;
+            }
+        }
+
+        runs[count++] = (mspOsdRun_t){ .start = start, .length = last - start + 1, .attr = attr };
+        cell = last + 1;
+    }
+    return count;
+}
+
+
+// encoded size of the runs, without any frame overhead
+int mspOsdRunsSize(const mspOsdRun_t *runs, int count)
+{
+    int size = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        size += MSP_OSD_RUN_HEADER_SIZE + runs[i].length;
+    }
+    return size;
+}
+
+
+// Either the runs from what the display shows, or a clear and the runs from a blank screen when
+// that is smaller, which it is once most of the screen changed. A display in an unknown state is
+// always cleared. runs and blankRuns need room for MSP_OSD_CELLS entries each.
+void mspOsdCanvasPlanUpdate(const mspOsdCanvas_t *shown, const mspOsdCanvas_t *blank, const mspOsdCanvas_t *canvas,
+                            int clearSize, mspOsdRun_t *runs, mspOsdRun_t *blankRuns, mspOsdUpdate_t *update)
+{
+    update->clear = !shown;
+    update->runs = runs;
+    update->count = mspOsdCanvasDiff(shown ? shown : blank, canvas, runs);
+
+    if (!update->clear && update->count) {
+        int blankCount = mspOsdCanvasDiff(blank, canvas, blankRuns);
+        if (clearSize + mspOsdRunsSize(blankRuns, blankCount) < mspOsdRunsSize(runs, update->count)) {
+            update->clear = true;
+            update->runs = blankRuns;
+            update->count = blankCount;
+        }
+    }
+}
+
+
+// Encodes runs from the cursor on into dst until it is full, splitting a run that does not fit.
+// Returns the bytes written, 0 once every run is packed.
+int mspOsdCanvasPack(const mspOsdCanvas_t *canvas, const mspOsdRun_t *runs, int count, mspOsdPackCursor_t *cursor,
+                     uint8_t *dst, int capacity)
+{
+    int used = 0;
+
+    while (cursor->run < count && capacity - used > MSP_OSD_RUN_HEADER_SIZE) {
+        const mspOsdRun_t *run = &runs[cursor->run];
+        int start = run->start + cursor->offset;
+        int length = run->length - cursor->offset;
+
+        if (length > capacity - used - MSP_OSD_RUN_HEADER_SIZE) {
+            length = capacity - used - MSP_OSD_RUN_HEADER_SIZE;
+        }
+
+        dst[used++] = start / canvas->cols;
+        dst[used++] = start % canvas->cols;
+        dst[used++] = run->attr;
+        dst[used++] = length;
+        memcpy(dst + used, canvas->chars + start, length);
+        used += length;
+
+        cursor->offset += length;
+        if (cursor->offset == run->length) {
+            cursor->run++;
+            cursor->offset = 0;
+        }
+    }
+    return used;
+}
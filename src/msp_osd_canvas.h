@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MSP_OSD_MAX_ROWS 20
+#define MSP_OSD_MAX_COLS 60
+#define MSP_OSD_CELLS (MSP_OSD_MAX_ROWS * MSP_OSD_MAX_COLS)
+#define MSP_OSD_RUN_HEADER_SIZE 4               // row, col, attr, length in front of the characters
+#define MSP_OSD_MAX_RUN_LENGTH 255
+#define MSP_OSD_BLANK ' '
+
+/*
+ * Character grid of a DisplayPort style OSD and the diff between two of them.
+ *
+ * Cells are stored row-major with a stride of cols, so a run may start anywhere and carry on
+ * past the end of a row into the next one. A run of changed cells swallows short stretches of
+ * unchanged ones when that is cheaper than the header of a new run. Runs are encoded as
+ * U8 row, U8 col, U8 attr, U8 length and the characters. All cells of a run share one attribute.
+ */
+typedef struct mspOsdCanvas_s {
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t chars[MSP_OSD_CELLS];
+    uint8_t attrs[MSP_OSD_CELLS];
+} mspOsdCanvas_t;
+
+typedef struct mspOsdRun_s {
+    uint16_t start;                             // cell index, row * cols + col
+    uint8_t length;
+    uint8_t attr;
+} mspOsdRun_t;
+
+// what one draw cycle sends to bring the display up to date
+typedef struct mspOsdUpdate_s {
+    bool clear;                                 // clear the screen before the runs are written
+    const mspOsdRun_t *runs;                    // one of the two run buffers given to the planner
+    int count;
+} mspOsdUpdate_t;
+
+// cursor for packing a run list into payloads of limited size, zero it before the first call
+typedef struct mspOsdPackCursor_s {
+    int run;
+    int offset;                                 // characters of runs[run] already packed
+} mspOsdPackCursor_t;
+
+void mspOsdCanvasInit(mspOsdCanvas_t *canvas, uint8_t rows, uint8_t cols);
+void mspOsdCanvasClear(mspOsdCanvas_t *canvas);
+void mspOsdCanvasWrite(mspOsdCanvas_t *canvas, uint8_t row, uint8_t col, uint8_t attr, const char *text);
+void mspOsdCanvasWriteChar(mspOsdCanvas_t *canvas, uint8_t row, uint8_t col, uint8_t attr, uint8_t c);
+
+// runs needs room for MSP_OSD_CELLS entries, from and to must have the same size
+int mspOsdCanvasDiff(const mspOsdCanvas_t *from, const mspOsdCanvas_t *to, mspOsdRun_t *runs);
+int mspOsdRunsSize(const mspOsdRun_t *runs, int count);
+// shown is NULL when the display state is unknown, blank is a blank canvas of the same size and
+// clearSize what a clear costs on top of the runs
+void mspOsdCanvasPlanUpdate(const mspOsdCanvas_t *shown, const mspOsdCanvas_t *blank, const mspOsdCanvas_t *canvas,
+                            int clearSize, mspOsdRun_t *runs, mspOsdRun_t *blankRuns, mspOsdUpdate_t *update);
+int mspOsdCanvasPack(const mspOsdCanvas_t *canvas, const mspOsdRun_t *runs, int count, mspOsdPackCursor_t *cursor,
+                     uint8_t *dst, int capacity);
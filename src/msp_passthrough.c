@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <netdb.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "msp_protocol.h"
+#include "msp_passthrough.h"
+
+/*
+ * Serial passthrough.
+ *
+ * MSP_PASSTHROUGH opens one of the targets given with -b and, once its reply has left the port,
+ * turns the port into a transparent bridge to it, the way firmware serial and ESC passthrough
+ * work. Bytes move fd to pipe to fd with splice(), so nothing is copied through user space and
+ * the MSP parser never sees them. A fd that cannot splice is read into the pipe instead.
+ *
+ * The bridge ends on MSP_PASSTHROUGH_ESCAPE from the host with MSP_PASSTHROUGH_GUARD_MS of host
+ * silence before and after it, when neither side sent anything for the idle timeout, or when
+ * either side hangs up. Only host bytes that follow a guard period are looked at, bulk data is
+ * spliced without inspection.
+ *
+ * The bridge owns the loop while it runs, other ports wait, as they do on a flight controller.
+ */
+
+#define MSP_PASSTHROUGH_PIPE_SIZE 65536
+
+typedef enum {
+    MSP_PASSTHROUGH_ESCAPE_NONE,                // host data is spliced through
+    MSP_PASSTHROUGH_ESCAPE_MATCHING,            // guard silence passed, host bytes are compared to the escape
+    MSP_PASSTHROUGH_ESCAPE_SEEN,                // whole escape received, waiting for the trailing guard
+} mspPassthroughEscape_e;
+
+typedef struct mspPassthroughDirection_s {
+    int from;
+    int to;
+    int pipe[2];
+    uint32_t queued;                            // bytes in the pipe not yet written to `to`
+    bool copy;                                  // `from` does not splice, read() into the pipe instead
+    uint64_t *bytes;
+} mspPassthroughDirection_t;
+
+static const char *targets[MSP_PASSTHROUGH_MAX_TARGETS];
+static int targetCount;
+
+static mspPort_t *pendingPort;                  // port that asked for a bridge and is still sending the reply
+static int pendingFd = -1;
+static uint16_t pendingIdleMs;
+
+static mspPassthroughStats_t passthroughStats;
+
+
+bool mspPassthroughAddTarget(const char *spec)
+{
+    if (targetCount == MSP_PASSTHROUGH_MAX_TARGETS) {
+        return false;
+    }
+    targets[targetCount++] = spec;
+    return true;
+}
+
+
+static speed_t mspPassthroughBaud(long baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B115200;
+    }
+}
+
+
+static int mspPassthroughOpenSerial(const char *spec)
+{
+    char path[PATH_MAX];
+    const char *at = strrchr(spec, '@');
+    long baud = 115200;
+    struct termios tty;
+    int fd;
+
+    if (at) {
+        baud = strtol(at + 1, NULL, 10);
+        snprintf(path, sizeof(path), "%.*s", (int)(at - spec), spec);
+    } else {
+        snprintf(path, sizeof(path), "%s", spec);
+    }
+
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // ptys and pipes have no line settings, that is fine
+    if (tcgetattr(fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        tty.c_cflag |= CLOCAL | CREAD;
+        cfsetispeed(&tty, mspPassthroughBaud(baud));
+        cfsetospeed(&tty, mspPassthroughBaud(baud));
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+    return fd;
+}
+
+
+static int mspPassthroughConnect(const char *spec)
+{
+    int fd = -1;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[64] = "";
+        const char *colon = strrchr(spec + 4, ':');
+        struct addrinfo hints;
+        struct addrinfo *res;
+
+        if (!colon) {
+            return -1;
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - (spec + 4)), spec + 4);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+            return -1;
+        }
+
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+
+static int mspPassthroughOpenTarget(const char *spec)
+{
+    if (strncmp(spec, "unix:", 5) == 0 || strncmp(spec, "tcp:", 4) == 0) {
+        return mspPassthroughConnect(spec);
+    }
+    return mspPassthroughOpenSerial(spec);
+}
+
+
+// MSP_PASSTHROUGH: the target is opened right away so a failure still gets an error reply. The
+// port only turns into a bridge in mspPassthroughProcess(), once this reply has gone out.
+void mspPassthroughProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply)
+{
+    sbuf_t *src = &command->buf;
+    uint8_t target = 0;
+    uint16_t idleMs = MSP_PASSTHROUGH_DEFAULT_IDLE_MS;
+
+    if (sbufBytesRemaining(src) >= 1) {
+        target = sbufReadU8(src);
+    }
+    if (sbufBytesRemaining(src) >= 2) {
+        idleMs = sbufReadU16(src);
+    }
+
+    reply->cmd = command->cmd;
+    reply->result = -1;
+
+    if (pendingPort || target >= targetCount || (pendingFd = mspPassthroughOpenTarget(targets[target])) < 0) {
+        msp->rxHeld = false;                    // no bridge, the bytes after the request are MSP again
+        return;
+    }
+
+    pendingPort = msp;
+    pendingIdleMs = idleMs;
+    sbufWriteU8(&reply->buf, target);
+    reply->result = 1;
+}
+
+
+static int mspPassthroughPortFd(mspPort_t *msp)
+{
+    return ((uartPort_t *)msp->port)->fd;   // usb and fd ports both start with a uartPort_t
+}
+
+
+// everything queued for the host before the bridge, the MSP_PASSTHROUGH reply included, goes out first
+static bool mspPassthroughFlushPort(mspPort_t *msp)
+{
+    uint32_t startedAt = millis();
+    struct pollfd pfd = { .fd = mspPassthroughPortFd(msp), .events = POLLOUT };
+
+    for (;;) {
+        mspSerialFlushTxQueue(msp);
+        serialEndWrite(msp->port);              // fd and channel ports have no usb ring to drain
+        if (!msp->txCurrent && isSerialTransmitBufferEmpty(msp->port)) {
+            return true;
+        }
+        if (millis() - startedAt > MSP_PASSTHROUGH_FLUSH_TIMEOUT_MS || pfd.fd < 0) {
+            return false;
+        }
+        poll(&pfd, 1, 10);
+    }
+}
+
+
+// false when the pipe took less than len, what it did take stays queued
+static bool mspPassthroughQueue(mspPassthroughDirection_t *direction, const uint8_t *data, int len)
+{
+    ssize_t written = len ? write(direction->pipe[1], data, len) : 0;
+
+    if (written > 0) {
+        direction->queued += written;
+    }
+    if (written != len) {
+        passthroughStats.shortWrites++;         // the caller ends the session
+        return false;
+    }
+    return true;
+}
+
+
+// Bytes the parser kept for a resync, or the serial layer already read from the host, belong in
+// front. Parsing stopped at the MSP_PASSTHROUGH request, so nothing after it was taken as MSP.
+static bool mspPassthroughTakeBuffered(mspPort_t *msp, mspPassthroughDirection_t *toTarget)
+{
+    uint8_t c;
+
+    if (!mspPassthroughQueue(toTarget, msp->resyncBuf + msp->resyncPos, msp->resyncLen - msp->resyncPos)) {
+        return false;
+    }
+
+    usbSetRxWaitTimeout(0);
+    while (serialRxBytesWaiting(msp->port)) {
+        c = serialRead(msp->port);
+        if (!mspPassthroughQueue(toTarget, &c, 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// moves what `from` has into the pipe, returns bytes moved, 0 when there was nothing and -1 on hangup
+static int mspPassthroughFill(mspPassthroughDirection_t *direction)
+{
+    uint32_t space = MSP_PASSTHROUGH_PIPE_SIZE - direction->queued;
+    ssize_t moved;
+
+    if (!space) {
+        return 0;
+    }
+
+    if (!direction->copy) {
+        moved = splice(direction->from, NULL, direction->pipe[1], NULL, space, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINVAL) {
+            direction->copy = true;
+            passthroughStats.copyFallback = true;
+        }
+    }
+    if (direction->copy) {
+        uint8_t buf[4096];
+        moved = read(direction->from, buf, space < sizeof(buf) ? space : sizeof(buf));
+        if (moved > 0 && !mspPassthroughQueue(direction, buf, moved)) {
+            return -1;
+        }
+        if (moved > 0) {
+            return moved;
+        }
+    }
+
+    if (moved == 0) {
+        return -1;                                  // end of file, the peer is gone
+    }
+    if (moved < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (!direction->copy) {
+        direction->queued += moved;
+    }
+    return moved;
+}
+
+
+static int mspPassthroughDrain(mspPassthroughDirection_t *direction)
+{
+    ssize_t moved;
+
+    if (!direction->queued) {
+        return 0;
+    }
+
+    moved = splice(direction->pipe[0], NULL, direction->to, NULL, direction->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    direction->queued -= moved;
+    *direction->bytes += moved;
+    return moved;
+}
+
+
+static bool mspPassthroughOpenPipe(mspPassthroughDirection_t *direction, int from, int to, uint64_t *bytes)
+{
+    direction->from = from;
+    direction->to = to;
+    direction->queued = 0;
+    direction->copy = false;
+    direction->bytes = bytes;
+
+    if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    fcntl(direction->pipe[1], F_SETPIPE_SZ, MSP_PASSTHROUGH_PIPE_SIZE);
+    return true;
+}
+
+
+static void mspPassthroughBridge(mspPort_t *msp, int targetFd, uint16_t idleMs)
+{
+    const int escapeLength = sizeof(MSP_PASSTHROUGH_ESCAPE) - 1;
+    mspPassthroughDirection_t toTarget;
+    mspPassthroughDirection_t toHost;
+    mspPassthroughEscape_e escape = MSP_PASSTHROUGH_ESCAPE_NONE;
+    int escapeMatched = 0;
+    int hostFd = mspPassthroughPortFd(msp);
+    uint32_t lastActivityAt = millis();
+    uint32_t lastHostAt = lastActivityAt;
+
+    if (!mspPassthroughOpenPipe(&toTarget, hostFd, targetFd, &passthroughStats.bytesToTarget)) {
+        return;
+    }
+    if (!mspPassthroughOpenPipe(&toHost, targetFd, hostFd, &passthroughStats.bytesFromTarget)) {
+        close(toTarget.pipe[0]);
+        close(toTarget.pipe[1]);
+        return;
+    }
+
+    passthroughStats.sessions++;
+    passthroughStats.copyFallback = false;
+    bool bridging = mspPassthroughTakeBuffered(msp, &toTarget);
+
+    while (bridging) {
+        struct pollfd fds[2] = {
+            { .fd = hostFd, .events = POLLIN | (toHost.queued ? POLLOUT : 0) },
+            { .fd = targetFd, .events = POLLIN | (toTarget.queued ? POLLOUT : 0) },
+        };
+        uint32_t now = millis();
+        int timeoutMs = MSP_PASSTHROUGH_GUARD_MS;
+        int moved = 0;
+        int n;
+
+        if (escape == MSP_PASSTHROUGH_ESCAPE_SEEN && now - lastHostAt >= MSP_PASSTHROUGH_GUARD_MS) {
+            break;
+        }
+        if (idleMs && now - lastActivityAt >= idleMs) {
+            break;
+        }
+        if (idleMs && idleMs - (now - lastActivityAt) < (uint32_t)timeoutMs) {
+            timeoutMs = idleMs - (now - lastActivityAt);
+        }
+        if (escape == MSP_PASSTHROUGH_ESCAPE_SEEN) {
+            timeoutMs = MSP_PASSTHROUGH_GUARD_MS - (now - lastHostAt);
+        }
+
+        poll(fds, 2, timeoutMs);
+        now = millis();
+
+        if (fds[0].revents & POLLIN) {
+            if (escape == MSP_PASSTHROUGH_ESCAPE_NONE && now - lastHostAt >= MSP_PASSTHROUGH_GUARD_MS) {
+                escape = MSP_PASSTHROUGH_ESCAPE_MATCHING;
+                escapeMatched = 0;
+            }
+
+            if (escape == MSP_PASSTHROUGH_ESCAPE_NONE) {
+                n = mspPassthroughFill(&toTarget);
+            } else {
+                // after a guard period host bytes are read one at a time until they stop looking like the escape
+                uint8_t c;
+                n = read(hostFd, &c, 1);
+                if (n == 1) {
+                    if (escape == MSP_PASSTHROUGH_ESCAPE_MATCHING && c == MSP_PASSTHROUGH_ESCAPE[escapeMatched]) {
+                        if (++escapeMatched == escapeLength) {
+                            escape = MSP_PASSTHROUGH_ESCAPE_SEEN;
+                        }
+                    } else {
+                        if (!mspPassthroughQueue(&toTarget, (const uint8_t *)MSP_PASSTHROUGH_ESCAPE, escapeMatched) ||
+                            !mspPassthroughQueue(&toTarget, &c, 1)) {
+                            break;
+                        }
+                        escape = MSP_PASSTHROUGH_ESCAPE_NONE;
+                    }
+                } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    n = 0;
+                } else {
+                    n = -1;
+                }
+            }
+            if (n < 0) {
+                break;
+            }
+            if (n > 0) {
+                lastHostAt = now;
+                moved += n;
+            }
+        } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if ((n = mspPassthroughFill(&toHost)) < 0) {
+                break;
+            }
+            moved += n;
+        } else if (fds[1].revents & (POLLHUP | POLLERR)) {
+            break;
+        }
+
+        if (mspPassthroughDrain(&toTarget) < 0 || mspPassthroughDrain(&toHost) < 0) {
+            break;
+        }
+
+        if (moved) {
+            lastActivityAt = now;
+        }
+    }
+
+    // whatever the target already sent still reaches the host, for a bounded time
+    uint32_t drainStartedAt = millis();
+    while (toHost.queued && millis() - drainStartedAt < MSP_PASSTHROUGH_FLUSH_TIMEOUT_MS) {
+        struct pollfd pfd = { .fd = hostFd, .events = POLLOUT };
+        poll(&pfd, 1, 10);
+        if (mspPassthroughDrain(&toHost) < 0) {
+            break;
+        }
+    }
+
+    close(toTarget.pipe[0]);
+    close(toTarget.pipe[1]);
+    close(toHost.pipe[0]);
+    close(toHost.pipe[1]);
+}
+
+
+// call for a server port after its replies went out, runs a requested bridge to completion
+void mspPassthroughProcess(mspPort_t *msp)
+{
+    int class;
+
+    if (pendingPort != msp || msp->replySeqEmit != msp->replySeqNext) {
+        return;
+    }
+    for (class = 0; class < MSP_CLASS_COUNT; class++) {
+        if (msp->rxQueues[class].count) {
+            return;                                 // received before the request, answered before the bridge
+        }
+    }
+
+    if (mspPassthroughFlushPort(msp)) {
+        mspPassthroughBridge(msp, pendingFd, pendingIdleMs);
+        fprintf(stderr, "passthrough: %llu bytes to target, %llu from target so far, %s, %u sessions cut by a short pipe write\n",
+                (unsigned long long)passthroughStats.bytesToTarget, (unsigned long long)passthroughStats.bytesFromTarget,
+                passthroughStats.copyFallback ? "read into the pipe" : "spliced", passthroughStats.shortWrites);
+    }
+
+    close(pendingFd);
+    pendingFd = -1;
+    pendingPort = NULL;
+
+    // back to MSP with a clean parser, anything half received belonged to the bridge
+    msp->c_state = IDLE;
+    msp->resyncPos = msp->resyncLen = 0;
+    msp->rxHeld = false;
+}
+
+
+const mspPassthroughStats_t *mspPassthroughGetStats(void)
+{
+    return &passthroughStats;
+}
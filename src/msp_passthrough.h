@@ -0,0 +1,22 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_PASSTHROUGH_MAX_TARGETS 4
+#define MSP_PASSTHROUGH_DEFAULT_IDLE_MS 10000   // bridge ends when neither side sent anything for this long
+#define MSP_PASSTHROUGH_GUARD_MS 1000           // silence required before and after the escape
+#define MSP_PASSTHROUGH_ESCAPE "+++"
+#define MSP_PASSTHROUGH_FLUSH_TIMEOUT_MS 500    // for the reply to MSP_PASSTHROUGH to leave the port
+
+typedef struct mspPassthroughStats_s {
+    uint32_t sessions;
+    uint64_t bytesToTarget;
+    uint64_t bytesFromTarget;
+    uint32_t shortWrites;                       // sessions ended because a pipe took less than was read
+    bool copyFallback;                          // the last session could not splice from one of the fds
+} mspPassthroughStats_t;
+
+// spec is a serial device as "<path>[@<baud>]", "tcp:<host>:<port>" or "unix:<path>"
+bool mspPassthroughAddTarget(const char *spec);
+void mspPassthroughProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply);
+void mspPassthroughProcess(mspPort_t *msp);
+const mspPassthroughStats_t *mspPassthroughGetStats(void);
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Statically defined tracepoints (USDT) on the parse, dispatch and transmit paths.
+ *
+ * Every probe is a single nop in the instruction stream plus an entry in the ELF .note.stapsdt
+ * section naming its provider, name, address and argument locations. bpftrace, perf and
+ * systemtap find the probes there and patch a breakpoint over the nop when attached, so there
+ * is nothing to enable at build or run time:
+ *
+ *   bpftrace -l 'usdt:./obj:msp:*'
+ *   perf buildid-cache --add ./obj && perf probe sdt_msp:handler_entry
+ *
+ * sys/sdt.h is used when it is installed. Without it the notes are emitted by the minimal
+ * version below, which covers ELF targets on x86 and arm; anywhere else, or with
+ * -DMSP_NO_PROBES, the probes compile to nothing. Arguments are always widened to 64 bits.
+ *
+ * provider msp:
+ *   frame_start(port)                      first header byte seen by the parser
+ *   frame_valid(port, cmd, size)           checksum matched, frame goes to dispatch
+ *   checksum_error(port, cmd, size)
+ *   handler_entry(cmd)                     mspProcessCommand, around the command handler
+ *   handler_exit(cmd, status)
+ *   tx_enqueue(port, cmd, length, priority)
+ *   tx_complete(port, cmd, length)         last byte of the frame handed to the port
+ */
+
+#if defined(MSP_NO_PROBES)
+#define MSP_PROBES_NONE
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define mspProbe1(name, a1)                 DTRACE_PROBE1(msp, name, (int64_t)(a1))
+#define mspProbe2(name, a1, a2)             DTRACE_PROBE2(msp, name, (int64_t)(a1), (int64_t)(a2))
+#define mspProbe3(name, a1, a2, a3)         DTRACE_PROBE3(msp, name, (int64_t)(a1), (int64_t)(a2), (int64_t)(a3))
+#define mspProbe4(name, a1, a2, a3, a4)     DTRACE_PROBE4(msp, name, (int64_t)(a1), (int64_t)(a2), (int64_t)(a3), (int64_t)(a4))
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || defined(__arm__))
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define MSP_PROBE_ADDR ".8byte"
+#else
+#define MSP_PROBE_ADDR ".4byte"
+#endif
+
+// same layout sys/sdt.h writes: note type 3, owner "stapsdt", then pc, base, semaphore and strings
+#define MSP_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: " MSP_PROBE_ADDR " 990b\n" \
+    MSP_PROBE_ADDR " _.stapsdt.base\n" \
+    MSP_PROBE_ADDR " 0\n" \
+    ".asciz \"msp\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define mspProbe1(name, v1) \
+    __asm__ __volatile__(MSP_PROBE_NOTE(name, "-8@%[a1]") \
+        :: [a1] "nor" ((int64_t)(v1)))
+#define mspProbe2(name, v1, v2) \
+    __asm__ __volatile__(MSP_PROBE_NOTE(name, "-8@%[a1] -8@%[a2]") \
+        :: [a1] "nor" ((int64_t)(v1)), [a2] "nor" ((int64_t)(v2)))
+#define mspProbe3(name, v1, v2, v3) \
+    __asm__ __volatile__(MSP_PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3]") \
+        :: [a1] "nor" ((int64_t)(v1)), [a2] "nor" ((int64_t)(v2)), [a3] "nor" ((int64_t)(v3)))
+#define mspProbe4(name, v1, v2, v3, v4) \
+    __asm__ __volatile__(MSP_PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]") \
+        :: [a1] "nor" ((int64_t)(v1)), [a2] "nor" ((int64_t)(v2)), [a3] "nor" ((int64_t)(v3)), [a4] "nor" ((int64_t)(v4)))
+
+#else
+#define MSP_PROBES_NONE
+#endif
+
+#ifdef MSP_PROBES_NONE
+#define mspProbe1(name, a1) do { } while (0)
+#define mspProbe2(name, a1, a2) do { } while (0)
+#define mspProbe3(name, a1, a2, a3) do { } while (0)
+#define mspProbe4(name, a1, a2, a3, a4) do { } while (0)
+#endif
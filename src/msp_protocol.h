@@ -306,3 +306,12 @@
 #define MSP_SERVO_MIX_RULES      241    //out message         Returns servo mixer configuration
 #define MSP_SET_SERVO_MIX_RULE   242    //in message          Sets servo mixer configuration
 #define MSP_SET_4WAY_IF          245    //in message          Sets 4way interface
+
+// Host side extensions, not part of Cleanflight
+#define MSP_TELEMETRY_SUBSCRIBE  226    //in message          U8 command + U16 period ms per entry, replies are pushed unsolicited
+#define MSP_MULTIPLE_MSP         230    //out message         U8 command per entry, reply is U8 length + payload per entry (Betaflight compatible)
+#define MSP_COMPRESSION          231    //in message          U8 algorithm mask + U8 size threshold, reply is the accepted pair, 0 turns it off
+#define MSP_COMPRESSED           232    //out message         U8 original command + U8 original size + compressed payload
+#define MSP_CONDITIONAL_READ     233    //out message         U8 command + U32 hash of the cached reply, reply is U8 command when unchanged
+#define MSP_PASSTHROUGH          234    //in message          U8 target + U16 idle timeout ms, reply U8 target, then the port is a raw bridge
+#define MSP_DISPLAYPORT          235    //in/out message      U8 subcommand + arguments, the display claims the OSD and is pushed its changes
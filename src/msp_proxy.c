@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "msp_proxy.h"
+#include "msp_frame.h"
+#include "msp_handshake.h"
+#include "msp_compress.h"
+#include "msp_checksum.h"
+#include "msp_protocol.h"
+
+/*
+ * MSP multiplexing proxy.
+ *
+ * The flight controller link is driven as an ordinary client mode msp port, so requests go out
+ * through commandSenderFn and replies come back through replyHandlerFn from mspSerialProcess().
+ * Downstream clients connect over TCP or unix sockets and are parsed as server mode msp ports.
+ *
+ * Only one request is outstanding on the FC link at a time, which keeps v1 reply matching trivial.
+ * Identical read-only requests that are already queued are coalesced onto one upstream request and
+ * recent read-only replies are answered from a short TTL cache.
+ *
+ * Before any client request is forwarded the proxy runs the connection handshake itself, and the
+ * identification replies it collected are then answered locally for as long as the link is up.
+ *
+ * A read-only request whose cached reply has expired is sent as MSP_CONDITIONAL_READ with the hash
+ * of that reply, so an unchanged answer costs the FC link a one byte payload. An FC that does not
+ * know the command is asked plainly from then on.
+ */
+
+typedef struct mspProxyClient_s {
+    bool used;
+    fdPort_t fdPort;
+    mspPort_t msp;
+} mspProxyClient_t;
+
+typedef struct mspProxyRequest_s {
+    uint8_t cmd;
+    uint8_t dataSize;
+    uint8_t data[MSP_PORT_INBUF_SIZE];
+    bool readOnly;
+    uint32_t waiters;                       // bitmask of client slots waiting for the reply
+} mspProxyRequest_t;
+
+typedef struct mspProxyCacheEntry_s {
+    bool valid;
+    uint8_t cmd;
+    uint8_t requestSize;
+    uint8_t request[MSP_PORT_INBUF_SIZE];
+    uint8_t replySize;
+    uint8_t reply[MSP_PORT_INBUF_SIZE];
+    uint32_t timestamp;
+} mspProxyCacheEntry_t;
+
+static mspPort_t *upstreamMsp;
+static int listenFd = -1;
+
+static mspProxyClient_t clients[MSP_PROXY_MAX_CLIENTS];
+
+static mspProxyRequest_t pending[MSP_PROXY_MAX_PENDING];
+static uint8_t pendingHead;
+static uint8_t pendingCount;
+static bool requestInFlight;
+static uint32_t requestSentAt;
+
+static mspProxyCacheEntry_t cache[MSP_PROXY_CACHE_SIZE];
+static uint8_t cacheNext;
+
+static mspHandshake_t handshake;
+static const char *handshakeCache;
+static bool fcLinkUp;
+static bool compressionRequested;
+static bool requestConditional;             // the request in flight went out as MSP_CONDITIONAL_READ
+static bool conditionalUnsupported;
+
+static mspProxyStats_t proxyStats;
+
+
+static mspProxyRequest_t *mspProxyPendingAt(int index)
+{
+    return &pending[(pendingHead + index) % MSP_PROXY_MAX_PENDING];
+}
+
+
+static void mspProxyReplyToClient(int slot, uint8_t cmd, uint8_t *data, int len, int16_t result)
+{
+    mspProxyClient_t *client = &clients[slot];
+
+    if (!client->used) {
+        return;
+    }
+
+    mspPacket_t reply = {
+        .buf = {
+            .ptr = data,
+            .end = data + len,
+        },
+        .cmd = cmd,
+        .result = result,
+    };
+
+    if (!mspSerialEncode(&client->msp, &reply)) {
+        proxyStats.droppedReplies++;
+    }
+}
+
+
+// one encoded frame is shared by every waiting client
+static void mspProxyReplyToWaiters(uint32_t waiters, uint8_t cmd, uint8_t *data, int len, int16_t result)
+{
+    mspFrame_t *frame = mspFrameAlloc();
+    int slot;
+
+    if (!frame) {
+        proxyStats.droppedReplies += __builtin_popcount(waiters);
+        return;
+    }
+
+    mspPacket_t reply = {
+        .buf = {
+            .ptr = data,
+            .end = data + len,
+        },
+        .cmd = cmd,
+        .result = result,
+    };
+
+    mspSerialEncodeFrame(frame, result < 0 ? '!' : '>', &reply);
+
+    for (slot = 0; slot < MSP_PROXY_MAX_CLIENTS; slot++) {
+        if ((waiters & (1u << slot)) && clients[slot].used) {
+            if (!mspSerialSubmitFrame(&clients[slot].msp, frame, MSP_TX_PRIORITY_CONTROL)) {
+                proxyStats.droppedReplies++;
+            }
+        }
+    }
+
+    mspFrameRelease(frame);
+}
+
+
+static mspProxyCacheEntry_t *mspProxyCacheLookup(uint8_t cmd, uint8_t *data, uint8_t size)
+{
+    int i;
+
+    for (i = 0; i < MSP_PROXY_CACHE_SIZE; i++) {
+        mspProxyCacheEntry_t *entry = &cache[i];
+        if (entry->valid && entry->cmd == cmd && entry->requestSize == size && memcmp(entry->request, data, size) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+static void mspProxyCacheStore(mspProxyRequest_t *request, uint8_t *reply, int len)
+{
+    mspProxyCacheEntry_t *entry = mspProxyCacheLookup(request->cmd, request->data, request->dataSize);
+
+    if (!entry) {
+        entry = &cache[cacheNext];
+        cacheNext = (cacheNext + 1) % MSP_PROXY_CACHE_SIZE;
+    }
+
+    entry->valid = true;
+    entry->cmd = request->cmd;
+    entry->requestSize = request->dataSize;
+    memcpy(entry->request, request->data, request->dataSize);
+    entry->replySize = len;
+    memcpy(entry->reply, reply, len);
+    entry->timestamp = millis();
+}
+
+
+static void mspProxyCacheInvalidate(void)
+{
+    int i;
+
+    for (i = 0; i < MSP_PROXY_CACHE_SIZE; i++) {
+        cache[i].valid = false;
+    }
+}
+
+
+static void mspProxyCompleteHead(void)
+{
+    pendingHead = (pendingHead + 1) % MSP_PROXY_MAX_PENDING;
+    pendingCount--;
+    requestInFlight = false;
+}
+
+
+static bool mspProxySendRequest(mspPacket_t *command)
+{
+    mspProxyRequest_t *request;
+
+    if (!pendingCount) {
+        return false;
+    }
+
+    request = mspProxyPendingAt(0);
+
+    mspProxyCacheEntry_t *entry = request->readOnly && !request->dataSize && !conditionalUnsupported ?
+                                  mspProxyCacheLookup(request->cmd, request->data, 0) : NULL;
+    requestConditional = entry != NULL;
+
+    if (requestConditional) {
+        command->cmd = MSP_CONDITIONAL_READ;
+        mspConditionalReadSerializeRequest(&command->buf, request->cmd, mspReplyHash(entry->reply, entry->replySize));
+    } else {
+        command->cmd = request->cmd;
+        sbufWriteData(&command->buf, request->data, request->dataSize);
+    }
+
+    requestInFlight = true;
+    requestSentAt = millis();
+    proxyStats.upstreamRequests++;
+
+    return true;
+}
+
+
+static bool mspProxySendHandshakeRequest(mspPacket_t *command)
+{
+    return mspHandshakeNextRequest(&handshake, command);
+}
+
+
+// the reply is not waited for, an FC without compression answers '!' and simply keeps sending plain replies
+static bool mspProxySendCompressionRequest(mspPacket_t *command)
+{
+    command->cmd = MSP_COMPRESSION;
+    mspCompressionSerializeRequest(&command->buf, MSP_COMPRESSION_DEFAULT_THRESHOLD);
+    return true;
+}
+
+
+static void mspProxyHandleReply(mspPacket_t *reply)
+{
+    mspProxyRequest_t *request;
+    int len = sbufBytesRemaining(&reply->buf);
+
+    if (mspHandshakeHandleReply(&handshake, reply)) {
+        return;
+    }
+
+    if (!requestInFlight || !pendingCount) {
+        return;                             // stray reply, nobody asked for it
+    }
+
+    request = mspProxyPendingAt(0);
+
+    if (requestConditional && reply->cmd == MSP_CONDITIONAL_READ) {
+        mspProxyCacheEntry_t *entry = mspProxyCacheLookup(request->cmd, request->data, 0);
+
+        if (!mspConditionalReadUnchanged(reply, request->cmd)) {
+            conditionalUnsupported = true;  // '!' or an empty reply, ask plainly
+        }
+        if (!entry || conditionalUnsupported) {
+            requestInFlight = false;        // a write dropped the entry meanwhile, resend
+            return;
+        }
+
+        proxyStats.notModified++;
+        entry->timestamp = millis();
+        mspProxyReplyToWaiters(request->waiters, request->cmd, entry->reply, entry->replySize, 1);
+        mspProxyCompleteHead();
+        return;
+    }
+
+    if (request->cmd != reply->cmd) {
+        return;
+    }
+
+    if (request->readOnly) {
+        mspProxyCacheStore(request, sbufPtr(&reply->buf), len);
+    }
+
+    mspProxyReplyToWaiters(request->waiters, reply->cmd, sbufPtr(&reply->buf), len, reply->result);
+    mspProxyCompleteHead();
+}
+
+
+static void mspProxyHandleClientRequest(int slot)
+{
+    mspProxyClient_t *client = &clients[slot];
+    uint32_t bit = 1u << slot;
+    uint8_t cmd = client->msp.cmdMSP;
+    uint8_t size = client->msp.dataSize;
+    uint8_t *data = client->msp.inBuf;
+    bool readOnly = mspCommandIsReadOnly(cmd);
+    bool clientWaiting = false;
+    bool writePending = false;
+    mspProxyRequest_t *match = NULL;
+    int i;
+
+    proxyStats.clientRequests++;
+
+    for (i = 0; i < pendingCount; i++) {
+        mspProxyRequest_t *request = mspProxyPendingAt(i);
+        clientWaiting |= (request->waiters & bit) != 0;
+        writePending |= !request->readOnly;
+    }
+
+    if (readOnly) {
+        // coalesce with the newest identical request that is not ordered before a write or
+        // before one of this client's own requests, so every client still sees its replies in order
+        for (i = pendingCount - 1; i >= 0; i--) {
+            mspProxyRequest_t *request = mspProxyPendingAt(i);
+            if (!request->readOnly || (request->waiters & bit)) {
+                break;
+            }
+            if (request->cmd == cmd && request->dataSize == size && memcmp(request->data, data, size) == 0) {
+                match = request;
+                break;
+            }
+        }
+
+        if (match) {
+            match->waiters |= bit;
+            proxyStats.coalesced++;
+            return;
+        }
+
+        if (!clientWaiting && !writePending) {
+            const mspHandshakeEntry_t *identity = size ? NULL : mspHandshakeGetReply(&handshake, cmd);
+            if (identity) {
+                proxyStats.handshakeHits++;
+                mspProxyReplyToClient(slot, cmd, (uint8_t *)identity->data, identity->size, 1);
+                return;
+            }
+
+            mspProxyCacheEntry_t *entry = mspProxyCacheLookup(cmd, data, size);
+            if (entry && millis() - entry->timestamp < MSP_PROXY_CACHE_TTL_MS) {
+                proxyStats.cacheHits++;
+                mspProxyReplyToClient(slot, cmd, entry->reply, entry->replySize, 1);
+                return;
+            }
+        }
+    } else {
+        mspProxyCacheInvalidate();
+    }
+
+    if (pendingCount == MSP_PROXY_MAX_PENDING) {
+        mspProxyReplyToClient(slot, cmd, NULL, 0, -1);
+        return;
+    }
+
+    match = mspProxyPendingAt(pendingCount++);
+    match->cmd = cmd;
+    match->dataSize = size;
+    memcpy(match->data, data, size);
+    match->readOnly = readOnly;
+    match->waiters = bit;
+}
+
+
+static void mspProxyDropClient(int slot)
+{
+    mspProxyClient_t *client = &clients[slot];
+    int i;
+
+    mspSerialDiscardTxQueue(&client->msp);
+    close(client->fdPort.uart.fd);
+    client->used = false;
+
+    for (i = 0; i < pendingCount; i++) {
+        mspProxyPendingAt(i)->waiters &= ~(1u << slot);
+    }
+}
+
+
+static void mspProxyAcceptClients(void)
+{
+    int fd;
+    int slot;
+    int one = 1;
+
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+        for (slot = 0; slot < MSP_PROXY_MAX_CLIENTS && clients[slot].used; slot++);
+
+        if (slot == MSP_PROXY_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // harmless failure on unix sockets
+
+        mspProxyClient_t *client = &clients[slot];
+        client->used = true;
+        resetMspPort(&client->msp, fdSerialOpen(&client->fdPort, fd));
+        client->msp.mode = MSP_MODE_SERVER;
+    }
+}
+
+
+static void mspProxyProcessClient(int slot)
+{
+    mspProxyClient_t *client = &clients[slot];
+    mspPort_t *msp = &client->msp;
+
+    mspSerialFlushTxQueue(msp);
+
+    // stop reading a client that is not draining its replies
+    while (!mspSerialTxQueueFull(msp, MSP_TX_PRIORITY_CONTROL)) {
+        mspSerialProcessResyncBytes(msp);
+
+        if (msp->c_state != MESSAGE_RECEIVED) {
+            if (!serialRxBytesWaiting(msp->port)) {
+                break;
+            }
+            mspSerialProcessReceivedByte(msp, serialRead(msp->port));
+        }
+
+        if (msp->c_state == MESSAGE_RECEIVED) {
+            mspProxyHandleClientRequest(slot);
+            msp->c_state = IDLE;
+        }
+    }
+
+    mspSerialFlushTxQueue(msp);
+
+    if (!fdSerialIsConnected(msp->port)) {
+        mspProxyDropClient(slot);
+    }
+}
+
+
+void mspProxyProcess(void)
+{
+    int slot;
+
+    mspProxyAcceptClients();
+
+    for (slot = 0; slot < MSP_PROXY_MAX_CLIENTS; slot++) {
+        if (clients[slot].used) {
+            mspProxyProcessClient(slot);
+        }
+    }
+
+    if (requestInFlight && millis() - requestSentAt > MSP_PROXY_REPLY_TIMEOUT_MS) {
+        mspProxyRequest_t *request = mspProxyPendingAt(0);
+        proxyStats.timeouts++;
+        mspProxyReplyToWaiters(request->waiters, request->cmd, NULL, 0, -1);
+        mspProxyCompleteHead();
+    }
+
+    // an FC that went away and came back may be a different one, ask again (cheaply, if the cache matches)
+    if (fcLinkUp != (((uartPort_t *)upstreamMsp->port)->deviceState == CONFIGURED)) {
+        fcLinkUp = !fcLinkUp;
+        if (fcLinkUp) {
+            mspHandshakeStart(&handshake, handshakeCache);
+            compressionRequested = false;
+            conditionalUnsupported = false;
+        }
+    }
+
+    // client requests wait until the handshake is through
+    if (!mspHandshakeIsComplete(&handshake)) {
+        mspHandshakeCheckTimeout(&handshake);
+        if (!upstreamMsp->commandSenderFn) {
+            upstreamMsp->commandSenderFn = mspProxySendHandshakeRequest;
+        }
+        return;
+    }
+
+    // large FC replies are what makes the link slow, ask for them compressed once per connection
+    if (!compressionRequested && !requestInFlight && !upstreamMsp->commandSenderFn) {
+        compressionRequested = true;
+        upstreamMsp->commandSenderFn = mspProxySendCompressionRequest;
+        return;
+    }
+
+    // hand the next request to the client path, mspSerialProcess() sends it once the link is idle
+    if (!requestInFlight && pendingCount && !upstreamMsp->commandSenderFn) {
+        upstreamMsp->commandSenderFn = mspProxySendRequest;
+    }
+}
+
+
+static int mspProxyListenUnix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, MSP_PROXY_MAX_CLIENTS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int mspProxyListenTcp(const char *spec)
+{
+    char host[64] = "";
+    const char *service = spec;
+    const char *colon = strrchr(spec, ':');
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int one = 1;
+    int fd = -1;
+
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        service = colon + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host[0] ? host : NULL, service, &hints, &res) != 0) {
+        return -1;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, MSP_PROXY_MAX_CLIENTS) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+bool mspProxyInit(mspPort_t *upstream, serialPort_t *fcPort, const char *listenSpec, const char *handshakeCachePath)
+{
+    if (strncmp(listenSpec, "unix:", 5) == 0) {
+        listenFd = mspProxyListenUnix(listenSpec + 5);
+    } else if (strncmp(listenSpec, "tcp:", 4) == 0) {
+        listenFd = mspProxyListenTcp(listenSpec + 4);
+    }
+
+    if (listenFd < 0) {
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);               // a vanished client shows up as EPIPE instead
+
+    resetMspPort(upstream, fcPort);
+    upstream->mode = MSP_MODE_CLIENT;
+    upstream->replyHandlerFn = mspProxyHandleReply;
+    upstreamMsp = upstream;
+
+    handshakeCache = handshakeCachePath;
+    fcLinkUp = ((uartPort_t *)fcPort)->deviceState == CONFIGURED;
+    mspHandshakeStart(&handshake, handshakeCachePath);
+
+    return true;
+}
+
+
+const mspProxyStats_t *mspProxyGetStats(void)
+{
+    proxyStats.handshakeFromCache = handshake.usedCache;
+    proxyStats.handshakeMs = mspHandshakeIsComplete(&handshake) ? handshake.completedAt - handshake.startedAt : 0;
+    return &proxyStats;
+}
+
+
+void mspProxyReport(void)
+{
+    const mspProxyStats_t *stats = mspProxyGetStats();
+
+    fprintf(stderr, "proxy %u client requests, %u upstream, %u coalesced, %u cache hits, %u handshake hits, %u timeouts, %u replies dropped\n",
+            stats->clientRequests, stats->upstreamRequests, stats->coalesced, stats->cacheHits, stats->handshakeHits,
+            stats->timeouts, stats->droppedReplies);
+}
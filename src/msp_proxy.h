@@ -0,0 +1,28 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_PROXY_MAX_CLIENTS 16            // client slots are tracked in a 32 bit waiter mask
+#define MSP_PROXY_MAX_PENDING 16
+#define MSP_PROXY_CACHE_SIZE 32
+#define MSP_PROXY_CACHE_TTL_MS 100          // read-only replies younger than this are served from the cache
+#define MSP_PROXY_REPLY_TIMEOUT_MS 500
+
+typedef struct mspProxyStats_s {
+    uint32_t clientRequests;
+    uint32_t upstreamRequests;
+    uint32_t coalesced;
+    uint32_t cacheHits;
+    uint32_t timeouts;
+    uint32_t droppedReplies;                // the client's tx queue stayed full, it will time out
+    uint32_t notModified;                   // expired cache entries the FC confirmed unchanged
+    uint32_t handshakeHits;                 // identification requests answered from the handshake
+    uint32_t handshakeMs;                   // time the upstream handshake took, 0 while it runs
+    bool handshakeFromCache;
+} mspProxyStats_t;
+
+// listenSpec is "tcp:<port>", "tcp:<host>:<port>" or "unix:<path>"
+// handshakeCachePath may be NULL to keep the FC identification in memory only
+bool mspProxyInit(mspPort_t *upstream, serialPort_t *fcPort, const char *listenSpec, const char *handshakeCachePath);
+void mspProxyProcess(void);
+const mspProxyStats_t *mspProxyGetStats(void);
+void mspProxyReport(void);
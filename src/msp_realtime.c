@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "msp_realtime.h"
+
+bool mspRealtimeEnabled;
+
+static int cpus[MSP_REALTIME_MAX_CPUS];
+static int cpuCount;
+static int priority = MSP_REALTIME_DEFAULT_PRIORITY;
+static uint32_t busyPollIdleUs;
+static cpu_set_t startupCpus;                   // helpers fall back to this without a cpu of their own
+static bool memoryLocked;
+
+static mspRealtimeJitter_t loopJitter;
+static mspRealtimeJitter_t wakeJitter;
+
+
+bool mspRealtimeConfigure(const char *spec)
+{
+    char *end;
+
+    cpuCount = 0;
+    for (;;) {
+        long cpu = strtol(spec, &end, 10);
+        if (end == spec || cpu < 0 || cpu >= CPU_SETSIZE || cpuCount == MSP_REALTIME_MAX_CPUS) {
+            return false;
+        }
+        cpus[cpuCount++] = cpu;
+        spec = end;
+        if (*spec != ',') {
+            break;
+        }
+        spec++;
+    }
+
+    if (*spec == ':') {
+        long value = strtol(spec + 1, &end, 10);
+        if (end == spec + 1 || value < sched_get_priority_min(SCHED_FIFO) || value > sched_get_priority_max(SCHED_FIFO)) {
+            return false;
+        }
+        priority = value;
+        spec = end;
+    }
+    return *spec == '\0';
+}
+
+
+void mspRealtimeSetBusyPoll(uint32_t idleUs)
+{
+    busyPollIdleUs = idleUs;
+}
+
+
+static bool mspRealtimePin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+
+// faults in the stack the calling thread will use, so the first deep call does not page fault
+static void mspRealtimePrefaultStack(void)
+{
+    volatile uint8_t stack[MSP_REALTIME_STACK_PREFAULT];
+
+    memset((uint8_t *)stack, 0, sizeof(stack));
+}
+
+
+// helperThreads is how many threads will call mspRealtimeEnterThread(), they need a cpu to run on
+bool mspRealtimeStart(int helperThreads)
+{
+    struct sched_param param = { .sched_priority = priority };
+    bool ok = true;
+    int err;
+
+    if (!cpuCount) {
+        return false;
+    }
+
+    // freed heap stays with the process, otherwise a later malloc would fault it back in
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    // MCL_CURRENT populates everything mapped so far, the port state and the frame pool included
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+        memoryLocked = true;
+    } else {
+        fprintf(stderr, "realtime: mlockall: %s, raise the memlock limit (ulimit -l)\n", strerror(errno));
+        ok = false;
+    }
+    mspRealtimePrefaultStack();
+
+    sched_getaffinity(0, sizeof(startupCpus), &startupCpus);
+    if (!mspRealtimePin(cpus[0])) {
+        fprintf(stderr, "realtime: cannot pin to cpu %d\n", cpus[0]);
+        ok = false;
+    }
+
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) {
+        fprintf(stderr, "realtime: SCHED_FIFO %d: %s\n", priority, strerror(err));
+        ok = false;
+    }
+
+    if (busyPollIdleUs && helperThreads && cpuCount == 1 && CPU_COUNT(&startupCpus) <= 1) {
+        fprintf(stderr, "realtime: no cpu left for the workers, busy-poll off\n");
+        busyPollIdleUs = 0;
+    }
+    if (busyPollIdleUs) {
+        usbSetBusyPoll(busyPollIdleUs);
+    }
+
+    mspRealtimeEnabled = true;
+    return ok;
+}
+
+
+// called first thing by helper threads, index counts from 0. With a single configured cpu the
+// helpers keep off it, a busy-polling main loop at the same priority would never let them run.
+void mspRealtimeEnterThread(int index)
+{
+    if (!mspRealtimeEnabled) {
+        return;
+    }
+
+    if (cpuCount > 1) {
+        mspRealtimePin(cpus[1 + index % (cpuCount - 1)]);
+    } else {
+        cpu_set_t set = startupCpus;
+        if (CPU_COUNT(&set) > 1) {
+            CPU_CLR(cpus[0], &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    mspRealtimePrefaultStack();
+}
+
+
+static void mspRealtimeRecord(mspRealtimeJitter_t *jitter, uint32_t us)
+{
+    jitter->histogram[us < MSP_REALTIME_JITTER_BUCKETS ? us : MSP_REALTIME_JITTER_BUCKETS - 1]++;
+    jitter->count++;
+    jitter->sumUs += us;
+    if (us > jitter->maxUs) {
+        jitter->maxUs = us;
+    }
+}
+
+
+// wake-up of the main loop to the start of its next wait
+void mspRealtimeRecordLoop(uint32_t us)
+{
+    mspRealtimeRecord(&loopJitter, us);
+}
+
+
+// how much later than asked a timed wait returned
+void mspRealtimeRecordWakeLate(uint32_t us)
+{
+    mspRealtimeRecord(&wakeJitter, us);
+}
+
+
+// ppm is parts per million, 999900 for p99.99. Samples in the last bucket report the exact max.
+uint32_t mspRealtimeJitterPercentileUs(const mspRealtimeJitter_t *jitter, uint32_t ppm)
+{
+    uint64_t target = (jitter->count * ppm + 999999) / 1000000;
+    uint64_t seen = 0;
+    uint32_t bucket;
+
+    for (bucket = 0; bucket < MSP_REALTIME_JITTER_BUCKETS - 1; bucket++) {
+        seen += jitter->histogram[bucket];
+        if (seen >= target) {
+            return bucket;
+        }
+    }
+    return jitter->maxUs;
+}
+
+
+static void mspRealtimeReportJitter(const char *name, const mspRealtimeJitter_t *jitter)
+{
+    if (!jitter->count) {
+        return;
+    }
+    fprintf(stderr, "realtime %-9s %10llu samples  mean %5u us  p99 %5u us  p99.99 %5u us  max %6u us\n", name,
+            (unsigned long long)jitter->count, (uint32_t)(jitter->sumUs / jitter->count),
+            mspRealtimeJitterPercentileUs(jitter, 990000), mspRealtimeJitterPercentileUs(jitter, 999900), jitter->maxUs);
+}
+
+
+void mspRealtimeReport(void)
+{
+    if (!mspRealtimeEnabled) {
+        return;
+    }
+    fprintf(stderr, "realtime cpu %d, SCHED_FIFO %d, memory %slocked, busy-poll %s\n", cpus[0], priority,
+            memoryLocked ? "" : "not ", busyPollIdleUs ? "on" : "off");
+    mspRealtimeReportJitter("loop", &loopJitter);
+    mspRealtimeReportJitter("wake late", &wakeJitter);
+}
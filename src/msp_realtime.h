@@ -0,0 +1,37 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_REALTIME_MAX_CPUS 16
+#define MSP_REALTIME_DEFAULT_PRIORITY 50        // SCHED_FIFO, 1..99
+#define MSP_REALTIME_BUSY_POLL_IDLE_US 2000     // busy-polling falls back to blocking waits after this long without a byte
+#define MSP_REALTIME_STACK_PREFAULT (256 * 1024)
+#define MSP_REALTIME_JITTER_BUCKETS 10000       // 1 us each, slower samples only count toward the max
+
+/*
+ * Deterministic real-time mode.
+ *
+ * mspRealtimeStart() locks all current and future memory, prefaults the stack, pins the main
+ * loop to the first configured cpu and raises it to SCHED_FIFO. Worker threads started after it
+ * inherit the policy and pin themselves to the remaining cpus. Optionally the port is busy-polled
+ * while traffic flows, see usbSetBusyPoll(). While enabled the time from each wake-up of the
+ * main loop to its next wait, and how late timed waits return, are kept in 1 us histograms and
+ * reported by mspRealtimeReport().
+ */
+typedef struct mspRealtimeJitter_s {
+    uint64_t count;
+    uint64_t sumUs;
+    uint32_t maxUs;
+    uint32_t histogram[MSP_REALTIME_JITTER_BUCKETS];
+} mspRealtimeJitter_t;
+
+extern bool mspRealtimeEnabled;
+
+// spec is "<cpu>[,<cpu>...][:<priority>]", the first cpu runs the main loop
+bool mspRealtimeConfigure(const char *spec);
+void mspRealtimeSetBusyPoll(uint32_t idleUs);
+bool mspRealtimeStart(int helperThreads);
+void mspRealtimeEnterThread(int index);
+void mspRealtimeRecordLoop(uint32_t us);
+void mspRealtimeRecordWakeLate(uint32_t us);
+uint32_t mspRealtimeJitterPercentileUs(const mspRealtimeJitter_t *jitter, uint32_t ppm);
+void mspRealtimeReport(void);
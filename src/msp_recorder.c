@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "msp_protocol.h"
+#include "msp_messages.h"
+#include "msp_recorder.h"
+
+/*
+ * Telemetry recorder.
+ *
+ * Every link is polled with one MSP_MULTIPLE_MSP request for attitude, analog, status, rc and
+ * motors per period. Each reply is decoded into one row of the columnar file described in
+ * msp_recorder_file.h, so offline tools never parse MSP or text again.
+ *
+ * The file is allocated in full and mapped when recording starts. Appending a row is a handful
+ * of stores into the mapping, and the kernel writes dirty pages back on its own, so the loop
+ * never waits on the disk. The valid column has a bit per group, a group the FC did not answer
+ * is recorded as zeros with its bit clear.
+ *
+ * The client callbacks carry no context, so every link slot has its own pair of them.
+ */
+
+typedef enum {
+    MSP_RECORDER_COL_TIME_US,
+    MSP_RECORDER_COL_LINK,
+    MSP_RECORDER_COL_VALID,
+    MSP_RECORDER_COL_ROLL,
+    MSP_RECORDER_COL_PITCH,
+    MSP_RECORDER_COL_YAW,
+    MSP_RECORDER_COL_VBAT,
+    MSP_RECORDER_COL_MAH_DRAWN,
+    MSP_RECORDER_COL_RSSI,
+    MSP_RECORDER_COL_AMPERAGE,
+    MSP_RECORDER_COL_CYCLE_TIME,
+    MSP_RECORDER_COL_I2C_ERRORS,
+    MSP_RECORDER_COL_SENSORS,
+    MSP_RECORDER_COL_FLIGHT_MODE_FLAGS,
+    MSP_RECORDER_COL_SYSTEM_LOAD,
+    MSP_RECORDER_COL_RC,
+    MSP_RECORDER_COL_MOTOR = MSP_RECORDER_COL_RC + MSP_RECORDER_CHANNELS,
+    MSP_RECORDER_COL_COUNT = MSP_RECORDER_COL_MOTOR + MSP_RECORDER_CHANNELS
+} mspRecorderColumn_e;
+
+typedef enum {
+    MSP_RECORDER_VALID_ATTITUDE = 1 << 0,
+    MSP_RECORDER_VALID_ANALOG = 1 << 1,
+    MSP_RECORDER_VALID_STATUS = 1 << 2,
+    MSP_RECORDER_VALID_RC = 1 << 3,
+    MSP_RECORDER_VALID_MOTOR = 1 << 4,
+} mspRecorderValid_e;
+
+typedef struct mspRecorderColumnType_s {
+    const char *name;                           // rc and motor columns get their channel number appended
+    uint8_t width;
+    bool isSigned;
+} mspRecorderColumnType_t;
+
+typedef struct mspRecorderLink_s {
+    mspPort_t *msp;                             // NULL when the slot is unused
+    uint8_t linkId;
+    uint16_t periodMs;
+    bool awaiting;
+    uint32_t nextPollAt;
+    uint32_t sentAt;
+} mspRecorderLink_t;
+
+_Static_assert(MSP_RECORDER_COL_COUNT <= MSP_RECORDER_MAX_COLUMNS, "too many columns for the header");
+
+static const mspRecorderColumnType_t columnTypes[] = {
+    [MSP_RECORDER_COL_TIME_US] = { "time_us", 8, false },
+    [MSP_RECORDER_COL_LINK] = { "link", 1, false },
+    [MSP_RECORDER_COL_VALID] = { "valid", 1, false },
+    [MSP_RECORDER_COL_ROLL] = { "roll", 2, true },
+    [MSP_RECORDER_COL_PITCH] = { "pitch", 2, true },
+    [MSP_RECORDER_COL_YAW] = { "yaw", 2, true },
+    [MSP_RECORDER_COL_VBAT] = { "vbat", 1, false },
+    [MSP_RECORDER_COL_MAH_DRAWN] = { "mah_drawn", 2, false },
+    [MSP_RECORDER_COL_RSSI] = { "rssi", 2, false },
+    [MSP_RECORDER_COL_AMPERAGE] = { "amperage", 2, true },
+    [MSP_RECORDER_COL_CYCLE_TIME] = { "cycle_time", 2, false },
+    [MSP_RECORDER_COL_I2C_ERRORS] = { "i2c_errors", 2, false },
+    [MSP_RECORDER_COL_SENSORS] = { "sensors", 2, false },
+    [MSP_RECORDER_COL_FLIGHT_MODE_FLAGS] = { "flight_modes", 4, false },
+    [MSP_RECORDER_COL_SYSTEM_LOAD] = { "system_load", 2, false },
+    [MSP_RECORDER_COL_RC] = { "rc", 2, false },
+    [MSP_RECORDER_COL_MOTOR] = { "motor", 2, false },
+};
+
+static const uint8_t polledCommands[] = { MSP_ATTITUDE, MSP_ANALOG, MSP_STATUS, MSP_RC, MSP_MOTOR };
+
+static uint8_t *fileBase;
+static size_t fileSize;
+static mspRecorderFileHeader_t *header;
+static uint8_t *columnBase[MSP_RECORDER_COL_COUNT];
+static uint8_t columnWidth[MSP_RECORDER_COL_COUNT];
+static uint64_t *timeIndex;
+
+static mspRecorderLink_t links[MSP_RECORDER_MAX_LINKS];
+static mspRecorderStats_t recorderStats;
+
+
+static uint64_t mspRecorderPageAlign(uint64_t offset)
+{
+    return (offset + MSP_RECORDER_PAGE_SIZE - 1) & ~(uint64_t)(MSP_RECORDER_PAGE_SIZE - 1);
+}
+
+
+static uint64_t mspRecorderWallClockUs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static const mspRecorderColumnType_t *mspRecorderColumnType(int column, int *channel)
+{
+    *channel = 0;
+    if (column >= MSP_RECORDER_COL_MOTOR) {
+        *channel = column - MSP_RECORDER_COL_MOTOR + 1;
+        return &columnTypes[MSP_RECORDER_COL_MOTOR];
+    }
+    if (column >= MSP_RECORDER_COL_RC) {
+        *channel = column - MSP_RECORDER_COL_RC + 1;
+        return &columnTypes[MSP_RECORDER_COL_RC];
+    }
+    return &columnTypes[column];
+}
+
+
+bool mspRecorderStart(const char *path, uint64_t capacity)
+{
+    mspRecorderFileHeader_t layout;
+    uint64_t offset = MSP_RECORDER_PAGE_SIZE;
+    int column;
+    int fd;
+
+    if (fileBase || !capacity) {
+        return false;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    memcpy(layout.magic, MSP_RECORDER_MAGIC, sizeof(MSP_RECORDER_MAGIC));
+    layout.version = MSP_RECORDER_VERSION;
+    layout.columnCount = MSP_RECORDER_COL_COUNT;
+    layout.rowCapacity = capacity;
+    layout.indexStride = MSP_RECORDER_INDEX_STRIDE;
+
+    for (column = 0; column < MSP_RECORDER_COL_COUNT; column++) {
+        mspRecorderColumnDesc_t *desc = &layout.columns[column];
+        int channel;
+        const mspRecorderColumnType_t *type = mspRecorderColumnType(column, &channel);
+
+        if (channel) {
+            snprintf(desc->name, sizeof(desc->name), "%s%d", type->name, channel);
+        } else {
+            snprintf(desc->name, sizeof(desc->name), "%s", type->name);
+        }
+        desc->width = type->width;
+        desc->isSigned = type->isSigned;
+        desc->offset = offset;
+        offset = mspRecorderPageAlign(offset + capacity * type->width);
+    }
+    layout.indexOffset = offset;
+    offset = mspRecorderPageAlign(offset + (capacity / MSP_RECORDER_INDEX_STRIDE + 1) * sizeof(uint64_t));
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    // reserve every block now, a page fault while recording must never have to allocate on disk
+    if (posix_fallocate(fd, 0, offset) != 0 ||
+        (fileBase = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fileBase = NULL;
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    close(fd);
+
+    fileSize = offset;
+    header = (mspRecorderFileHeader_t *)fileBase;
+    memcpy(header, &layout, sizeof(layout));
+
+    for (column = 0; column < MSP_RECORDER_COL_COUNT; column++) {
+        columnBase[column] = fileBase + layout.columns[column].offset;
+        columnWidth[column] = layout.columns[column].width;
+    }
+    timeIndex = (uint64_t *)(fileBase + layout.indexOffset);
+
+    memset(&recorderStats, 0, sizeof(recorderStats));
+    return true;
+}
+
+
+static void mspRecorderAppendRow(const uint64_t *values)
+{
+    uint64_t row = header->rowCount;
+    int column;
+
+    if (row == header->rowCapacity) {
+        recorderStats.dropped++;
+        return;
+    }
+
+    // values are little endian like the file, the low bytes of each are the column value
+    for (column = 0; column < MSP_RECORDER_COL_COUNT; column++) {
+        memcpy(columnBase[column] + row * columnWidth[column], &values[column], columnWidth[column]);
+    }
+    if (row % MSP_RECORDER_INDEX_STRIDE == 0) {
+        timeIndex[row / MSP_RECORDER_INDEX_STRIDE] = values[MSP_RECORDER_COL_TIME_US];
+    }
+
+    // a reader following a live recording only looks at rows below rowCount
+    __atomic_store_n(&header->rowCount, row + 1, __ATOMIC_RELEASE);
+    recorderStats.rows = row + 1;
+}
+
+
+static uint8_t mspRecorderDecode(uint8_t cmd, sbuf_t *src, uint64_t *values)
+{
+    int len = sbufBytesRemaining(src);
+    int i;
+
+    switch (cmd) {
+        case MSP_ATTITUDE:
+            if (len < (int)sizeof(mspAttitude_t)) {
+                return 0;
+            }
+            values[MSP_RECORDER_COL_ROLL] = (int16_t)sbufReadU16(src);
+            values[MSP_RECORDER_COL_PITCH] = (int16_t)sbufReadU16(src);
+            values[MSP_RECORDER_COL_YAW] = (int16_t)sbufReadU16(src);
+            return MSP_RECORDER_VALID_ATTITUDE;
+
+        case MSP_ANALOG:
+            if (len < (int)sizeof(mspAnalog_t)) {
+                return 0;
+            }
+            values[MSP_RECORDER_COL_VBAT] = sbufReadU8(src);
+            values[MSP_RECORDER_COL_MAH_DRAWN] = sbufReadU16(src);
+            values[MSP_RECORDER_COL_RSSI] = sbufReadU16(src);
+            values[MSP_RECORDER_COL_AMPERAGE] = (int16_t)sbufReadU16(src);
+            return MSP_RECORDER_VALID_ANALOG;
+
+        case MSP_STATUS:
+            if (len < (int)sizeof(mspStatus_t)) {
+                return 0;
+            }
+            values[MSP_RECORDER_COL_CYCLE_TIME] = sbufReadU16(src);
+            values[MSP_RECORDER_COL_I2C_ERRORS] = sbufReadU16(src);
+            values[MSP_RECORDER_COL_SENSORS] = sbufReadU16(src);
+            values[MSP_RECORDER_COL_FLIGHT_MODE_FLAGS] = sbufReadU32(src);
+            sbufReadU8(src);                                    // current profile
+            values[MSP_RECORDER_COL_SYSTEM_LOAD] = sbufReadU16(src);
+            return MSP_RECORDER_VALID_STATUS;
+
+        case MSP_RC:
+        case MSP_MOTOR: {
+            int first = cmd == MSP_RC ? MSP_RECORDER_COL_RC : MSP_RECORDER_COL_MOTOR;
+            if (len < 2) {
+                return 0;
+            }
+            for (i = 0; i < MSP_RECORDER_CHANNELS && sbufBytesRemaining(src) >= 2; i++) {
+                values[first + i] = sbufReadU16(src);
+            }
+            return cmd == MSP_RC ? MSP_RECORDER_VALID_RC : MSP_RECORDER_VALID_MOTOR;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+
+static bool mspRecorderSendPoll(mspRecorderLink_t *link, mspPacket_t *command)
+{
+    command->cmd = MSP_MULTIPLE_MSP;
+    mspMultipleMspSerializeRequest(&command->buf, polledCommands, sizeof(polledCommands));
+    link->sentAt = millis();
+    recorderStats.polls++;
+    return true;
+}
+
+
+static void mspRecorderHandleReply(mspRecorderLink_t *link, mspPacket_t *reply)
+{
+    mspPacket_t subReplies[sizeof(polledCommands)];
+    uint64_t values[MSP_RECORDER_COL_COUNT];
+    uint8_t valid = 0;
+    int count;
+    int i;
+
+    if (reply->cmd != MSP_MULTIPLE_MSP || !link->awaiting) {
+        return;
+    }
+    link->awaiting = false;
+    if (reply->result < 0) {
+        return;
+    }
+
+    memset(values, 0, sizeof(values));
+    count = mspMultipleMspSplitReply(reply, polledCommands, sizeof(polledCommands), subReplies);
+    for (i = 0; i < count; i++) {
+        valid |= mspRecorderDecode(polledCommands[i], &subReplies[i].buf, values);
+    }
+
+    values[MSP_RECORDER_COL_TIME_US] = mspRecorderWallClockUs();
+    values[MSP_RECORDER_COL_LINK] = link->linkId;
+    values[MSP_RECORDER_COL_VALID] = valid;
+    mspRecorderAppendRow(values);
+}
+
+
+#define MSP_RECORDER_LINK_CALLBACKS(n) \
+    static bool mspRecorderSendLink##n(mspPacket_t *command) { return mspRecorderSendPoll(&links[n], command); } \
+    static void mspRecorderReplyLink##n(mspPacket_t *reply) { mspRecorderHandleReply(&links[n], reply); }
+
+MSP_RECORDER_LINK_CALLBACKS(0)
+MSP_RECORDER_LINK_CALLBACKS(1)
+
+static const mspCommandSenderFuncPtr linkSenders[MSP_RECORDER_MAX_LINKS] = { mspRecorderSendLink0, mspRecorderSendLink1 };
+static const mspReplyHandlerFuncPtr linkReplyHandlers[MSP_RECORDER_MAX_LINKS] = { mspRecorderReplyLink0, mspRecorderReplyLink1 };
+
+_Static_assert(MSP_RECORDER_MAX_LINKS == 2, "one MSP_RECORDER_LINK_CALLBACKS() per link slot");
+
+
+bool mspRecorderAddLink(mspPort_t *msp, uint8_t linkId, uint16_t periodMs)
+{
+    int slot;
+
+    for (slot = 0; slot < MSP_RECORDER_MAX_LINKS && links[slot].msp; slot++);
+
+    if (!fileBase || slot == MSP_RECORDER_MAX_LINKS || msp->mode != MSP_MODE_CLIENT) {
+        return false;
+    }
+
+    links[slot].msp = msp;
+    links[slot].linkId = linkId;
+    links[slot].periodMs = periodMs ? periodMs : MSP_RECORDER_DEFAULT_PERIOD_MS;
+    links[slot].awaiting = false;
+    links[slot].nextPollAt = millis();
+    msp->replyHandlerFn = linkReplyHandlers[slot];
+    return true;
+}
+
+
+// call once per loop next to mspSerialProcess()
+void mspRecorderProcess(void)
+{
+    uint32_t now = millis();
+    int slot;
+
+    for (slot = 0; slot < MSP_RECORDER_MAX_LINKS; slot++) {
+        mspRecorderLink_t *link = &links[slot];
+
+        if (!link->msp) {
+            continue;
+        }
+
+        if (link->awaiting && now - link->sentAt > MSP_RECORDER_REPLY_TIMEOUT_MS) {
+            link->awaiting = false;
+            recorderStats.timeouts++;
+        }
+
+        if (link->awaiting || (int32_t)(now - link->nextPollAt) < 0 || link->msp->commandSenderFn) {
+            continue;
+        }
+
+        // a link that fell behind polls at its period again rather than catching up in a burst
+        link->nextPollAt += link->periodMs;
+        if ((int32_t)(now - link->nextPollAt) >= 0) {
+            link->nextPollAt = now + link->periodMs;
+        }
+
+        link->awaiting = true;
+        link->sentAt = now;
+        link->msp->commandSenderFn = linkSenders[slot];
+    }
+}
+
+
+// how long the loop may sleep on msp before its next poll is due, UINT32_MAX when it is not a link
+uint32_t mspRecorderTimeUntilDueMs(mspPort_t *msp)
+{
+    uint32_t now = millis();
+    int slot;
+
+    for (slot = 0; slot < MSP_RECORDER_MAX_LINKS; slot++) {
+        mspRecorderLink_t *link = &links[slot];
+
+        if (link->msp == msp && !link->awaiting) {
+            return (int32_t)(link->nextPollAt - now) > 0 ? link->nextPollAt - now : 0;
+        }
+    }
+    return UINT32_MAX;
+}
+
+
+void mspRecorderStop(void)
+{
+    int slot;
+
+    if (!fileBase) {
+        return;
+    }
+
+    for (slot = 0; slot < MSP_RECORDER_MAX_LINKS; slot++) {
+        if (links[slot].msp) {
+            links[slot].msp->replyHandlerFn = NULL;
+            links[slot].msp = NULL;
+        }
+    }
+
+    msync(fileBase, fileSize, MS_SYNC);
+    munmap(fileBase, fileSize);
+    fileBase = NULL;
+    header = NULL;
+
+    fprintf(stderr, "recorder: %llu rows, %u polls, %u timeouts, %u dropped\n",
+            (unsigned long long)recorderStats.rows, recorderStats.polls, recorderStats.timeouts, recorderStats.dropped);
+}
+
+
+const mspRecorderStats_t *mspRecorderGetStats(void)
+{
+    return &recorderStats;
+}
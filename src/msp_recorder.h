@@ -0,0 +1,25 @@
+#pragma once
+#include "lib.h"
+#include "msp_recorder_file.h"
+
+#define MSP_RECORDER_MAX_LINKS MAX_MSP_PORT_COUNT
+#define MSP_RECORDER_DEFAULT_CAPACITY (1 << 20)     // rows, about 70 MB on disk
+#define MSP_RECORDER_DEFAULT_PERIOD_MS 20
+#define MSP_RECORDER_REPLY_TIMEOUT_MS 250
+#define MSP_RECORDER_INDEX_STRIDE 1024
+#define MSP_RECORDER_CHANNELS 8                     // rc and motor columns each
+
+typedef struct mspRecorderStats_s {
+    uint64_t rows;
+    uint32_t polls;
+    uint32_t timeouts;
+    uint32_t dropped;                               // replies that arrived with the file full
+} mspRecorderStats_t;
+
+// capacity is in rows, the file is allocated up front so appending never waits on the filesystem
+bool mspRecorderStart(const char *path, uint64_t capacity);
+bool mspRecorderAddLink(mspPort_t *msp, uint8_t linkId, uint16_t periodMs);
+void mspRecorderProcess(void);
+uint32_t mspRecorderTimeUntilDueMs(mspPort_t *msp);
+void mspRecorderStop(void);
+const mspRecorderStats_t *mspRecorderGetStats(void);
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * On-disk layout of a telemetry recording, shared by the recorder and the offline tools.
+ *
+ * The file is one header page followed by one fixed-stride array per column, each page aligned
+ * and sized for rowCapacity rows, then a sparse time index holding time_us of every indexStride-th
+ * row. A reader maps the file and scans rowCount rows of any column as a plain array. Rows past
+ * rowCount may be partially written. All values are little endian.
+ */
+
+#define MSP_RECORDER_MAGIC "MSPREC1"
+#define MSP_RECORDER_VERSION 1
+#define MSP_RECORDER_PAGE_SIZE 4096
+#define MSP_RECORDER_MAX_COLUMNS 64
+#define MSP_RECORDER_COLUMN_NAME_LENGTH 16
+
+typedef struct mspRecorderColumnDesc_s {
+    char name[MSP_RECORDER_COLUMN_NAME_LENGTH];
+    uint8_t width;                              // bytes per value, 1, 2, 4 or 8
+    uint8_t isSigned;
+    uint8_t reserved[6];
+    uint64_t offset;                            // file offset of row 0
+} mspRecorderColumnDesc_t;
+
+typedef struct mspRecorderFileHeader_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t columnCount;
+    uint64_t rowCapacity;
+    uint64_t rowCount;                          // rows completely written, only ever grows
+    uint32_t indexStride;
+    uint32_t reserved;
+    uint64_t indexOffset;                       // uint64_t time_us per indexStride rows
+    mspRecorderColumnDesc_t columns[MSP_RECORDER_MAX_COLUMNS];
+} mspRecorderFileHeader_t;
+
+_Static_assert(sizeof(mspRecorderFileHeader_t) <= MSP_RECORDER_PAGE_SIZE, "header must fit its page");
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "msp_protocol.h"
+#include "msp_messages.h"
+#include "msp_telemetry.h"
+#include "msp_frame.h"
+
+/*
+ * Server push telemetry.
+ *
+ * A client sends MSP_TELEMETRY_SUBSCRIBE once with a list of read-only commands and periods,
+ * after which the server emits the reply frames for those commands on its own schedule.
+ * Any valid frame from the client counts as a keepalive, when the link goes quiet for
+ * MSP_TELEMETRY_IDLE_TIMEOUT_MS every subscription on the port is cancelled.
+ *
+ * A pushed frame is encoded once per command and millisecond, other ports that are due for the
+ * same command in the same millisecond queue a reference to that frame instead of re-encoding.
+ */
+
+typedef struct mspTelemetryPush_s {
+    uint8_t cmd;
+    uint32_t at;
+    mspFrame_t *frame;
+} mspTelemetryPush_t;
+
+static mspTelemetryPush_t recentPushes[MSP_MAX_SUBSCRIPTIONS];
+static mspTelemetryStats_t stats;
+
+static mspSubscription_t *mspTelemetryFindSubscription(mspPort_t *msp, uint8_t cmd)
+{
+    int i;
+
+    for (i = 0; i < MSP_MAX_SUBSCRIPTIONS; i++) {
+        if (msp->subscriptions[i].periodMs && msp->subscriptions[i].cmd == cmd) {
+            return &msp->subscriptions[i];
+        }
+    }
+    return NULL;
+}
+
+
+static int mspTelemetryActiveCount(mspPort_t *msp)
+{
+    int i;
+    int count = 0;
+
+    for (i = 0; i < MSP_MAX_SUBSCRIPTIONS; i++) {
+        if (msp->subscriptions[i].periodMs) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+static void mspTelemetryCancelAll(mspPort_t *msp)
+{
+    memset(msp->subscriptions, 0, sizeof(msp->subscriptions));
+}
+
+
+static void mspTelemetrySubscribe(mspPort_t *msp, uint8_t cmd, uint16_t periodMs)
+{
+    mspSubscription_t *sub = mspTelemetryFindSubscription(msp, cmd);
+
+    if (!periodMs) {
+        if (sub) {
+            sub->periodMs = 0;
+        }
+        return;
+    }
+
+    if (!mspCommandIsReadOnly(cmd)) {
+        return;                                 // pushing a setter would repeat its side effect
+    }
+
+    if (!sub) {
+        for (sub = msp->subscriptions; sub < ARRAYEND(msp->subscriptions) && sub->periodMs; sub++);
+        if (sub == ARRAYEND(msp->subscriptions)) {
+            return;
+        }
+    }
+
+    sub->cmd = cmd;
+    sub->periodMs = periodMs < MSP_TELEMETRY_MIN_PERIOD_MS ? MSP_TELEMETRY_MIN_PERIOD_MS : periodMs;
+    sub->nextDueAt = millis();
+}
+
+
+// MSP_TELEMETRY_SUBSCRIBE: adds, changes or (period 0) removes subscriptions of this port, an
+// empty request cancels all of them. The reply is the number still active.
+void mspTelemetryProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply)
+{
+    sbuf_t *src = &command->buf;
+    mspTelemetrySubscription_t entry;
+
+    reply->cmd = command->cmd;
+
+    if (sbufBytesRemaining(src) == 0) {
+        mspTelemetryCancelAll(msp);
+    }
+
+    while (sbufReadMessage(src, entry)) {
+        mspTelemetrySubscribe(msp, entry.cmd, le16toh(entry.periodMs));
+    }
+
+    sbufWriteU8(&reply->buf, mspTelemetryActiveCount(msp));
+    reply->result = 1;
+}
+
+
+static mspFrame_t *mspTelemetryBuildFrame(uint8_t cmd)
+{
+    mspFrame_t *frame = mspFrameAlloc();
+
+    if (!frame) {
+        return NULL;
+    }
+
+    mspPacket_t reply = {
+        .buf = {
+            .ptr = mspFramePayload(frame),
+            .end = mspFramePayload(frame) + MSP_PORT_OUTBUF_SIZE,
+        },
+        .cmd = -1,
+        .result = 0,
+    };
+
+    mspPacket_t command = {
+        .buf = {
+            .ptr = NULL,
+            .end = NULL,
+        },
+        .cmd = cmd,
+        .result = 0,
+    };
+
+    if (mspProcessCommand(&command, &reply) <= 0) {
+        mspFrameRelease(frame);
+        return NULL;                            // nothing worth pushing, the subscriber keeps its last value
+    }
+
+    sbufSwitchToReader(&reply.buf, mspFramePayload(frame));
+    mspSerialEncodeFrame(frame, '>', &reply);
+    return frame;
+}
+
+
+static void mspTelemetryEmit(mspPort_t *msp, uint8_t cmd)
+{
+    uint32_t now = millis();
+    mspTelemetryPush_t *push = &recentPushes[cmd % MSP_MAX_SUBSCRIPTIONS];
+
+    if (!push->frame || push->cmd != cmd || push->at != now) {
+        mspFrame_t *frame = mspTelemetryBuildFrame(cmd);
+        if (!frame) {
+            return;
+        }
+        if (push->frame) {
+            mspFrameRelease(push->frame);
+        }
+        push->cmd = cmd;
+        push->at = now;
+        push->frame = frame;
+    } else {
+        stats.shared++;
+    }
+
+    if (mspSerialSubmitFrame(msp, push->frame, MSP_TX_PRIORITY_TELEMETRY)) {
+        stats.pushed++;
+    } else {
+        stats.dropped++;                        // tx queue full, the subscriber gets the next period's value
+    }
+}
+
+
+// a cached frame is only shared within its millisecond, after that the tx queues hold the only references
+static void mspTelemetryExpirePushes(uint32_t now)
+{
+    mspTelemetryPush_t *push;
+
+    for (push = recentPushes; push < ARRAYEND(recentPushes); push++) {
+        if (push->frame && push->at != now) {
+            mspFrameRelease(push->frame);
+            push->frame = NULL;
+        }
+    }
+}
+
+
+void mspTelemetryProcess(mspPort_t *msp)
+{
+    uint32_t now = millis();
+    int i;
+
+    mspTelemetryExpirePushes(now);
+
+    if (!mspTelemetryActiveCount(msp)) {
+        return;
+    }
+
+    if (now - msp->lastActivityAt > MSP_TELEMETRY_IDLE_TIMEOUT_MS) {
+        mspTelemetryCancelAll(msp);
+        return;
+    }
+
+    for (i = 0; i < MSP_MAX_SUBSCRIPTIONS; i++) {
+        mspSubscription_t *sub = &msp->subscriptions[i];
+        if (!sub->periodMs || (int32_t)(now - sub->nextDueAt) < 0) {
+            continue;
+        }
+
+        mspTelemetryEmit(msp, sub->cmd);
+
+        sub->nextDueAt += sub->periodMs;
+        if ((int32_t)(now - sub->nextDueAt) >= 0) {
+            sub->nextDueAt = now + sub->periodMs;  // fell behind, skip rather than burst to catch up
+        }
+    }
+}
+
+
+// how long the receive path may block before the next push is due
+uint32_t mspTelemetryTimeUntilDueMs(mspPort_t *msp)
+{
+    uint32_t now = millis();
+    uint32_t wait = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < MSP_MAX_SUBSCRIPTIONS; i++) {
+        mspSubscription_t *sub = &msp->subscriptions[i];
+        if (!sub->periodMs) {
+            continue;
+        }
+        if ((int32_t)(sub->nextDueAt - now) <= 0) {
+            return 0;
+        }
+        if (sub->nextDueAt - now < wait) {
+            wait = sub->nextDueAt - now;
+        }
+    }
+    return wait;
+}
+
+
+void mspTelemetryReport(void)
+{
+    if (!stats.pushed && !stats.dropped) {
+        return;
+    }
+    fprintf(stderr, "telemetry %llu pushes (%llu shared between ports), %llu dropped on a full tx queue\n",
+            (unsigned long long)stats.pushed, (unsigned long long)stats.shared, (unsigned long long)stats.dropped);
+}
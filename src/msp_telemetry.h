@@ -0,0 +1,16 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_TELEMETRY_IDLE_TIMEOUT_MS 2000   // subscriptions are dropped when the client sends nothing for this long
+#define MSP_TELEMETRY_MIN_PERIOD_MS 5
+
+typedef struct mspTelemetryStats_s {
+    uint64_t pushed;                            // frames queued to a subscriber
+    uint64_t shared;                            // of those, reusing a frame encoded for another port
+    uint64_t dropped;                           // not queued, the port's tx queue was full
+} mspTelemetryStats_t;
+
+void mspTelemetryProcessCommand(mspPort_t *msp, mspPacket_t *command, mspPacket_t *reply);
+void mspTelemetryProcess(mspPort_t *msp);
+uint32_t mspTelemetryTimeUntilDueMs(mspPort_t *msp);
+void mspTelemetryReport(void);
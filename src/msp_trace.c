@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msp_trace.h"
+
+typedef struct mspTraceRecord_s {
+    uint32_t startUs;
+    uint32_t durationUs;
+    uint16_t portId;
+    uint8_t cmd;
+    uint8_t kind;
+} mspTraceRecord_t;
+
+typedef struct mspTraceRing_s {
+    mspTraceRecord_t records[MSP_TRACE_RING_SIZE];
+    atomic_uint head;                           // records written so far, the ring holds the last MSP_TRACE_RING_SIZE
+} mspTraceRing_t;
+
+static const char * const spanNames[MSP_TRACE_SPAN_COUNT] = {
+    [MSP_TRACE_SPAN_RX] = "rx",
+    [MSP_TRACE_SPAN_DISPATCH] = "dispatch",
+    [MSP_TRACE_SPAN_TX] = "tx",
+    [MSP_TRACE_SPAN_REQUEST] = "request",
+};
+
+bool mspTraceEnabled;
+
+static const char *tracePath;
+static mspTraceRing_t *rings[MSP_TRACE_MAX_THREADS];
+static atomic_uint ringCount;
+static __thread mspTraceRing_t *threadRing;
+
+
+// rings are allocated once per thread on its first span, never in the steady state
+static mspTraceRing_t *mspTraceThreadRing(void)
+{
+    if (!threadRing) {
+        uint32_t index = atomic_fetch_add(&ringCount, 1);
+        if (index >= MSP_TRACE_MAX_THREADS) {
+            return NULL;
+        }
+        threadRing = calloc(1, sizeof(mspTraceRing_t));
+        rings[index] = threadRing;
+    }
+    return threadRing;
+}
+
+
+void mspTraceRecord(mspTraceSpan_e kind, uint16_t portId, uint8_t cmd, uint32_t startUs)
+{
+    mspTraceRing_t *ring = mspTraceThreadRing();
+    uint32_t now = micros();
+
+    if (!ring || !startUs) {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    mspTraceRecord_t *record = &ring->records[head % MSP_TRACE_RING_SIZE];
+    record->startUs = startUs;
+    record->durationUs = now - startUs;
+    record->portId = portId;
+    record->cmd = cmd;
+    record->kind = kind;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+bool mspTraceStart(const char *path)
+{
+    tracePath = path;
+    mspTraceEnabled = true;
+    return mspTraceThreadRing() != NULL;
+}
+
+
+// writes every span still held in the rings, the file is rewritten on each dump
+bool mspTraceDump(void)
+{
+    FILE *f;
+    uint32_t r;
+    bool first = true;
+
+    if (!tracePath || !(f = fopen(tracePath, "w"))) {
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (r = 0; r < atomic_load(&ringCount) && r < MSP_TRACE_MAX_THREADS; r++) {
+        mspTraceRing_t *ring = rings[r];
+        if (!ring) {
+            continue;
+        }
+
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t i = head > MSP_TRACE_RING_SIZE ? head - MSP_TRACE_RING_SIZE : 0;
+        for (; i < head; i++) {
+            mspTraceRecord_t *record = &ring->records[i % MSP_TRACE_RING_SIZE];
+            fprintf(f, "%s{\"name\":\"%s %u\",\"cat\":\"msp\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":%u,\"tid\":%u,\"args\":{\"cmd\":%u}}",
+                first ? "" : ",\n", spanNames[record->kind], record->cmd, record->startUs, record->durationUs,
+                r + 1, record->portId, record->cmd);
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
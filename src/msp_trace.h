@@ -0,0 +1,31 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_TRACE_RING_SIZE 65536               // spans kept per thread, oldest are overwritten
+#define MSP_TRACE_MAX_THREADS 16
+
+typedef enum {
+    MSP_TRACE_SPAN_RX,                          // first header byte to checksum validated
+    MSP_TRACE_SPAN_DISPATCH,                    // command handler
+    MSP_TRACE_SPAN_TX,                          // frame encoded to last byte handed to the port
+    MSP_TRACE_SPAN_REQUEST,                     // first header byte of the request to last byte of its reply
+    MSP_TRACE_SPAN_COUNT
+} mspTraceSpan_e;
+
+/*
+ * Opt-in per frame latency tracing.
+ *
+ * Spans go into a per-thread ring and are written out as Chrome trace event JSON, which both
+ * chrome://tracing and ui.perfetto.dev open. Each msp port is its own track, span names carry
+ * the command id. When tracing is off every hook is a single predictable branch.
+ */
+extern bool mspTraceEnabled;
+
+#define mspTraceSpan(kind, msp, cmd, startUs) \
+    do { if (mspTraceEnabled) mspTraceRecord((kind), (msp)->traceId, (cmd), (startUs)); } while (0)
+
+#define mspTraceNow() (mspTraceEnabled ? micros() : 0)
+
+bool mspTraceStart(const char *path);
+void mspTraceRecord(mspTraceSpan_e kind, uint16_t portId, uint8_t cmd, uint32_t startUs);
+bool mspTraceDump(void);
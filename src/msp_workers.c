@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "msp_workers.h"
+#include "msp_realtime.h"
+
+typedef struct mspWorkerJob_s {
+    mspPort_t *msp;
+    mspReplySlot_t *slot;
+} mspWorkerJob_t;
+
+static pthread_t threads[MSP_WORKERS_MAX];
+static int threadCount;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t allIdle = PTHREAD_COND_INITIALIZER;
+static mspWorkerJob_t jobs[MSP_WORKERS_QUEUE_SIZE];
+static int jobHead;
+static int jobCount;
+static int jobsRunning;                     // submitted and not finished, queued ones included
+static bool stopping;
+
+static int wakeFd = -1;                     // written on every finished job, wakes the main loop from select()
+
+
+static void *mspWorkerMain(void *arg)
+{
+    uint64_t one = 1;
+
+    mspRealtimeEnterThread((int)(intptr_t)arg);
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!jobCount && !stopping) {
+            pthread_cond_wait(&jobReady, &lock);
+        }
+        if (!jobCount) {
+            break;
+        }
+
+        mspWorkerJob_t job = jobs[jobHead];
+        jobHead = (jobHead + 1) % MSP_WORKERS_QUEUE_SIZE;
+        jobCount--;
+        pthread_mutex_unlock(&lock);
+
+        mspSerialExecuteCommand(job.msp, job.slot);
+        atomic_store_explicit(&job.slot->done, true, memory_order_release);
+        ssize_t written = write(wakeFd, &one, sizeof(one));  // can only fail once 2^64 - 1 wakeups are unread
+        UNUSED(written);
+
+        pthread_mutex_lock(&lock);
+        if (--jobsRunning == 0) {
+            pthread_cond_broadcast(&allIdle);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+
+bool mspWorkersStart(int count)
+{
+    if (count > MSP_WORKERS_MAX) {
+        count = MSP_WORKERS_MAX;
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        return false;
+    }
+
+    stopping = false;
+    for (threadCount = 0; threadCount < count; threadCount++) {
+        if (pthread_create(&threads[threadCount], NULL, mspWorkerMain, (void *)(intptr_t)threadCount) != 0) {
+            break;
+        }
+    }
+
+    if (!threadCount) {
+        close(wakeFd);
+        wakeFd = -1;
+        return false;
+    }
+
+    usbSetWakeFd(wakeFd);
+    return true;
+}
+
+
+// finishes the queued jobs first, their slots belong to ports that are still alive
+void mspWorkersStop(void)
+{
+    int i;
+
+    if (!threadCount) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    threadCount = 0;
+
+    usbSetWakeFd(-1);
+    close(wakeFd);
+    wakeFd = -1;
+}
+
+
+// false when there is no pool, the caller then runs the command itself
+bool mspWorkersSubmit(mspPort_t *msp, mspReplySlot_t *slot)
+{
+    if (!threadCount) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    jobs[(jobHead + jobCount) % MSP_WORKERS_QUEUE_SIZE] = (mspWorkerJob_t){ .msp = msp, .slot = slot };
+    jobCount++;
+    jobsRunning++;
+    pthread_cond_signal(&jobReady);
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+
+// returns once every submitted command has finished, their replies may still wait to be emitted
+void mspWorkersWaitIdle(void)
+{
+    if (!threadCount) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (jobsRunning) {
+        pthread_cond_wait(&allIdle, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+// clears pending wakeups, call before looking at finished slots so none is slept through
+void mspWorkersCollect(void)
+{
+    uint64_t count;
+
+    if (wakeFd >= 0) {
+        ssize_t got = read(wakeFd, &count, sizeof(count));  // EAGAIN when nothing finished since the last call
+        UNUSED(got);
+    }
+}
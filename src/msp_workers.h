@@ -0,0 +1,20 @@
+#pragma once
+#include "lib.h"
+
+#define MSP_WORKERS_MAX 16
+#define MSP_WORKERS_QUEUE_SIZE (MAX_MSP_PORT_COUNT * MSP_PORT_REPLY_WINDOW)   // every reply slot of every port
+
+/*
+ * Worker pool for server mode commands.
+ *
+ * Commands without side effects are handed to the pool and execute in parallel, across ports and
+ * across pipelined requests of one port. Everything else still runs on the main loop, once the
+ * pool has drained. Replies are put on the wire by the main loop in dispatch order regardless of
+ * which finished first, see mspSerialEmitReplies(). Without mspWorkersStart() every command runs
+ * inline as before.
+ */
+bool mspWorkersStart(int count);
+void mspWorkersStop(void);
+bool mspWorkersSubmit(mspPort_t *msp, mspReplySlot_t *slot);
+void mspWorkersWaitIdle(void);
+void mspWorkersCollect(void);
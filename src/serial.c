@@ -5,9 +5,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <limits.h>
 #include "lib.h"
+#include "msp_realtime.h"
 
 #define edison_port "/dev/ttyMFD2";
+#define USB_TX_BUFFER_SIZE 1024                 // power of two, indices wrap with a mask
+#define USB_REOPEN_BACKOFF_MIN_MS 50
+#define USB_REOPEN_BACKOFF_MAX_MS 5000
 
 
 
@@ -18,11 +28,28 @@ int temp_data_len;
 char temp_buff[100];
 
 
-char portname[20] = edison_port;
+char portname[PATH_MAX] = edison_port;
+
+static uint32_t rxWaitTimeoutUs = SELECT_TIMEOUT_US;
+static int wakeFd = -1;                         // readable when something other than the port needs the loop
+static uint32_t busyPollIdleUs;                 // 0 blocks in select() as usual
+static uint32_t lastRxUs;
+static uint32_t loopWakeUs;                     // when the last wait returned with work, 0 after a timeout
+
+// hot-plug: an inotify watch on the device directory wakes a reopen as soon as the node comes
+// back, the backoff timer covers filesystems without inotify and nodes that appear half set up
+static int hotplugFd = -1;
+static uint32_t reopenAt;
+static uint32_t reopenBackoffMs = USB_REOPEN_BACKOFF_MIN_MS;
 
 
 uartPort_t USB;
 
+static uint8_t usbTxBuffer[USB_TX_BUFFER_SIZE];
+
+static void usbVcpWriteBuf(serialPort_t *instance, void *data, int count);
+static void usbVcpEndWrite(serialPort_t *instance);
+
 LINE_CODING linecoding = 
 { 
     115200, /* baud rate*/
@@ -114,8 +141,8 @@ static const struct serialPortVTable usbTable[] = {
         .isSerialTransmitBufferEmpty = usb_txbuffer_empty,              //used
         .setMode = usbVcpSetMode,                                       //used, TBD
         .beginWrite = NULL,                                             //not needed
-        .endWrite = NULL,                                               //not needed
-        .writeBuf = NULL                                                //not needed
+        .endWrite = usbVcpEndWrite,                                     //pushes coalesced frames to the fd
+        .writeBuf = usbVcpWriteBuf                                      //copies into the tx ring
     }
 };
 
@@ -132,16 +159,57 @@ uint8_t usbIsConnected(void)
 
 
 
+static uint32_t usbTxBytesQueued(void)
+{
+    return USB.port.txBufferHead - USB.port.txBufferTail;
+}
+
+
+// Writes as much of the tx ring as the fd takes without blocking, both halves of a wrapped ring
+// go out in one writev so small frames queued back to back leave in a single syscall.
+void usbTxDrain(void)
+{
+    while (usbTxBytesQueued() && usbIsConnected()) {
+        uint32_t tail = USB.port.txBufferTail & (USB_TX_BUFFER_SIZE - 1);
+        uint32_t queued = usbTxBytesQueued();
+        uint32_t first = USB_TX_BUFFER_SIZE - tail < queued ? USB_TX_BUFFER_SIZE - tail : queued;
+        struct iovec iov[2] = {
+            { .iov_base = usbTxBuffer + tail, .iov_len = first },
+            { .iov_base = usbTxBuffer, .iov_len = queued - first },
+        };
+
+        ssize_t wlen = writev(USB.fd, iov, queued > first ? 2 : 1);
+        if (wlen < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                usbClose();
+            }
+            break;                              // EAGAIN, retried when select reports the fd writable
+        }
+        USB.port.txBufferTail += wlen;
+    }
+}
+
+
 uint32_t usbWrite(uint8_t* str, int len)
 {
-    //Don't write if USB is not connected
+    // nobody is listening while the adapter is away, replies and pushes are dropped rather than
+    // queued up and delivered stale after the reconnect
     if(usbIsConnected() == false)
     {
-        printf("USB not connected\t%d\n",USB.deviceState);
-        return -1;
+        return len;
+    }
+
+    // never block the loop on a slow UART, whatever does not fit is the producer's to retry
+    uint32_t space = USB_TX_BUFFER_SIZE - usbTxBytesQueued();
+    int wlen = len < (int)space ? len : (int)space;
+    int i;
+
+    for (i = 0; i < wlen; i++) {
+        usbTxBuffer[USB.port.txBufferHead++ & (USB_TX_BUFFER_SIZE - 1)] = str[i];
     }
-    int wlen;
-    wlen = write(USB.fd, str, len);
     return wlen;
 }
 
@@ -156,21 +224,94 @@ uint8_t serial_waiting(serialPort_t *instance)
     }    
 
     UNUSED(instance);
+
+    if(!usbIsConnected())
+    {
+        usbWaitForDevice();
+        return 0;
+    }
+
     fd_set readset;                             //for the select function
+    fd_set writeset;
     FD_ZERO(&readset);
+    FD_ZERO(&writeset);
     FD_SET(USB.fd, &readset);
-    uint32_t result;
+    if(usbTxBytesQueued())
+    {
+        FD_SET(USB.fd, &writeset);
+    }
+    if(wakeFd >= 0)
+    {
+        FD_SET(wakeFd, &readset);
+    }
+    int result;
+    uint32_t waitUs = rxWaitTimeoutUs;
+    uint32_t waitStartUs = 0;
+
+    // busy-polling keeps spinning while bytes keep coming and goes back to blocking once idle
+    if(busyPollIdleUs && micros() - lastRxUs < busyPollIdleUs)
+    {
+        waitUs = 0;
+    }
+
+    if(mspRealtimeEnabled)
+    {
+        waitStartUs = micros();
+        if(loopWakeUs)
+        {
+            mspRealtimeRecordLoop(waitStartUs - loopWakeUs);
+        }
+    }
         
-    struct timeval tv = {SELECT_TIMEOUT, SELECT_TIMEOUT_US};   // sleep for ten minutes!
+    struct timeval tv = {SELECT_TIMEOUT, waitUs};   // sleep for ten minutes!
+
+    result = select((USB.fd > wakeFd ? USB.fd : wakeFd) + 1, &readset, &writeset, NULL, &tv);
+    if(result < 0)
+    {
+        loopWakeUs = 0;                         // interrupted (EINTR from a signal), the sets are undefined
+        return 0;
+    }
+
+    if(mspRealtimeEnabled)
+    {
+        uint32_t now = micros();
+        loopWakeUs = result > 0 ? now : 0;
+        if(result == 0 && waitUs && now - waitStartUs > waitUs)
+        {
+            mspRealtimeRecordWakeLate(now - waitStartUs - waitUs);
+        }
+    }
+
+    if(result > 0 && FD_ISSET(USB.fd, &writeset))
+    {
+        usbTxDrain();
+        if(!FD_ISSET(USB.fd, &readset))
+        {
+            return 0;
+        }
+    }
 
-    result = select(USB.fd + 1, &readset, NULL, NULL, &tv);
+    if(result > 0 && !FD_ISSET(USB.fd, &readset))
+    {
+        return 0;                               // only the wake fd fired
+    }
 
     if(result > 0)
     {
         temp_data_len = read(USB.fd, temp_buff, sizeof(temp_buff));
+        if(temp_data_len <= 0)
+        {
+            // readable with nothing to read (or EIO) is how a tty reports a hangup
+            if(temp_data_len == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                usbClose();
+            }
+            return 0;
+        }
         data_available = true;
         data_read = false;
         read_pos = 0;
+        lastRxUs = micros();
     }
 
     //printf("result:%d\n",result);
@@ -183,55 +324,86 @@ int32_t usbRead(uint8_t* buf, int len)
     if(!data_available)
     {
         //TBD
+        return -1;
     }
-    else
+
+    *buf = temp_buff[read_pos++];
+    if(read_pos >= temp_data_len)
     {
-        read_pos++;
-        if(read_pos <= temp_data_len)
-        {
-            *buf = temp_buff[read_pos-1];
-            return 1;
-        }
+        // last buffered byte handed out, next serial_waiting() refills from the fd
+        data_read = true;
+        data_available = false;
+    }
+    return 1;
+}
 
-        else
-        {
-            data_read = true;
-            data_available = false;
-            return -1;
-        }
+
+// fd that ends the wait for incoming bytes early when it becomes readable, -1 for none.
+// The owner drains it, see mspWorkersCollect().
+void usbSetWakeFd(int fd)
+{
+    wakeFd = fd;
+}
+
+
+// Polls the port without sleeping until idleUs pass without a byte, then blocks again until the
+// next one arrives. 0 turns it off. Only worth it with a cpu to spare, see msp_realtime.h.
+void usbSetBusyPoll(uint32_t idleUs)
+{
+    busyPollIdleUs = idleUs;
+    lastRxUs = micros() - idleUs;
+}
+
+
+// shortens the wait for incoming bytes when something else, like a telemetry push, is due sooner
+void usbSetRxWaitTimeout(uint32_t timeoutUs)
+{
+    rxWaitTimeoutUs = timeoutUs < SELECT_TIMEOUT_US ? timeoutUs : SELECT_TIMEOUT_US;
+}
+
+
+// like usbSetRxWaitTimeout() but never lengthens the wait already set
+void usbCapRxWaitTimeout(uint32_t timeoutUs)
+{
+    if (timeoutUs < rxWaitTimeoutUs) {
+        rxWaitTimeoutUs = timeoutUs;
     }
 }
 
 
 uint8_t usbTxBytesFree(serialPort_t *instance)
 {
-    // Because we block upon transmit and don't buffer bytes, our "buffer" capacity is effectively unlimited.
     UNUSED(instance);
-    return 255;
+    uint32_t space = USB_TX_BUFFER_SIZE - usbTxBytesQueued();
+    return space > 255 ? 255 : space;
 }
 
 
 bool usb_txbuffer_empty(serialPort_t *instance)
 {
-    return true;
+    UNUSED(instance);
+    return usbTxBytesQueued() == 0;
 }
 
 serialPort_t* usartInitAllIOSignals(void)        //usartIrqHandler() not setup in the original version of cleanflight in this function
 {
+    USB.fd = -1;
     USB.deviceState = UNCONNECTED;
     USB.port.vTable = usbTable;
+    USB.port.txBuffer = usbTxBuffer;
+    USB.port.txBufferSize = USB_TX_BUFFER_SIZE;
     usbInit();
     return &USB.port;
 }
 
 
-void SetUsbAttributes(int fd)       //UART characteristics hardcoded here!!!
+bool SetUsbAttributes(int fd)       //UART characteristics hardcoded here!!!
 {
     struct termios tty;
 
     if (tcgetattr(fd, &tty) < 0) {
         //printf("Error from tcgetattr: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     cfsetospeed(&tty, (speed_t)(linecoding.bitrate));
@@ -247,31 +419,123 @@ void SetUsbAttributes(int fd)       //UART characteristics hardcoded here!!!
     tty.c_cflag &= ~CSTOPB;     //only need 1 stop bit
     tty.c_cflag &= ~CRTSCTS;    //no hardware flowcontrol
 
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        exit(EXIT_FAILURE);
+    return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+
+// overrides the default device, must be called before usartInitAllIOSignals()
+void usbSetDevice(const char *path)
+{
+    snprintf(portname, sizeof(portname), "%s", path);
+}
+
+
+// opens and configures the device without blocking, on failure the next attempt is pushed back
+bool usbOpen(void)
+{
+    int fd = open(portname, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd >= 0) {
+        USB.fd = fd;
+        USB.deviceState = ATTACHED;
+        tcflush(fd, TCIOFLUSH);
+        if (SetUsbAttributes(fd)) {
+            USB.deviceState = CONFIGURED;
+            reopenBackoffMs = USB_REOPEN_BACKOFF_MIN_MS;
+            return true;
+        }
+        close(fd);
+        USB.fd = -1;
+        USB.deviceState = UNCONNECTED;
     }
-    return;
- 
+
+    reopenAt = millis() + reopenBackoffMs;
+    reopenBackoffMs = reopenBackoffMs * 2 < USB_REOPEN_BACKOFF_MAX_MS ? reopenBackoffMs * 2 : USB_REOPEN_BACKOFF_MAX_MS;
+    return false;
+}
+
+
+// Drops the fd after a hangup. The msp port on top keeps its state, a frame cut in half by the
+// unplug is thrown away by the parser's checksum and resync once bytes flow again.
+void usbClose(void)
+{
+    if (USB.fd >= 0) {
+        close(USB.fd);
+    }
+    USB.fd = -1;
+    USB.deviceState = UNCONNECTED;
+    USB.port.txBufferTail = USB.port.txBufferHead;
+    data_read = true;
+    data_available = false;
+
+    reopenBackoffMs = USB_REOPEN_BACKOFF_MIN_MS;
+    reopenAt = millis() + reopenBackoffMs;
+}
+
+
+static bool usbHotplugEventForPort(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[sizeof(portname)];
+    const char *name;
+    bool found = false;
+    ssize_t len;
+
+    strcpy(path, portname);
+    name = basename(path);
+
+    while ((len = read(hotplugFd, events, sizeof(events))) > 0) {
+        char *p;
+        for (p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            found |= event->len && strcmp(event->name, name) == 0;
+        }
+    }
+    return found;
 }
 
 
-int usbOpen(void)
+// Called in place of the rx select while the device is gone. Sleeps no longer than the regular rx
+// wait so the other ports keep being served, and reopens on a hot-plug event or when the backoff expires.
+void usbWaitForDevice(void)
 {
-    int fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
-    if (fd < 0) {
-        exit(EXIT_FAILURE);
+    int32_t untilReopenMs = (int32_t)(reopenAt - millis());
+    uint32_t waitUs = untilReopenMs <= 0 ? 0 : (uint32_t)untilReopenMs * 1000;
+    struct timeval tv;
+    fd_set readset;
+
+    if (waitUs > rxWaitTimeoutUs) {
+        waitUs = rxWaitTimeoutUs;
+    }
+    tv.tv_sec = waitUs / 1000000;
+    tv.tv_usec = waitUs % 1000000;
+
+    FD_ZERO(&readset);
+    if (hotplugFd >= 0) {
+        FD_SET(hotplugFd, &readset);
+    }
+
+    if (select(hotplugFd + 1, &readset, NULL, NULL, &tv) > 0 && usbHotplugEventForPort()) {
+        usbOpen();
+    } else if ((int32_t)(millis() - reopenAt) >= 0) {
+        usbOpen();
     }
-    USB.fd = fd;
-    USB.deviceState = CONFIGURED;
-    return fd;
 }
 
 
 void usbInit(void)
 {
-    int fd = usbOpen();
-    tcflush(fd,TCIOFLUSH);
-    SetUsbAttributes(fd);    
+    char dir[sizeof(portname)];
+
+    strcpy(dir, portname);
+    hotplugFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplugFd >= 0 && inotify_add_watch(hotplugFd, dirname(dir), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+        close(hotplugFd);
+        hotplugFd = -1;
+    }
+
+    // a missing adapter at startup is just a disconnected one
+    usbOpen();
 }
 
 
@@ -281,6 +545,20 @@ static void usbVcpWrite(serialPort_t *instance, uint8_t c)
 }
 
 
+static void usbVcpWriteBuf(serialPort_t *instance, void *data, int count)
+{
+    UNUSED(instance);
+    usbWrite(data, count);
+}
+
+
+static void usbVcpEndWrite(serialPort_t *instance)
+{
+    UNUSED(instance);
+    usbTxDrain();
+}
+
+
 static uint8_t usbVcpRead(serialPort_t *instance)
 {
     UNUSED(instance);
@@ -314,18 +592,19 @@ void sbufWriteU8(sbuf_t *dst, uint8_t val)
     *dst->ptr++ = val;
 }
 
+// memcpy of a fixed size compiles to a single unaligned store
 void sbufWriteU16(sbuf_t *dst, uint16_t val)
 {
-    sbufWriteU8(dst, val >> 0);
-    sbufWriteU8(dst, val >> 8);
+    val = htole16(val);
+    memcpy(dst->ptr, &val, sizeof(val));
+    dst->ptr += sizeof(val);
 }
 
 void sbufWriteU32(sbuf_t *dst, uint32_t val)
 {
-    sbufWriteU8(dst, val >> 0);
-    sbufWriteU8(dst, val >> 8);
-    sbufWriteU8(dst, val >> 16);
-    sbufWriteU8(dst, val >> 24);
+    val = htole32(val);
+    memcpy(dst->ptr, &val, sizeof(val));
+    dst->ptr += sizeof(val);
 }
 
 void sbufWriteData(sbuf_t *dst, const void *data, int len)
@@ -334,3 +613,24 @@ void sbufWriteData(sbuf_t *dst, const void *data, int len)
     dst->ptr += len;
 }
 
+uint8_t sbufReadU8(sbuf_t *src)
+{
+    return *src->ptr++;
+}
+
+uint16_t sbufReadU16(sbuf_t *src)
+{
+    uint16_t val;
+    memcpy(&val, src->ptr, sizeof(val));
+    src->ptr += sizeof(val);
+    return le16toh(val);
+}
+
+uint32_t sbufReadU32(sbuf_t *src)
+{
+    uint32_t val;
+    memcpy(&val, src->ptr, sizeof(val));
+    src->ptr += sizeof(val);
+    return le32toh(val);
+}
+
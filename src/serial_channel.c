@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "serial_channel.h"
+
+#define CHANNEL_QUEUE_MASK (CHANNEL_QUEUE_SIZE - 1)
+#define CHANNEL_DRAIN_CHUNK 256
+
+
+static uint64_t channelNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static channelPort_t *channelFromInstance(serialPort_t *instance)
+{
+    return (channelPort_t *)instance;       // serialPort_t is the first member of uartPort_t, uartPort_t of channelPort_t
+}
+
+
+// splitmix64, spreads seed and stream over the whole state so neighbouring seeds are unrelated
+static uint64_t channelSeed(uint64_t seed, uint64_t stream)
+{
+    uint64_t z = seed + stream * 0x9e3779b97f4a7c15ULL + 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+
+// xorshift64*
+static uint64_t channelRandom(channelQueue_t *queue)
+{
+    uint64_t x = queue->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    queue->rng = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+// uniform in [0, 1)
+static double channelUniform(channelQueue_t *queue)
+{
+    return (channelRandom(queue) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static void channelQueueInit(channelQueue_t *queue, uint64_t seed, uint64_t stream)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->rng = channelSeed(seed, stream);
+}
+
+
+static uint64_t channelByteNs(const channelConfig_t *config)
+{
+    return config->baudRate ? CHANNEL_BITS_PER_BYTE * 1000000000ULL / config->baudRate : 0;
+}
+
+
+// Puts one byte on the emulated line. A byte that is lost still took its time on the line.
+static void channelOffer(const channelConfig_t *config, channelQueue_t *queue, uint8_t byte, uint64_t now)
+{
+    uint64_t deliverAt;
+    int bit;
+
+    queue->stats.bytes++;
+    queue->lineFreeAtNs = (queue->lineFreeAtNs > now ? queue->lineFreeAtNs : now) + channelByteNs(config);
+
+    if (queue->burstRemaining) {
+        queue->burstRemaining--;
+        queue->stats.burstDropped++;
+        return;
+    }
+    if (config->burstRate > 0 && channelUniform(queue) < config->burstRate) {
+        uint32_t length = 1;
+        if (config->burstLength > 1) {
+            length += (uint32_t)(log(1 - channelUniform(queue)) / log(1 - 1.0 / config->burstLength));
+        }
+        queue->stats.bursts++;
+        queue->stats.burstDropped++;
+        queue->burstRemaining = length - 1;
+        return;
+    }
+    if (config->byteDropRate > 0 && channelUniform(queue) < config->byteDropRate) {
+        queue->stats.dropped++;
+        return;
+    }
+    if (config->bitErrorRate > 0) {
+        int flipped = 0;
+        for (bit = 0; bit < 8; bit++) {
+            if (channelUniform(queue) < config->bitErrorRate) {
+                byte ^= 1 << bit;
+                flipped++;
+            }
+        }
+        queue->stats.corrupted += flipped > 0;
+        queue->stats.bitErrors += flipped;
+    }
+
+    if (queue->tail - queue->head == CHANNEL_QUEUE_SIZE) {
+        queue->stats.overruns++;
+        return;
+    }
+
+    deliverAt = queue->lineFreeAtNs + config->latencyUs * 1000ULL;
+    if (config->jitterUs) {
+        deliverAt += (uint64_t)(channelUniform(queue) * config->jitterUs * 1000);
+    }
+    if (deliverAt < queue->lastDeliverAtNs) {
+        deliverAt = queue->lastDeliverAtNs;         // a serial link does not reorder
+    }
+    queue->lastDeliverAtNs = deliverAt;
+
+    queue->deliverAtNs[queue->tail & CHANNEL_QUEUE_MASK] = deliverAt;
+    queue->data[queue->tail & CHANNEL_QUEUE_MASK] = byte;
+    queue->tail++;
+}
+
+
+static uint32_t channelDueCount(const channelQueue_t *queue, uint64_t now, uint32_t limit)
+{
+    uint32_t count = 0;
+
+    while (count < limit && queue->head + count != queue->tail &&
+           queue->deliverAtNs[(queue->head + count) & CHANNEL_QUEUE_MASK] <= now) {
+        count++;
+    }
+    return count;
+}
+
+
+static uint64_t channelNextDueNs(const channelQueue_t *queue)
+{
+    return queue->head == queue->tail ? UINT64_MAX : queue->deliverAtNs[queue->head & CHANNEL_QUEUE_MASK];
+}
+
+
+static uint8_t channelTake(channelQueue_t *queue)
+{
+    queue->stats.delivered++;
+    return queue->data[queue->head++ & CHANNEL_QUEUE_MASK];
+}
+
+
+// wrapped ports: bytes that reached the far end go out on the inner port
+static void channelDrainOut(channelPort_t *channel, uint64_t now)
+{
+    uartPort_t *innerUart = (uartPort_t *)channel->inner;
+    uint8_t chunk[CHANNEL_DRAIN_CHUNK];
+
+    channel->uart.fd = innerUart->fd;
+    channel->uart.deviceState = innerUart->deviceState;
+
+    for (;;) {
+        uint32_t count = channelDueCount(&channel->out, now, serialTxBytesFree(channel->inner));
+        uint32_t i;
+
+        if (!count) {
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            chunk[i] = channelTake(&channel->out);
+        }
+        serialBeginWrite(channel->inner);
+        serialWriteBuf(channel->inner, chunk, count);
+        serialEndWrite(channel->inner);
+    }
+}
+
+
+// wrapped ports: the select() in the inner port must not sleep past the next byte that is due
+static void channelCapWait(channelPort_t *channel, uint64_t now)
+{
+    uint64_t next = channelNextDueNs(&channel->out);
+    uint64_t nextIn = channelNextDueNs(channel->in);
+
+    if (nextIn < next) {
+        next = nextIn;
+    }
+    if (next != UINT64_MAX) {
+        usbCapRxWaitTimeout(next > now ? (next - now + 999) / 1000 : 0);
+    }
+}
+
+
+static uint8_t channelTotalRxWaiting(serialPort_t *instance)
+{
+    channelPort_t *channel = channelFromInstance(instance);
+    uint64_t now = channelNowNs();
+    uint32_t due;
+
+    if (!channel->inner) {
+        return channelDueCount(channel->in, now, 255);
+    }
+
+    channelDrainOut(channel, now);
+    due = channelDueCount(channel->in, now, 255);
+    if (due) {
+        return due;
+    }
+
+    channelCapWait(channel, now);
+    while (serialRxBytesWaiting(channel->inner)) {
+        channelOffer(&channel->config, &channel->wrapIn, serialRead(channel->inner), channelNowNs());
+        usbCapRxWaitTimeout(0);                 // the rest of what arrived is read without sleeping
+    }
+
+    now = channelNowNs();
+    channelDrainOut(channel, now);
+    return channelDueCount(channel->in, now, 255);
+}
+
+
+static uint8_t channelRead(serialPort_t *instance)
+{
+    channelPort_t *channel = channelFromInstance(instance);
+
+    if (channel->in->head == channel->in->tail) {
+        return 0;
+    }
+    return channelTake(channel->in);
+}
+
+
+static void channelWriteBuf(serialPort_t *instance, void *data, int count)
+{
+    channelPort_t *channel = channelFromInstance(instance);
+    uint64_t now = channelNowNs();
+    uint8_t *p = data;
+
+    for (; count > 0; count--, p++) {
+        channelOffer(&channel->config, &channel->out, *p, now);
+    }
+    if (channel->inner) {
+        channelDrainOut(channel, now);
+    }
+}
+
+
+static void channelWrite(serialPort_t *instance, uint8_t ch)
+{
+    channelWriteBuf(instance, &ch, 1);
+}
+
+
+// room left in the emulated driver buffer, bytes already on the line or in flight do not count
+static uint8_t channelTotalTxFree(serialPort_t *instance)
+{
+    channelPort_t *channel = channelFromInstance(instance);
+    uint64_t now = channelNowNs();
+    uint64_t byteNs = channelByteNs(&channel->config);
+    uint32_t waiting = 0;
+    uint32_t space = CHANNEL_QUEUE_SIZE - (channel->out.tail - channel->out.head);
+
+    if (channel->inner) {
+        channelDrainOut(channel, now);
+    }
+    if (byteNs && channel->out.lineFreeAtNs > now) {
+        waiting = (channel->out.lineFreeAtNs - now + byteNs - 1) / byteNs;
+    }
+    if (waiting >= CHANNEL_TX_BUFFER_SIZE) {
+        return 0;
+    }
+    if (space > CHANNEL_TX_BUFFER_SIZE - waiting) {
+        space = CHANNEL_TX_BUFFER_SIZE - waiting;
+    }
+    return space > 255 ? 255 : space;
+}
+
+
+static bool channelIsTransmitBufferEmpty(serialPort_t *instance)
+{
+    channelPort_t *channel = channelFromInstance(instance);
+
+    if (!channel->inner) {
+        return channel->out.head == channel->out.tail;
+    }
+    channelDrainOut(channel, channelNowNs());
+    return channel->out.head == channel->out.tail && isSerialTransmitBufferEmpty(channel->inner);
+}
+
+
+// changes the emulated line rate, the wrapped port keeps its own
+static void channelSetBaudRate(serialPort_t *instance, uint32_t baudRate)
+{
+    channelFromInstance(instance)->config.baudRate = baudRate;
+    instance->baudRate = baudRate;
+}
+
+
+static void channelSetMode(serialPort_t *instance, portMode_t mode)
+{
+    instance->mode = mode;
+}
+
+
+static const struct serialPortVTable channelTable[] = {
+    {
+        .serialWrite = channelWrite,
+        .serialTotalRxWaiting = channelTotalRxWaiting,
+        .serialTotalTxFree = channelTotalTxFree,
+        .serialRead = channelRead,
+        .serialSetBaudRate = channelSetBaudRate,
+        .isSerialTransmitBufferEmpty = channelIsTransmitBufferEmpty,
+        .setMode = channelSetMode,
+        .beginWrite = NULL,
+        .endWrite = NULL,
+        .writeBuf = channelWriteBuf
+    }
+};
+
+
+static void channelInit(channelPort_t *channel, const channelConfig_t *config, uint64_t stream)
+{
+    memset(channel, 0, sizeof(*channel));
+    channel->config = *config;
+    channel->uart.port.vTable = channelTable;
+    channel->uart.port.mode = MODE_RXTX;
+    channel->uart.port.baudRate = config->baudRate;
+    channel->uart.fd = -1;
+    channel->uart.deviceState = CONFIGURED;
+    channelQueueInit(&channel->out, config->seed, stream);
+    channelQueueInit(&channel->wrapIn, config->seed, stream + 1);
+    channel->in = &channel->wrapIn;
+}
+
+
+serialPort_t *channelSerialWrap(channelPort_t *channel, serialPort_t *inner, const channelConfig_t *config)
+{
+    channelInit(channel, config, 0);
+    channel->inner = inner;
+    channel->uart.fd = ((uartPort_t *)inner)->fd;
+    channel->uart.deviceState = ((uartPort_t *)inner)->deviceState;
+    return &channel->uart.port;
+}
+
+
+// what is written to one port is read from the other, each direction impaired on its own
+void channelSerialOpenPair(channelPort_t *a, channelPort_t *b, const channelConfig_t *config)
+{
+    channelInit(a, config, 2);
+    channelInit(b, config, 4);
+    a->in = &b->out;
+    b->in = &a->out;
+}
+
+
+bool channelConfigParse(channelConfig_t *config, const char *spec)
+{
+    char copy[256];
+    char *saveptr;
+    char *item;
+
+    memset(config, 0, sizeof(*config));
+    config->burstLength = 1;
+    config->seed = 1;
+
+    if (snprintf(copy, sizeof(copy), "%s", spec) >= (int)sizeof(copy)) {
+        return false;
+    }
+
+    for (item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        char *end;
+        double number;
+
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        number = strtod(value, &end);
+        if (end == value || *end || number < 0) {
+            return false;
+        }
+
+        if (strcmp(item, "baud") == 0) {
+            config->baudRate = number;
+        } else if (strcmp(item, "latency") == 0) {
+            config->latencyUs = number * 1000;
+        } else if (strcmp(item, "jitter") == 0) {
+            config->jitterUs = number * 1000;
+        } else if (strcmp(item, "ber") == 0 && number <= 1) {
+            config->bitErrorRate = number;
+        } else if (strcmp(item, "drop") == 0 && number <= 1) {
+            config->byteDropRate = number;
+        } else if (strcmp(item, "burst") == 0 && number <= 1) {
+            config->burstRate = number;
+        } else if (strcmp(item, "burstlen") == 0 && number >= 1) {
+            config->burstLength = number;
+        } else if (strcmp(item, "seed") == 0) {
+            config->seed = strtoull(value, NULL, 0);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void channelReportQueue(const char *name, const channelQueue_t *queue)
+{
+    const channelStats_t *stats = &queue->stats;
+
+    fprintf(stderr, "channel %s %llu bytes, %llu delivered, %llu dropped, %llu lost in %llu bursts, %llu corrupted (%llu bits), %llu overruns\n",
+            name, (unsigned long long)stats->bytes, (unsigned long long)stats->delivered, (unsigned long long)stats->dropped,
+            (unsigned long long)stats->burstDropped, (unsigned long long)stats->bursts, (unsigned long long)stats->corrupted,
+            (unsigned long long)stats->bitErrors, (unsigned long long)stats->overruns);
+}
+
+
+void channelSerialReport(channelPort_t *channel)
+{
+    channelReportQueue("tx", &channel->out);
+    channelReportQueue("rx", channel->in);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "lib.h"
+
+#define CHANNEL_QUEUE_SIZE 8192                 // power of two, bytes in flight per direction
+#define CHANNEL_TX_BUFFER_SIZE 1024             // bytes a writer may queue ahead of the line, like a UART driver
+#define CHANNEL_BITS_PER_BYTE 10                // 8N1
+
+typedef struct channelConfig_s {
+    uint32_t baudRate;                          // 0 does not pace at all
+    uint32_t latencyUs;                         // one way, on top of the time on the line
+    uint32_t jitterUs;                          // uniform, bytes are never reordered by it
+    double bitErrorRate;                        // per bit
+    double byteDropRate;
+    double burstRate;                           // per byte, chance that a burst loss starts
+    uint32_t burstLength;                       // mean bytes lost per burst, geometric
+    uint64_t seed;
+} channelConfig_t;
+
+typedef struct channelStats_s {
+    uint64_t bytes;                             // offered to the channel
+    uint64_t delivered;
+    uint64_t dropped;                           // single byte drops
+    uint64_t burstDropped;
+    uint64_t bursts;
+    uint64_t corrupted;                         // bytes with at least one flipped bit
+    uint64_t bitErrors;
+    uint64_t overruns;                          // queue full, lost like a UART overrun
+} channelStats_t;
+
+// one direction of the channel: bytes with the time they arrive at the far end
+typedef struct channelQueue_s {
+    uint64_t deliverAtNs[CHANNEL_QUEUE_SIZE];
+    uint8_t data[CHANNEL_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t lineFreeAtNs;                      // when the line has sent every byte given to it
+    uint64_t lastDeliverAtNs;
+    uint32_t burstRemaining;
+    uint64_t rng;
+    channelStats_t stats;
+} channelQueue_t;
+
+/*
+ * Serial port that emulates a radio or UART link.
+ *
+ * Every byte written is paced at the configured baud rate, delayed by the latency plus jitter,
+ * and may be dropped, lost in a burst or have bits flipped, all driven by a seeded xorshift
+ * generator so a run can be repeated exactly. A wrapped port gets the same treatment in both
+ * directions: bytes written go out to the inner port once they arrive, bytes read from the
+ * inner port become readable once they arrive. An in-memory pair connects two channel ports
+ * directly, for benchmarks inside one process.
+ *
+ * The port starts with a uartPort_t that mirrors the fd and state of the wrapped port, so code
+ * that looks at those keeps working. Passthrough bridges use that fd and bypass the emulation.
+ */
+typedef struct channelPort_s {
+    uartPort_t uart;
+    channelConfig_t config;
+    serialPort_t *inner;                        // NULL for an in-memory pair
+    channelQueue_t out;                         // written to this port
+    channelQueue_t wrapIn;                      // read from the inner port
+    channelQueue_t *in;                         // where reads come from, wrapIn or the peer's out
+} channelPort_t;
+
+// spec is a comma separated list of baud=, latency= and jitter= (ms), ber=, drop=, burst=,
+// burstlen= and seed=, for example "baud=57600,latency=20,jitter=5,drop=1e-4"
+bool channelConfigParse(channelConfig_t *config, const char *spec);
+serialPort_t *channelSerialWrap(channelPort_t *channel, serialPort_t *inner, const channelConfig_t *config);
+void channelSerialOpenPair(channelPort_t *a, channelPort_t *b, const channelConfig_t *config);
+void channelSerialReport(channelPort_t *channel);
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "lib.h"
+
+#define FD_PORT_WRITE_TIMEOUT_MS 100
+
+
+static fdPort_t *fdPortFromInstance(serialPort_t *instance)
+{
+    return (fdPort_t *)instance;            // serialPort_t is the first member of uartPort_t, uartPort_t of fdPort_t
+}
+
+
+static void fdSerialDisconnect(fdPort_t *fdPort)
+{
+    fdPort->uart.deviceState = UNCONNECTED;
+}
+
+
+bool fdSerialIsConnected(serialPort_t *instance)
+{
+    return fdPortFromInstance(instance)->uart.deviceState != UNCONNECTED;
+}
+
+
+static void fdSerialWriteBuf(serialPort_t *instance, void *data, int count)
+{
+    fdPort_t *fdPort = fdPortFromInstance(instance);
+    uint8_t *p = data;
+
+    while (count > 0 && fdSerialIsConnected(instance)) {
+        ssize_t wlen = write(fdPort->uart.fd, p, count);
+        if (wlen > 0) {
+            p += wlen;
+            count -= wlen;
+        } else if (wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            // peer is slow, give it a bounded amount of time before dropping it
+            struct pollfd pfd = { .fd = fdPort->uart.fd, .events = POLLOUT };
+            if (poll(&pfd, 1, FD_PORT_WRITE_TIMEOUT_MS) <= 0) {
+                fdSerialDisconnect(fdPort);
+            }
+        } else {
+            fdSerialDisconnect(fdPort);
+        }
+    }
+}
+
+
+static void fdSerialWrite(serialPort_t *instance, uint8_t ch)
+{
+    fdSerialWriteBuf(instance, &ch, 1);
+}
+
+
+static uint8_t fdSerialTotalRxWaiting(serialPort_t *instance)
+{
+    fdPort_t *fdPort = fdPortFromInstance(instance);
+    uint32_t waiting;
+
+    if (instance->rxBufferTail == instance->rxBufferHead && fdSerialIsConnected(instance)) {
+        ssize_t rlen = read(fdPort->uart.fd, fdPort->rxBuf, instance->rxBufferSize);
+        instance->rxBufferTail = 0;
+        instance->rxBufferHead = rlen > 0 ? rlen : 0;
+        if (rlen == 0 || (rlen < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            fdSerialDisconnect(fdPort);
+        }
+    }
+
+    waiting = instance->rxBufferHead - instance->rxBufferTail;
+    return waiting > 255 ? 255 : waiting;
+}
+
+
+static uint8_t fdSerialRead(serialPort_t *instance)
+{
+    if (instance->rxBufferTail == instance->rxBufferHead) {
+        return 0;
+    }
+    return instance->rxBuffer[instance->rxBufferTail++];
+}
+
+
+static uint8_t fdSerialTotalTxFree(serialPort_t *instance)
+{
+    // writes poll until the peer accepts them, so the "buffer" never fills
+    UNUSED(instance);
+    return 255;
+}
+
+
+static bool fdSerialIsTransmitBufferEmpty(serialPort_t *instance)
+{
+    UNUSED(instance);
+    return true;
+}
+
+
+static void fdSerialSetBaudRate(serialPort_t *instance, uint32_t baudRate)
+{
+    // meaningless for sockets and pipes, remembered for the caller's benefit
+    instance->baudRate = baudRate;
+}
+
+
+static void fdSerialSetMode(serialPort_t *instance, portMode_t mode)
+{
+    instance->mode = mode;
+}
+
+
+static const struct serialPortVTable fdTable[] = {
+    {
+        .serialWrite = fdSerialWrite,
+        .serialTotalRxWaiting = fdSerialTotalRxWaiting,
+        .serialTotalTxFree = fdSerialTotalTxFree,
+        .serialRead = fdSerialRead,
+        .serialSetBaudRate = fdSerialSetBaudRate,
+        .isSerialTransmitBufferEmpty = fdSerialIsTransmitBufferEmpty,
+        .setMode = fdSerialSetMode,
+        .beginWrite = NULL,
+        .endWrite = NULL,
+        .writeBuf = fdSerialWriteBuf
+    }
+};
+
+
+serialPort_t* fdSerialOpen(fdPort_t *fdPort, int fd)
+{
+    memset(fdPort, 0, sizeof(fdPort_t));
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    fdPort->uart.port.vTable = fdTable;
+    fdPort->uart.port.mode = MODE_RXTX;
+    fdPort->uart.port.rxBuffer = fdPort->rxBuf;
+    fdPort->uart.port.rxBufferSize = sizeof(fdPort->rxBuf);
+    fdPort->uart.fd = fd;
+    fdPort->uart.deviceState = CONFIGURED;
+
+    return &fdPort->uart.port;
+}
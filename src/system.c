@@ -0,0 +1,25 @@
+#include <stdint.h>
+#include <time.h>
+#include "lib.h"
+
+
+static uint64_t monotonicMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// milliseconds since an arbitrary point, wraps like the flight controller's millis()
+uint32_t millis(void)
+{
+    return monotonicMicros() / 1000;
+}
+
+
+uint32_t micros(void)
+{
+    return monotonicMicros();
+}
@@ -0,0 +1,146 @@
+/*
+ * Benchmark of the lazy attitude estimation.
+ *
+ * Feeds simulated IMU samples from src/msp_ahrs.c through the estimator in simulated time,
+ * pushed in small batches as a driver draining a sensor FIFO would, while a number of clients
+ * poll the attitude at a fixed rate. Prints how many requests shared each fusion, the cost per
+ * fused sample and the error against the true attitude, then the cost of ingesting the same
+ * samples when nobody polls.
+ *
+ *   msp_ahrs_bench [-r imu_hz] [-t seconds] [-c clients] [-f poll_hz]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "msp_ahrs.h"
+
+#define FIFO_WATERMARK 8                        // samples per push
+
+typedef struct errorStats_s {
+    double sumSquares;
+    double max;
+} errorStats_t;
+
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void recordError(errorStats_t *error, double degrees)
+{
+    error->sumSquares += degrees * degrees;
+    error->max = fabs(degrees) > error->max ? fabs(degrees) : error->max;
+}
+
+
+static void pushSamples(const mspImuSample_t *samples, uint64_t from, uint64_t to)
+{
+    uint64_t n;
+
+    for (n = from; n < to; n += FIFO_WATERMARK) {
+        mspAhrsPushSamples(&samples[n], to - n < FIFO_WATERMARK ? to - n : FIFO_WATERMARK);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint32_t rate = 1000;
+    double seconds = 60;
+    int clients = 4;
+    double pollHz = 50;
+    errorStats_t rollError = { 0 }, pitchError = { 0 }, headingError = { 0 };
+    uint64_t scored = 0;
+    uint64_t pushed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:t:c:f:")) != -1) {
+        switch (opt) {
+            case 'r': rate = atoi(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'f': pollHz = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-r imu_hz] [-t seconds] [-c clients] [-f poll_hz]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!rate || clients < 1 || pollHz <= 0 || seconds <= 0) {
+        return EXIT_FAILURE;
+    }
+
+    mspImuSimStart(rate);
+    mspAhrsStart(rate, NULL);
+
+    uint64_t total = (uint64_t)(seconds * rate);
+    uint64_t pollEvery = rate / pollHz > 1 ? (uint64_t)(rate / pollHz) : 1;
+    mspImuSample_t *samples = malloc(total * sizeof(*samples));
+    uint64_t n;
+
+    if (!samples) {
+        return EXIT_FAILURE;
+    }
+    for (n = 0; n < total; n++) {
+        mspImuSimSample(n, &samples[n], NULL, NULL, NULL);
+    }
+
+    // clients poll at the same rate with their phases spread over the period
+    for (n = 0; n < total; n++) {
+        int client;
+        if ((n + 1) % FIFO_WATERMARK == 0 || n + 1 == total) {
+            pushSamples(samples, pushed, n + 1);
+            pushed = n + 1;
+        }
+        for (client = 0; client < clients; client++) {
+            if ((n + client * pollEvery / clients) % pollEvery == 0 && pushed) {
+                mspImuSample_t sample;
+                mspAhrsAttitude_t attitude;
+                float roll, pitch, heading;
+                double headingDelta;
+
+                mspAhrsGetAttitude(&attitude);
+                mspImuSimSample(pushed - 1, &sample, &roll, &pitch, &heading);
+                if (pushed < rate) {
+                    continue;                   // first second: the estimate is still settling
+                }
+                scored++;
+                recordError(&rollError, attitude.roll / 10.0 - roll);
+                recordError(&pitchError, attitude.pitch / 10.0 - pitch);
+                headingDelta = fmod(attitude.heading - heading + 540.0, 360.0) - 180.0;
+                recordError(&headingError, headingDelta);
+            }
+        }
+    }
+
+    mspAhrsStats_t polled = *mspAhrsGetStats();
+    scored = scored ? scored : 1;
+
+    printf("%u Hz IMU, %.0f s, %d clients polling at %.0f Hz\n", rate, seconds, clients, pollHz);
+    printf("  requests   %llu, %llu fusions (%.1f requests each)\n", (unsigned long long)polled.requests,
+           (unsigned long long)polled.fusions, polled.fusions ? (double)polled.requests / polled.fusions : 0.0);
+    printf("  fused      %llu of %llu samples, %.0f ns per sample, %.1f us per fusion\n",
+           (unsigned long long)polled.fused, (unsigned long long)polled.samples,
+           polled.fused ? (double)polled.fusionNs / polled.fused : 0.0,
+           polled.fusions ? polled.fusionNs / 1e3 / polled.fusions : 0.0);
+    printf("  error      roll rms %.2f max %.2f, pitch rms %.2f max %.2f, heading rms %.2f max %.2f degrees\n",
+           sqrt(rollError.sumSquares / scored), rollError.max, sqrt(pitchError.sumSquares / scored), pitchError.max,
+           sqrt(headingError.sumSquares / scored), headingError.max);
+
+    // the same samples again with nobody asking: only the queue is written
+    uint64_t started = nowNs();
+    pushSamples(samples, 0, total);
+    uint64_t elapsed = nowNs() - started;
+    const mspAhrsStats_t *unpolled = mspAhrsGetStats();
+    printf("  unpolled   %.0f ns per sample ingested, %llu fused\n", (double)elapsed / total,
+           (unsigned long long)(unpolled->fused - polled.fused));
+    free(samples);
+    return EXIT_SUCCESS;
+}
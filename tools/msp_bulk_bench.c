@@ -0,0 +1,376 @@
+/*
+ * Benchmark of the windowed bulk transfers.
+ *
+ * Plays a slow FC on the master side of a fresh pty and starts the server on the slave side as a
+ * client that uploads an OSD font (-F) or downloads dataflash (-D), once stop-and-wait (-W 1) and
+ * once with the given window. Every request is answered after a fixed latency, replies are paced
+ * at the baud rate one after the other, a share of the requests is lost, and dataflash replies
+ * are capped like a real FC's buffer. Prints the time each transfer took and checks that the font
+ * arrived and the downloaded file holds the flash contents.
+ *
+ *   msp_bulk_bench [-s ./obj] [-l latency_ms] [-b baud] [-p loss] [-w window] [-n chars] [-k kib] [-m max_chunk] [-S seed]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#define MSP_OSD_CHAR_WRITE 87
+#define MSP_DATAFLASH_READ 71
+#define OSD_CHAR_SIZE 54
+#define FAKEFC_MAX_PENDING 256
+#define FAKEFC_MAX_REPLY (6 + 255)
+#define FAKEFC_TIMEOUT_NS 120000000000ULL
+
+typedef struct fakeFcReply_s {
+    uint64_t dueNs;
+    uint16_t len;
+    uint8_t data[FAKEFC_MAX_REPLY];
+} fakeFcReply_t;
+
+typedef struct fakeFcRun_s {
+    uint64_t requests;
+    uint64_t dropped;
+    double seconds;                             // first request to server exit
+    bool exited;                                // with status 0
+} fakeFcRun_t;
+
+static uint32_t latencyMs = 20;
+static uint32_t baud = 115200;
+static double loss = 0.01;
+static uint32_t maxChunk = 128;
+
+static uint8_t *font;                           // as written by the server
+static uint32_t fontSize;
+
+// replies leave in arrival order, and each is due no earlier than the one before it
+static fakeFcReply_t pending[FAKEFC_MAX_PENDING];
+static uint32_t pendingHead;
+static uint32_t pendingCount;
+static uint64_t lineFreeNs;
+
+static uint8_t rxBuf[65536];
+static uint32_t rxLen;
+
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint8_t flashByte(uint32_t address)
+{
+    return ((address * 13) >> 3) & 0xff;
+}
+
+
+static void queueReply(uint8_t cmd, const uint8_t *payload, uint8_t size, uint64_t now)
+{
+    fakeFcReply_t *reply;
+    uint8_t checksum = size ^ cmd;
+    uint64_t due;
+    int i;
+
+    if (pendingCount == FAKEFC_MAX_PENDING) {
+        return;
+    }
+    reply = &pending[(pendingHead + pendingCount++) % FAKEFC_MAX_PENDING];
+    reply->data[0] = '$';
+    reply->data[1] = 'M';
+    reply->data[2] = '>';
+    reply->data[3] = size;
+    reply->data[4] = cmd;
+    for (i = 0; i < size; i++) {
+        reply->data[5 + i] = payload[i];
+        checksum ^= payload[i];
+    }
+    reply->data[5 + size] = checksum;
+    reply->len = 6 + size;
+
+    due = now + latencyMs * 1000000ULL;
+    if (lineFreeNs + reply->len * 10 * 1000000000ULL / baud > due) {
+        due = lineFreeNs + reply->len * 10 * 1000000000ULL / baud;
+    }
+    reply->dueNs = lineFreeNs = due;
+}
+
+
+static void handleRequest(uint8_t cmd, const uint8_t *data, uint8_t size, uint64_t now)
+{
+    uint8_t payload[255];
+
+    if (cmd == MSP_OSD_CHAR_WRITE && size >= 1 + OSD_CHAR_SIZE) {
+        uint32_t address = size == 1 + OSD_CHAR_SIZE ? data[0] : data[0] | data[1] << 8;
+        if ((address + 1) * OSD_CHAR_SIZE <= fontSize) {
+            memcpy(font + address * OSD_CHAR_SIZE, data + size - OSD_CHAR_SIZE, OSD_CHAR_SIZE);
+        }
+        queueReply(cmd, NULL, 0, now);
+    } else if (cmd == MSP_DATAFLASH_READ && size >= 6) {
+        uint32_t address = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+        uint32_t length = data[4] | data[5] << 8;
+        uint32_t i;
+
+        length = length < maxChunk ? length : maxChunk;
+        length = length < sizeof(payload) - 4 ? length : sizeof(payload) - 4;
+        memcpy(payload, data, 4);
+        for (i = 0; i < length; i++) {
+            payload[4 + i] = flashByte(address + i);
+        }
+        queueReply(cmd, payload, 4 + length, now);
+    }
+}
+
+
+static void parseRequests(fakeFcRun_t *run, uint64_t now)
+{
+    uint32_t pos = 0;
+
+    while (rxLen - pos >= 6) {
+        uint8_t size, cmd;
+
+        if (rxBuf[pos] != '$' || rxBuf[pos + 1] != 'M' || rxBuf[pos + 2] != '<') {
+            pos++;
+            continue;
+        }
+        size = rxBuf[pos + 3];
+        cmd = rxBuf[pos + 4];
+        if (rxLen - pos < 6u + size) {
+            break;
+        }
+        run->requests++;
+        if ((double)random() / RAND_MAX < loss) {
+            run->dropped++;
+        } else {
+            handleRequest(cmd, rxBuf + pos + 5, size, now);
+        }
+        pos += 6 + size;
+    }
+    memmove(rxBuf, rxBuf + pos, rxLen - pos);
+    rxLen -= pos;
+}
+
+
+static bool runTransfer(const char *server, const char *option, const char *argument, int window, fakeFcRun_t *run)
+{
+    char slaveName[64];
+    char windowArg[16];
+    struct termios tio;
+    uint64_t firstRequest = 0;
+    uint64_t deadline = nowNs() + FAKEFC_TIMEOUT_NS;
+    int master, slave;
+    int status;
+    pid_t pid;
+
+    memset(run, 0, sizeof(*run));
+    pendingHead = pendingCount = 0;
+    lineFreeNs = 0;
+    rxLen = 0;
+
+    if (openpty(&master, &slave, slaveName, NULL, NULL) < 0) {
+        perror("openpty");
+        return false;
+    }
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    snprintf(windowArg, sizeof(windowArg), "%d", window);
+
+    pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        close(master);
+        close(slave);
+        dup2(devnull, STDOUT_FILENO);           // the server logs every command on stdout
+        dup2(devnull, STDERR_FILENO);
+        execl(server, server, "-d", slaveName, option, argument, "-W", windowArg, (char *)NULL);
+        _exit(127);
+    }
+
+    for (;;) {
+        struct pollfd pfd = { .fd = master, .events = POLLIN };
+        uint64_t now = nowNs();
+        int timeoutMs = 10;
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            run->exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            break;
+        }
+        if (now > deadline) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            break;
+        }
+
+        while (pendingCount && pending[pendingHead].dueNs <= now) {
+            fakeFcReply_t *reply = &pending[pendingHead];
+            if (write(master, reply->data, reply->len) < 0 && errno == EAGAIN) {
+                break;                          // the server is behind, try again on the next turn
+            }
+            pendingHead = (pendingHead + 1) % FAKEFC_MAX_PENDING;
+            pendingCount--;
+        }
+        if (pendingCount) {
+            uint64_t wait = pending[pendingHead].dueNs > now ? pending[pendingHead].dueNs - now : 0;
+            timeoutMs = wait / 1000000 < (uint64_t)timeoutMs ? (int)(wait / 1000000) : timeoutMs;
+        }
+
+        if (poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)) {
+            ssize_t len = read(master, rxBuf + rxLen, sizeof(rxBuf) - rxLen);
+            if (len > 0) {
+                now = nowNs();
+                firstRequest = firstRequest ? firstRequest : now;
+                rxLen += len;
+                parseRequests(run, now);
+            }
+        }
+    }
+
+    run->seconds = firstRequest ? (nowNs() - firstRequest) / 1e9 : 0;
+    close(master);
+    close(slave);
+    return run->exited;
+}
+
+
+static void printRun(const char *name, int window, const fakeFcRun_t *run, bool verified)
+{
+    printf("  %-10s window %2d  %6.2f s  %6llu requests  %4llu lost  %s\n", name, window, run->seconds,
+           (unsigned long long)run->requests, (unsigned long long)run->dropped,
+           !run->exited ? "FAILED" : verified ? "verified" : "MISMATCH");
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s server] [-l latency_ms] [-b baud] [-p loss] [-w window] [-n chars] [-k kib] [-m max_chunk] [-S seed]\n", name);
+    fprintf(stderr, "  -s  server binary, started with -d <pty> -F/-D ... -W <window>, default ./obj\n");
+    fprintf(stderr, "  -l  FC reply latency, default 20 ms\n");
+    fprintf(stderr, "  -b  baud rate the replies are paced at, default 115200\n");
+    fprintf(stderr, "  -p  share of requests the FC never sees, default 0.01\n");
+    fprintf(stderr, "  -w  window compared against stop-and-wait, default 8\n");
+    fprintf(stderr, "  -n  font characters to upload, default 256\n");
+    fprintf(stderr, "  -k  dataflash KiB to download, default 64\n");
+    fprintf(stderr, "  -m  most dataflash bytes the FC returns per request, default 128\n");
+    fprintf(stderr, "  -S  seed for the font and the losses, default 1\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *server = "./obj";
+    char fontPath[] = "/tmp/msp_bulk_bench_fontXXXXXX";
+    char flashPath[] = "/tmp/msp_bulk_bench_flashXXXXXX";
+    char flashArg[64];
+    uint32_t chars = 256;
+    uint32_t flashSize = 64 * 1024;
+    unsigned seed = 1;
+    int windows[2] = { 1, 8 };
+    uint8_t *source;
+    bool ok = true;
+    int fd;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:l:b:p:w:n:k:m:S:h")) != -1) {
+        switch (opt) {
+            case 's': server = optarg; break;
+            case 'l': latencyMs = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'p': loss = atof(optarg); break;
+            case 'w': windows[1] = atoi(optarg); break;
+            case 'n': chars = atoi(optarg); break;
+            case 'k': flashSize = atoi(optarg) * 1024; break;
+            case 'm': maxChunk = atoi(optarg); break;
+            case 'S': seed = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!baud || !chars || chars > 65535 || !flashSize || !maxChunk || windows[1] < 1 || loss < 0 || loss >= 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fontSize = chars * OSD_CHAR_SIZE;
+    font = malloc(fontSize);
+    source = malloc(fontSize);
+    srandom(seed);
+    for (i = 0; i < (int)fontSize; i++) {
+        source[i] = random();
+    }
+    fd = mkstemp(fontPath);
+    if (fd < 0 || write(fd, source, fontSize) != (ssize_t)fontSize) {
+        perror(fontPath);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    fd = mkstemp(flashPath);
+    if (fd < 0) {
+        perror(flashPath);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    snprintf(flashArg, sizeof(flashArg), "%s:%u", flashPath, flashSize);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%u ms latency, %u baud, %.1f%% requests lost, dataflash replies capped at %u bytes\n",
+           latencyMs, baud, loss * 100, maxChunk);
+
+    for (i = 0; i < 2; i++) {
+        fakeFcRun_t run;
+        bool verified;
+
+        memset(font, 0, fontSize);
+        srandom(seed + i);
+        runTransfer(server, "-F", fontPath, windows[i], &run);
+        verified = memcmp(font, source, fontSize) == 0;
+        printRun("font", windows[i], &run, verified);
+        ok = ok && run.exited && verified;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fakeFcRun_t run;
+        bool verified = false;
+        FILE *file;
+
+        truncate(flashPath, 0);
+        srandom(seed + i);
+        runTransfer(server, "-D", flashArg, windows[i], &run);
+        file = fopen(flashPath, "rb");
+        if (file) {
+            uint32_t address = 0;
+            int c;
+            verified = true;
+            while ((c = fgetc(file)) != EOF) {
+                verified = verified && c == flashByte(address);
+                address++;
+            }
+            verified = verified && address == flashSize;
+            fclose(file);
+        }
+        printRun("dataflash", windows[i], &run, verified);
+        ok = ok && run.exited && verified;
+    }
+
+    unlink(fontPath);
+    unlink(flashPath);
+    free(font);
+    free(source);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
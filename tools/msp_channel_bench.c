@@ -0,0 +1,146 @@
+/*
+ * Benchmark of MSP over an emulated link, inside one process.
+ *
+ * The server and a client run on the two ends of an in-memory channel pair (see serial_channel.h),
+ * so the whole path is the real parser, dispatch and transmit code with only the link emulated.
+ * The client uploads an OSD font with the bulk engine (msp_bulk.c), once stop-and-wait and once
+ * with the given window, and the server's font store is checked afterwards. For each run prints
+ * the effective throughput, how much of the line it used, the requests and retransmits, and what
+ * the channel did to the bytes in each direction.
+ *
+ *   msp_channel_bench [-L channel] [-w window] [-r runs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lib.h"
+#include "msp_protocol.h"
+#include "msp_frame.h"
+#include "msp_checksum.h"
+#include "msp_bulk.h"
+#include "msp_osd.h"
+#include "serial_channel.h"
+
+#define DRAIN_MS 500                            // after a transfer, until nothing is in flight
+
+
+static uint8_t source[MSP_OSD_FONT_CHARS * MSP_OSD_FONT_CHAR_SIZE];
+static FILE *report;                            // stdout itself carries the server's command log
+
+
+static void runFor(uint32_t ms)
+{
+    uint32_t until = millis() + ms;
+
+    while ((int32_t)(millis() - until) < 0) {
+        mspSerialProcess();
+    }
+}
+
+
+// reads the font back from the server's store, without going over the link
+static bool fontMatches(void)
+{
+    uint8_t in[1];
+    uint8_t out[1 + MSP_OSD_FONT_CHAR_SIZE];
+    int i;
+
+    for (i = 0; i < MSP_OSD_FONT_CHARS; i++) {
+        mspPacket_t command = { .buf = { .ptr = in, .end = in + 1 }, .cmd = MSP_OSD_CHAR_READ };
+        mspPacket_t reply = { .buf = { .ptr = out, .end = out + sizeof(out) }, .cmd = MSP_OSD_CHAR_READ };
+
+        in[0] = i;
+        if (mspOsdCommandHandler(&command, &reply) <= 0 ||
+            memcmp(out + 1, source + i * MSP_OSD_FONT_CHAR_SIZE, MSP_OSD_FONT_CHAR_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool runUpload(channelPort_t *server, channelPort_t *client, const channelConfig_t *config, int window)
+{
+    mspBulkTransfer_t transfer;
+    double seconds;
+    double goodput;
+    bool verified;
+    uint32_t i;
+
+    for (i = 0; i < sizeof(source); i++) {
+        source[i] = random();                   // a new font each run, so a stale store cannot pass
+    }
+    channelSerialOpenPair(server, client, config);
+    resetMspPort(&mspPorts[0], &server->uart.port);
+    resetMspPort(&mspPorts[1], &client->uart.port);
+    mspPorts[1].mode = MSP_MODE_CLIENT;
+
+    mspBulkInitOsdFontUpload(&transfer, source, MSP_OSD_FONT_CHARS);
+    transfer.window = window;
+    if (!mspBulkStart(&mspPorts[1], &transfer)) {
+        return false;
+    }
+    while (transfer.state == MSP_BULK_RUNNING) {
+        mspSerialProcess();
+        mspBulkProcess();
+    }
+    runFor(DRAIN_MS);
+
+    seconds = (transfer.finishedAt - transfer.startedAt) / 1000.0;
+    goodput = seconds > 0 ? transfer.completed * MSP_OSD_FONT_CHAR_SIZE / seconds : 0;
+    verified = transfer.state == MSP_BULK_DONE && fontMatches();
+    fprintf(report, "  window %2d  %6.2f s  %7.0f B/s", window, seconds, goodput);
+    if (config->baudRate) {
+        fprintf(report, " (%3.0f%% of the line)", 100 * goodput / (config->baudRate / CHANNEL_BITS_PER_BYTE));
+    }
+    fprintf(report, "  %5u requests  %4u retransmits  %s\n", transfer.requests, transfer.retransmits,
+           transfer.state != MSP_BULK_DONE ? "FAILED" : verified ? "verified" : "MISMATCH");
+    fflush(report);
+    channelSerialReport(server);                // tx carries the replies, rx the requests
+    return verified;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static channelPort_t server, client;
+    const char *spec = "baud=57600,latency=20,jitter=5,drop=1e-4";
+    channelConfig_t config;
+    int window = MSP_BULK_DEFAULT_WINDOW;
+    int runs = 1;
+    bool ok = true;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "L:w:r:h")) != -1) {
+        switch (opt) {
+            case 'L': spec = optarg; break;
+            case 'w': window = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-L channel] [-w window] [-r runs]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!channelConfigParse(&config, spec) || window < 1 || window > MSP_BULK_MAX_WINDOW || runs < 1) {
+        fprintf(stderr, "usage: %s [-L channel] [-w window] [-r runs]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        return EXIT_FAILURE;
+    }
+    mspChecksumInit();
+    mspFramePoolInit();
+    srandom(1);
+
+    fprintf(report, "%d char OSD font upload over %s\n", MSP_OSD_FONT_CHARS, spec);
+    for (i = 0; i < runs; i++) {
+        ok = runUpload(&server, &client, &config, 1) && ok;
+        ok = runUpload(&server, &client, &config, window) && ok;
+        config.seed++;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,175 @@
+/*
+ * Benchmark of MSP reply compression.
+ *
+ * Runs the LZ4 block codec from src/msp_lz4.c over payloads shaped like the large MSP replies
+ * and prints the compression ratio, the CPU cost per payload, and the effective payload
+ * throughput on a serial link. MSP_COMPRESSED frames carry two extra header bytes, and a
+ * reply that does not shrink goes out uncompressed, exactly as the server does it.
+ *
+ *   msp_compress_bench [-b baud] [-n iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "msp_lz4.h"
+
+#define MSP_V1_FRAME_OVERHEAD 6
+#define MSP_COMPRESSED_HEADER_SIZE 2
+#define PAYLOAD_SIZE 255
+
+typedef struct benchPayload_s {
+    const char *name;
+    uint8_t data[PAYLOAD_SIZE];
+    int size;
+} benchPayload_t;
+
+static benchPayload_t payloads[8];
+static int payloadCount;
+
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static benchPayload_t *addPayload(const char *name, int size)
+{
+    benchPayload_t *payload = &payloads[payloadCount++];
+    payload->name = name;
+    payload->size = size;
+    return payload;
+}
+
+
+static void buildPayloads(void)
+{
+    static const char boxNames[] = "ARM;ANGLE;HORIZON;BARO;MAG;HEADFREE;HEADADJ;CAMSTAB;CAMTRIG;GPS HOME;GPS HOLD;"
+                                   "PASSTHRU;BEEPER;LEDMAX;LEDLOW;LLIGHTS;CALIB;GOVERNOR;OSD SW;TELEMETRY;GTUNE;SONAR;"
+                                   "SERVO1;SERVO2;SERVO3;BLACKBOX;FAILSAFE;AIR MODE;";
+    benchPayload_t *p;
+    int i;
+
+    p = addPayload("box names", sizeof(boxNames) - 1 < PAYLOAD_SIZE ? sizeof(boxNames) - 1 : PAYLOAD_SIZE);
+    memcpy(p->data, boxNames, p->size);
+
+    // 40 ranges of id, aux channel, start, end, most of them unused
+    p = addPayload("mode ranges", 160);
+    memset(p->data, 0, p->size);
+    for (i = 0; i < 4; i++) {
+        p->data[i * 4 + 0] = i;
+        p->data[i * 4 + 1] = i / 2;
+        p->data[i * 4 + 2] = 32 + i * 8;
+        p->data[i * 4 + 3] = 48 + i * 8;
+    }
+
+    // 32 led slots of packed xy, direction, function, color
+    p = addPayload("led strip", 128);
+    for (i = 0; i < 32; i++) {
+        uint32_t led = (i < 12 ? (i << 4 | 7) : 0) | (i < 12 ? 0x0f00 : 0) | (i < 12 ? 0x00120000 : 0);
+        memcpy(p->data + i * 4, &led, 4);
+    }
+
+    // osd element positions, u16 each, hidden elements at 0
+    p = addPayload("osd layout", 120);
+    memset(p->data, 0, p->size);
+    for (i = 0; i < 60; i += 5) {
+        uint16_t pos = 0x0800 | (i * 3);
+        memcpy(p->data + i * 2, &pos, 2);
+    }
+
+    // blackbox log text as it sits in dataflash
+    p = addPayload("dataflash", 250);
+    for (i = 0; i < p->size; ) {
+        i += snprintf((char *)p->data + i, p->size - i, "I %d,%d,%d,%d,%d\n", 1000 + i, i % 7, -i % 13, 1500 + i % 50, 1200);
+    }
+    p->size = 250;
+
+    p = addPayload("random", 250);
+    srand(1);
+    for (i = 0; i < p->size; i++) {
+        p->data[i] = rand();
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint32_t baud = 115200;
+    int iterations = 100000;
+    uint64_t plainBytes = 0;
+    uint64_t wireBytes = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "b:n:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                baud = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b baud] [-n iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    buildPayloads();
+
+    double linkBytesPerSec = baud / 10.0;       // 8N1
+    printf("%-12s %5s %5s %6s %10s %10s %12s %12s\n", "payload", "raw", "lz4", "ratio", "comp ns", "decomp ns", "plain B/s", "lz4 B/s");
+
+    for (i = 0; i < payloadCount; i++) {
+        benchPayload_t *p = &payloads[i];
+        uint8_t packed[PAYLOAD_SIZE * 2];
+        uint8_t unpacked[PAYLOAD_SIZE];
+        uint64_t start, compressNs, decompressNs;
+        int packedLen = 0;
+        int n;
+
+        start = nowNs();
+        for (n = 0; n < iterations; n++) {
+            packedLen = mspLz4Compress(p->data, p->size, packed, sizeof(packed));
+        }
+        compressNs = (nowNs() - start) / iterations;
+
+        start = nowNs();
+        for (n = 0; n < iterations; n++) {
+            if (mspLz4Decompress(packed, packedLen, unpacked, sizeof(unpacked)) != p->size) {
+                fprintf(stderr, "%s: round trip failed\n", p->name);
+                return EXIT_FAILURE;
+            }
+        }
+        decompressNs = (nowNs() - start) / iterations;
+
+        if (memcmp(unpacked, p->data, p->size) != 0) {
+            fprintf(stderr, "%s: round trip mismatch\n", p->name);
+            return EXIT_FAILURE;
+        }
+
+        // what actually goes on the wire, the server falls back to the plain reply when lz4 does not win
+        int plainFrame = MSP_V1_FRAME_OVERHEAD + p->size;
+        int packedFrame = MSP_V1_FRAME_OVERHEAD + MSP_COMPRESSED_HEADER_SIZE + packedLen;
+        int frame = packedFrame < plainFrame ? packedFrame : plainFrame;
+
+        plainBytes += plainFrame;
+        wireBytes += frame;
+
+        printf("%-12s %5d %5d %5.2fx %10llu %10llu %12.0f %12.0f\n", p->name, p->size, packedLen,
+               (double)p->size / packedLen, (unsigned long long)compressNs, (unsigned long long)decompressNs,
+               linkBytesPerSec * p->size / plainFrame,
+               // payload bytes per second of link time plus server cpu time
+               p->size / ((double)frame / linkBytesPerSec + (frame < plainFrame ? (compressNs + decompressNs) / 1e9 : 0)));
+    }
+
+    printf("\nall payloads: %llu wire bytes plain, %llu with compression (%.0f%% of the link time)\n",
+           (unsigned long long)plainBytes, (unsigned long long)wireBytes, 100.0 * wireBytes / plainBytes);
+    return EXIT_SUCCESS;
+}
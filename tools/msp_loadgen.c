@@ -0,0 +1,540 @@
+/*
+ * MSP load generator.
+ *
+ * Starts the server on the slave side of a fresh pty and drives it from the master side, so every
+ * request and reply goes through the kernel tty layer just like a USB adapter would. Any number of
+ * virtual clients share the link. The server answers each command class in order, but control
+ * commands may overtake queued bulk work. A reply is therefore matched to the oldest outstanding
+ * request for the same command.
+ *
+ * Closed loop (default) keeps a fixed number of requests outstanding per client. Open loop (-r)
+ * sends on a fixed schedule whatever the server does, so queueing delay shows up in the latency
+ * instead of silently lowering the offered load.
+ *
+ * With -L the server emulates a slower, lossy link on its side of the pty (see serial_channel.h),
+ * so the same mix can be measured as it would run over a radio.
+ *
+ *   msp_loadgen [-s ./obj] [-c clients] [-w window] [-r rate] [-t seconds] [-m cmd:weight,...] [-L channel]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#define LOADGEN_MAX_CLIENTS 1024
+#define LOADGEN_MAX_OUTSTANDING 4096
+#define LOADGEN_MAX_MIX 32
+#define LOADGEN_REPLY_TIMEOUT_NS 1000000000ULL
+#define LOADGEN_SERVER_START_NS 300000000ULL
+
+// log-linear latency histogram, 16 sub-buckets per power of two of nanoseconds (~6% resolution)
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+typedef struct loadgenStats_s {
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t errors;                            // '!' replies and replies nobody asked for
+    uint64_t timeouts;
+    uint64_t latencySumNs;
+    uint64_t latencyMaxNs;
+    uint64_t histogram[HIST_BUCKETS];
+} loadgenStats_t;
+
+typedef struct loadgenMix_s {
+    uint8_t cmd;
+    uint32_t weight;
+    loadgenStats_t stats;
+} loadgenMix_t;
+
+typedef struct loadgenClient_s {
+    uint32_t outstanding;
+    uint64_t nextSendNs;                        // open loop only
+} loadgenClient_t;
+
+typedef struct loadgenRequest_s {
+    uint8_t mixIndex;
+    bool answered;
+    uint16_t client;
+    uint64_t sentNs;
+} loadgenRequest_t;
+
+static loadgenMix_t mix[LOADGEN_MAX_MIX];
+static int mixCount;
+static uint32_t mixTotalWeight;
+
+static loadgenClient_t clients[LOADGEN_MAX_CLIENTS];
+static int clientCount = 8;
+static uint32_t window = 1;
+static double rate;                             // requests per second over all clients, 0 for closed loop
+
+static loadgenRequest_t outstanding[LOADGEN_MAX_OUTSTANDING];
+static uint32_t outstandingHead;
+static uint32_t outstandingCount;
+
+static uint8_t txBuf[65536];
+static uint32_t txLen;
+static uint8_t rxBuf[65536];
+static uint32_t rxLen;
+
+static loadgenStats_t stats;
+
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int histBucket(uint64_t value)
+{
+    int exponent;
+
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    exponent = 63 - __builtin_clzll(value);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+
+// upper edge of a bucket, so reported percentiles never understate
+static uint64_t histBucketValue(int bucket)
+{
+    int exponent = bucket / HIST_SUB_BUCKETS;
+
+    if (exponent == 0) {
+        return bucket;
+    }
+    exponent += HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+static uint64_t histPercentile(const loadgenStats_t *stats, double percentile)
+{
+    uint64_t target = (uint64_t)(stats->replies * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += stats->histogram[i];
+        if (seen >= target && seen) {
+            return histBucketValue(i) < stats->latencyMaxNs ? histBucketValue(i) : stats->latencyMaxNs;
+        }
+    }
+    return stats->latencyMaxNs;
+}
+
+
+static void recordLatency(loadgenStats_t *stats, uint64_t latency)
+{
+    stats->replies++;
+    stats->latencySumNs += latency;
+    if (latency > stats->latencyMaxNs) {
+        stats->latencyMaxNs = latency;
+    }
+    stats->histogram[histBucket(latency)]++;
+}
+
+
+static void printLatency(const char *name, const loadgenStats_t *stats)
+{
+    if (!stats->replies) {
+        return;
+    }
+    printf("%-11s mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f us\n", name,
+           stats->latencySumNs / 1e3 / stats->replies, histPercentile(stats, 50) / 1e3, histPercentile(stats, 99) / 1e3,
+           histPercentile(stats, 99.9) / 1e3, stats->latencyMaxNs / 1e3);
+}
+
+
+static bool parseMix(const char *spec)
+{
+    const char *p = spec;
+
+    mixCount = 0;
+    mixTotalWeight = 0;
+    while (*p && mixCount < LOADGEN_MAX_MIX) {
+        char *end;
+        unsigned long cmd = strtoul(p, &end, 10);
+        unsigned long weight = 1;
+
+        if (end == p || cmd > 255) {
+            return false;
+        }
+        p = end;
+        if (*p == ':') {
+            weight = strtoul(p + 1, &end, 10);
+            if (end == p + 1) {
+                return false;
+            }
+            p = end;
+        }
+        memset(&mix[mixCount], 0, sizeof(mix[mixCount]));
+        mix[mixCount].cmd = cmd;
+        mix[mixCount].weight = weight;
+        mixTotalWeight += weight;
+        mixCount++;
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return false;
+        }
+    }
+    return mixCount > 0 && mixTotalWeight > 0;
+}
+
+
+static int pickCommand(void)
+{
+    uint32_t r = (uint32_t)random() % mixTotalWeight;
+    int i;
+
+    for (i = 0; i < mixCount - 1 && r >= mix[i].weight; i++) {
+        r -= mix[i].weight;
+    }
+    return i;
+}
+
+
+static bool queueRequest(int client, uint64_t now)
+{
+    loadgenRequest_t *request;
+    int mixIndex;
+    uint8_t cmd;
+
+    if (outstandingCount == LOADGEN_MAX_OUTSTANDING || txLen + 6 > sizeof(txBuf)) {
+        return false;
+    }
+
+    mixIndex = pickCommand();
+    cmd = mix[mixIndex].cmd;
+    memcpy(txBuf + txLen, (uint8_t[]){ '$', 'M', '<', 0, cmd, cmd }, 6);   // empty payload, checksum is the command
+    txLen += 6;
+
+    request = &outstanding[(outstandingHead + outstandingCount++) % LOADGEN_MAX_OUTSTANDING];
+    request->mixIndex = mixIndex;
+    request->answered = false;
+    request->client = client;
+    request->sentNs = now;
+
+    clients[client].outstanding++;
+    stats.sent++;
+    mix[mixIndex].stats.sent++;
+    return true;
+}
+
+
+static void retireRequest(loadgenRequest_t *request)
+{
+    request->answered = true;
+    clients[request->client].outstanding--;
+}
+
+
+// answered requests behind an unanswered one stay in the FIFO until it is answered or expires
+static void popAnswered(void)
+{
+    while (outstandingCount && outstanding[outstandingHead].answered) {
+        outstandingHead = (outstandingHead + 1) % LOADGEN_MAX_OUTSTANDING;
+        outstandingCount--;
+    }
+}
+
+
+static void handleReply(uint8_t direction, uint8_t cmd, uint64_t now)
+{
+    loadgenRequest_t *request = NULL;
+    uint32_t i;
+
+    for (i = 0; i < outstandingCount; i++) {
+        loadgenRequest_t *candidate = &outstanding[(outstandingHead + i) % LOADGEN_MAX_OUTSTANDING];
+        if (!candidate->answered && mix[candidate->mixIndex].cmd == cmd) {
+            request = candidate;
+            break;
+        }
+    }
+
+    if (!request) {
+        stats.errors++;                         // unsolicited frame
+        return;
+    }
+
+    retireRequest(request);
+    if (direction != '>') {
+        stats.errors++;
+        mix[request->mixIndex].stats.errors++;
+    } else {
+        recordLatency(&stats, now - request->sentNs);
+        recordLatency(&mix[request->mixIndex].stats, now - request->sentNs);
+    }
+    popAnswered();
+}
+
+
+static void parseReplies(uint64_t now)
+{
+    uint32_t pos = 0;
+
+    while (rxLen - pos >= 6) {
+        uint8_t *frame = rxBuf + pos;
+        uint8_t size;
+        uint8_t checksum;
+        int i;
+
+        if (frame[0] != '$' || frame[1] != 'M' || (frame[2] != '>' && frame[2] != '!')) {
+            pos++;                              // resync on the next '$'
+            continue;
+        }
+        size = frame[3];
+        if (rxLen - pos < 6u + size) {
+            break;
+        }
+
+        checksum = size ^ frame[4];
+        for (i = 0; i < size; i++) {
+            checksum ^= frame[5 + i];
+        }
+        if (checksum != frame[5 + size]) {
+            stats.errors++;
+            pos++;
+            continue;
+        }
+
+        handleReply(frame[2], frame[4], now);
+        pos += 6 + size;
+    }
+
+    memmove(rxBuf, rxBuf + pos, rxLen - pos);
+    rxLen -= pos;
+}
+
+
+static void expireRequests(uint64_t now)
+{
+    while (outstandingCount && now - outstanding[outstandingHead].sentNs > LOADGEN_REPLY_TIMEOUT_NS) {
+        loadgenRequest_t *request = &outstanding[outstandingHead];
+        retireRequest(request);
+        stats.timeouts++;
+        mix[request->mixIndex].stats.timeouts++;
+        popAnswered();
+    }
+}
+
+
+// returns the time of the next scheduled send in open loop, or a short idle poll in closed loop
+static uint64_t generateLoad(uint64_t now)
+{
+    uint64_t nextNs = now + 1000000;
+    int i;
+
+    for (i = 0; i < clientCount; i++) {
+        loadgenClient_t *client = &clients[i];
+
+        if (rate > 0) {
+            // the schedule does not wait for replies, a slow server falls behind instead of being waited on
+            while (client->nextSendNs <= now && queueRequest(i, client->nextSendNs)) {
+                client->nextSendNs += (uint64_t)(1e9 * clientCount / rate);
+            }
+            if (client->nextSendNs < nextNs) {
+                nextNs = client->nextSendNs;
+            }
+        } else {
+            while (client->outstanding < window && queueRequest(i, now));
+        }
+    }
+    return nextNs;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s server] [-c clients] [-w window] [-r rate] [-t seconds] [-m cmd:weight,...] [-L channel]\n", name);
+    fprintf(stderr, "  -s  server binary, started with -d <pty>, default ./obj\n");
+    fprintf(stderr, "  -c  virtual clients sharing the link, default 8\n");
+    fprintf(stderr, "  -w  closed loop: requests each client keeps outstanding, default 1\n");
+    fprintf(stderr, "  -r  open loop: total requests per second, spread evenly over the clients\n");
+    fprintf(stderr, "  -t  test duration in seconds, default 10\n");
+    fprintf(stderr, "  -m  command mix, default 101:4,108:4,110:1,1:1\n");
+    fprintf(stderr, "  -L  passed to the server: link emulation, e.g. baud=57600,latency=20,drop=1e-4\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *server = "./obj";
+    const char *channel = NULL;
+    double duration = 10;
+    char slaveName[64];
+    struct termios tio;
+    uint64_t start, end, lastReport, now;
+    uint64_t lastReplies = 0;
+    int master, slave;
+    pid_t pid;
+    int opt;
+    int i;
+
+    parseMix("101:4,108:4,110:1,1:1");
+
+    while ((opt = getopt(argc, argv, "s:c:w:r:t:m:L:h")) != -1) {
+        switch (opt) {
+            case 's':
+                server = optarg;
+                break;
+            case 'c':
+                clientCount = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'm':
+                if (!parseMix(optarg)) {
+                    fprintf(stderr, "bad command mix '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                channel = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (clientCount < 1 || clientCount > LOADGEN_MAX_CLIENTS || window < 1 || duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (openpty(&master, &slave, slaveName, NULL, NULL) < 0) {
+        perror("openpty");
+        return EXIT_FAILURE;
+    }
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        close(master);
+        close(slave);
+        dup2(devnull, STDOUT_FILENO);           // the server logs every command on stdout
+        if (channel) {
+            execl(server, server, "-d", slaveName, "-L", channel, (char *)NULL);
+        } else {
+            execl(server, server, "-d", slaveName, (char *)NULL);
+        }
+        perror(server);
+        _exit(127);
+    }
+    // the slave stays open here too, so the link never hangs up while the server opens it
+    signal(SIGPIPE, SIG_IGN);
+
+    now = nowNs();
+    start = now + LOADGEN_SERVER_START_NS;
+    while (nowNs() < start) {
+        usleep(10000);
+    }
+    start = lastReport = nowNs();
+    end = start + (uint64_t)(duration * 1e9);
+
+    srandom(1);
+    for (i = 0; i < clientCount; i++) {
+        clients[i].nextSendNs = rate > 0 ? start + (uint64_t)(1e9 * clientCount / rate) * i / clientCount : start;
+    }
+
+    while ((now = nowNs()) < end) {
+        struct pollfd pfd = { .fd = master, .events = POLLIN };
+        uint64_t waitNs;
+        struct timespec timeout;
+        ssize_t len;
+
+        waitNs = generateLoad(now);
+        waitNs = waitNs > now ? waitNs - now : 0;
+        timeout.tv_sec = waitNs / 1000000000ULL;
+        timeout.tv_nsec = waitNs % 1000000000ULL;
+        if (txLen) {
+            pfd.events |= POLLOUT;
+        }
+
+        if (ppoll(&pfd, 1, &timeout, NULL) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            len = write(master, txBuf, txLen);
+            if (len > 0) {
+                memmove(txBuf, txBuf + len, txLen - len);
+                txLen -= len;
+            }
+        }
+        if (pfd.revents & POLLIN) {
+            len = read(master, rxBuf + rxLen, sizeof(rxBuf) - rxLen);
+            if (len > 0) {
+                rxLen += len;
+                parseReplies(nowNs());
+            }
+        }
+        if (pfd.revents & (POLLHUP | POLLERR)) {
+            fprintf(stderr, "link hung up, server died?\n");
+            break;
+        }
+
+        expireRequests(now);
+
+        if (now - lastReport >= 1000000000ULL) {
+            fprintf(stderr, "%6.1fs %8llu replies/s  %u outstanding\n", (now - start) / 1e9,
+                    (unsigned long long)(stats.replies - lastReplies), outstandingCount);
+            lastReplies = stats.replies;
+            lastReport = now;
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    double elapsed = (nowNs() - start) / 1e9;
+    printf("clients %d, %s, %.1f s\n", clientCount, rate > 0 ? "open loop" : "closed loop", elapsed);
+    if (rate > 0) {
+        printf("offered     %10.1f req/s\n", rate);
+    }
+    printf("throughput  %10.1f req/s\n", stats.replies / elapsed);
+    printf("sent        %10llu\n", (unsigned long long)stats.sent);
+    printf("replies     %10llu\n", (unsigned long long)stats.replies);
+    printf("errors      %10llu (%.3f%%)\n", (unsigned long long)stats.errors, stats.sent ? 100.0 * stats.errors / stats.sent : 0);
+    printf("timeouts    %10llu (%.3f%%)\n", (unsigned long long)stats.timeouts, stats.sent ? 100.0 * stats.timeouts / stats.sent : 0);
+    printLatency("latency", &stats);
+    if (mixCount > 1) {
+        for (i = 0; i < mixCount; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "  cmd %u", mix[i].cmd);
+            printLatency(name, &mix[i].stats);
+        }
+    }
+
+    return stats.replies ? EXIT_SUCCESS : EXIT_FAILURE;
+}
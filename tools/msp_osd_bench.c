@@ -0,0 +1,143 @@
+/*
+ * Benchmark of the OSD DisplayPort diffing.
+ *
+ * Draws a simulated HUD with the canvas code from src/msp_osd_canvas.c, changing values
+ * every cycle as in flight, and prints the bytes each cycle costs on the link when only the
+ * changed runs are sent, against redrawing every row each cycle. The update of each cycle is
+ * chosen by mspOsdCanvasPlanUpdate() as in the server, the first one clears, and the frames are
+ * packed as the server packs them: MSP_DISPLAYPORT write runs frames, the clear when there is
+ * one, and a draw.
+ *
+ *   msp_osd_bench [-r rows] [-c cols] [-f fps] [-b baud] [-n cycles]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "msp_osd_canvas.h"
+
+#define MSP_V1_FRAME_OVERHEAD 6
+#define MSP_V1_MAX_PAYLOAD_SIZE 255
+#define CLEAR_FRAME_SIZE (MSP_V1_FRAME_OVERHEAD + 1)
+
+static mspOsdCanvas_t canvas;
+static mspOsdCanvas_t shown;
+static mspOsdCanvas_t blank;
+static mspOsdRun_t runs[MSP_OSD_CELLS];
+static mspOsdRun_t blankRuns[MSP_OSD_CELLS];
+
+
+// a HUD as flown: attitude and speed change every cycle, slower values now and then
+static void drawHud(mspOsdCanvas_t *target, int cycle, int fps)
+{
+    double t = (double)cycle / fps;
+    int rows = target->rows;
+    int cols = target->cols;
+    int horizon = rows / 2 + (int)lround(3 * sin(t * 0.7));
+    double roll = 0.25 * sin(t * 1.3);
+    char text[32];
+    int col;
+
+    snprintf(text, sizeof(text), "%2d", 80 + (int)(10 * sin(t * 0.1)));
+    mspOsdCanvasWrite(target, 0, 1, 0, text);
+    snprintf(text, sizeof(text), "%03d", (int)(t * 9) % 360);
+    mspOsdCanvasWrite(target, 0, cols / 2 - 1, 0, text);
+    snprintf(text, sizeof(text), "%4dM", (int)(120 + 40 * sin(t * 0.2)));
+    mspOsdCanvasWrite(target, rows / 2, cols - 6, 0, text);
+    snprintf(text, sizeof(text), "%3dKM/H", (int)(60 + 20 * sin(t * 0.5)));
+    mspOsdCanvasWrite(target, rows / 2, 1, 0, text);
+    snprintf(text, sizeof(text), "%2d.%dV", 16 - (int)(t / 60), 8 - (int)(t / 6) % 9);
+    mspOsdCanvasWrite(target, rows - 2, 1, 0, text);
+    snprintf(text, sizeof(text), "%5dMAH", (int)(t * 7));
+    mspOsdCanvasWrite(target, rows - 2, 10, 0, text);
+    snprintf(text, sizeof(text), "%02d:%02d", (int)t / 60, (int)t % 60);
+    mspOsdCanvasWrite(target, rows - 2, cols - 7, 0, text);
+    mspOsdCanvasWrite(target, rows / 2, cols / 2 - 1, 0, "-+-");
+
+    // artificial horizon, nine cells either side of the centre
+    for (col = cols / 2 - 9; col <= cols / 2 + 9; col++) {
+        int row = horizon + (int)lround((col - cols / 2) * roll);
+        if (row > 1 && row < rows - 2 && (col < cols / 2 - 1 || col > cols / 2 + 1)) {
+            mspOsdCanvasWriteChar(target, row, col, 0, '-');
+        }
+    }
+}
+
+
+static int framedSize(const mspOsdRun_t *cycleRuns, int count)
+{
+    uint8_t payload[MSP_V1_MAX_PAYLOAD_SIZE];
+    mspOsdPackCursor_t cursor = { 0 };
+    int bytes = 0;
+    int length;
+
+    while ((length = mspOsdCanvasPack(&canvas, cycleRuns, count, &cursor, payload, sizeof(payload) - 1))) {
+        bytes += MSP_V1_FRAME_OVERHEAD + 1 + length;
+    }
+    return bytes;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int rows = 16;
+    int cols = 30;
+    int fps = 10;
+    int baud = 115200;
+    int cycles = 6000;
+    bool shownUnknown = true;
+    uint64_t diffBytes = 0;
+    uint64_t fullBytes = 0;
+    int maxCycleBytes = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "r:c:f:b:n:")) != -1) {
+        switch (opt) {
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 'f': fps = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'n': cycles = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-r rows] [-c cols] [-f fps] [-b baud] [-n cycles]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    mspOsdCanvasInit(&canvas, rows, cols);
+    mspOsdCanvasInit(&shown, rows, cols);
+    mspOsdCanvasInit(&blank, rows, cols);
+    rows = canvas.rows;
+    cols = canvas.cols;
+
+    for (i = 0; i < cycles; i++) {
+        mspOsdUpdate_t update;
+        int bytes = 0;
+
+        mspOsdCanvasClear(&canvas);
+        drawHud(&canvas, i, fps);
+
+        mspOsdCanvasPlanUpdate(shownUnknown ? NULL : &shown, &blank, &canvas, CLEAR_FRAME_SIZE, runs, blankRuns, &update);
+        if (update.clear || update.count) {
+            bytes = (update.clear ? CLEAR_FRAME_SIZE : 0) + framedSize(update.runs, update.count) + MSP_V1_FRAME_OVERHEAD + 1;
+        }
+        memcpy(&shown, &canvas, sizeof(shown));
+        shownUnknown = false;
+
+        diffBytes += bytes;
+        fullBytes += rows * (MSP_V1_FRAME_OVERHEAD + MSP_OSD_RUN_HEADER_SIZE + cols) + MSP_V1_FRAME_OVERHEAD + 1;
+        maxCycleBytes = bytes > maxCycleBytes ? bytes : maxCycleBytes;
+    }
+
+    double linkBytesPerSecond = baud / 10.0;
+    printf("%dx%d at %d fps, %d cycles\n", rows, cols, fps, cycles);
+    printf("  full redraw  %7.0f bytes/cycle  %6.1f%% of %d baud\n", (double)fullBytes / cycles,
+           100.0 * fullBytes / cycles * fps / linkBytesPerSecond, baud);
+    printf("  diff         %7.1f bytes/cycle  %6.1f%% of %d baud, worst cycle %d bytes\n", (double)diffBytes / cycles,
+           100.0 * diffBytes / cycles * fps / linkBytesPerSecond, baud, maxCycleBytes);
+    printf("  reduction    %.1fx\n", diffBytes ? (double)fullBytes / diffBytes : 0.0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ * Reader for telemetry recordings written by `obj -R`.
+ *
+ * Maps the file and works on the column arrays in place, nothing is parsed or copied:
+ *
+ *   msp_recscan <file>                          list the columns and the recorded time span
+ *   msp_recscan <file> -c <column>              min, max, mean of one column and the scan rate
+ *   msp_recscan <file> -p <col,col,...> [-f <from_us>] [-n <rows>]
+ *                                               print rows as CSV, -f seeks with the time index
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "msp_recorder_file.h"
+
+static const uint8_t *fileBase;
+static const mspRecorderFileHeader_t *header;
+
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static const mspRecorderColumnDesc_t *findColumn(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < header->columnCount; i++) {
+        if (strncmp(header->columns[i].name, name, MSP_RECORDER_COLUMN_NAME_LENGTH) == 0) {
+            return &header->columns[i];
+        }
+    }
+    fprintf(stderr, "no column %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+static int64_t columnValue(const mspRecorderColumnDesc_t *column, uint64_t row)
+{
+    const uint8_t *p = fileBase + column->offset + row * column->width;
+
+    switch (column->width) {
+        case 1: return column->isSigned ? (int64_t)*(const int8_t *)p : (int64_t)*p;
+        case 2: return column->isSigned ? (int64_t)*(const int16_t *)p : (int64_t)*(const uint16_t *)p;
+        case 4: return column->isSigned ? (int64_t)*(const int32_t *)p : (int64_t)*(const uint32_t *)p;
+        default: return *(const int64_t *)p;
+    }
+}
+
+
+// first row at or after fromUs: binary search over the sparse index, then a short linear scan
+static uint64_t seekRow(uint64_t rows, uint64_t fromUs)
+{
+    const uint64_t *index = (const uint64_t *)(fileBase + header->indexOffset);
+    const mspRecorderColumnDesc_t *time = findColumn("time_us");
+    uint64_t entries = (rows + header->indexStride - 1) / header->indexStride;
+    uint64_t lo = 0;
+    uint64_t hi = entries;
+    uint64_t row;
+
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (index[mid] <= fromUs) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    row = lo ? (lo - 1) * header->indexStride : 0;
+    while (row < rows && (uint64_t)columnValue(time, row) < fromUs) {
+        row++;
+    }
+    return row;
+}
+
+
+static void listColumns(uint64_t rows)
+{
+    const mspRecorderColumnDesc_t *time = findColumn("time_us");
+    uint32_t i;
+
+    printf("%llu of %llu rows, %u columns\n", (unsigned long long)rows, (unsigned long long)header->rowCapacity, header->columnCount);
+    if (rows) {
+        printf("time_us %lld .. %lld (%.1f s)\n", (long long)columnValue(time, 0), (long long)columnValue(time, rows - 1),
+               (columnValue(time, rows - 1) - columnValue(time, 0)) / 1e6);
+    }
+    for (i = 0; i < header->columnCount; i++) {
+        printf("  %-16s %s%d\n", header->columns[i].name, header->columns[i].isSigned ? "int" : "uint", header->columns[i].width * 8);
+    }
+}
+
+
+static void scanColumn(uint64_t rows, const char *name)
+{
+    const mspRecorderColumnDesc_t *column = findColumn(name);
+    int64_t min = INT64_MAX;
+    int64_t max = INT64_MIN;
+    double sum = 0;
+    double started = nowSeconds();
+    double elapsed;
+    uint64_t row;
+
+    for (row = 0; row < rows; row++) {
+        int64_t value = columnValue(column, row);
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+        sum += value;
+    }
+    elapsed = nowSeconds() - started;
+
+    if (!rows) {
+        printf("%s: no rows\n", name);
+        return;
+    }
+    printf("%s: min %lld  max %lld  mean %.3f  over %llu rows\n", name, (long long)min, (long long)max, sum / rows, (unsigned long long)rows);
+    printf("scanned %.1f MB in %.3f ms, %.0f MB/s\n", rows * column->width / 1e6, elapsed * 1e3, rows * column->width / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+}
+
+
+static void printRows(uint64_t rows, char *names, uint64_t fromUs, uint64_t count)
+{
+    const mspRecorderColumnDesc_t *columns[MSP_RECORDER_MAX_COLUMNS];
+    int columnCount = 0;
+    char *name;
+    uint64_t row;
+    int i;
+
+    for (name = strtok(names, ","); name && columnCount < MSP_RECORDER_MAX_COLUMNS; name = strtok(NULL, ",")) {
+        columns[columnCount++] = findColumn(name);
+        printf("%s%s", columnCount > 1 ? "," : "", name);
+    }
+    printf("\n");
+
+    for (row = seekRow(rows, fromUs); row < rows && count--; row++) {
+        for (i = 0; i < columnCount; i++) {
+            printf("%s%lld", i ? "," : "", (long long)columnValue(columns[i], row));
+        }
+        printf("\n");
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *scan = NULL;
+    char *print = NULL;
+    uint64_t fromUs = 0;
+    uint64_t count = UINT64_MAX;
+    struct stat st;
+    uint64_t rows;
+    int opt;
+    int fd;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [-c column] [-p col,col,... [-f from_us] [-n rows]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "c:p:f:n:")) != -1) {
+        switch (opt) {
+            case 'c': scan = optarg; break;
+            case 'p': print = optarg; break;
+            case 'f': fromUs = strtoull(optarg, NULL, 10); break;
+            case 'n': count = strtoull(optarg, NULL, 10); break;
+            default: return EXIT_FAILURE;
+        }
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < MSP_RECORDER_PAGE_SIZE) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    fileBase = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (fileBase == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    header = (const mspRecorderFileHeader_t *)fileBase;
+    if (memcmp(header->magic, MSP_RECORDER_MAGIC, sizeof(MSP_RECORDER_MAGIC)) != 0 || header->version != MSP_RECORDER_VERSION ||
+        header->columnCount > MSP_RECORDER_MAX_COLUMNS) {
+        fprintf(stderr, "%s is not a recording\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // a recording may still be growing, rowCount is only raised once a row is complete
+    rows = __atomic_load_n(&header->rowCount, __ATOMIC_ACQUIRE);
+    madvise((void *)fileBase, st.st_size, MADV_SEQUENTIAL);
+
+    if (scan) {
+        scanColumn(rows, scan);
+    } else if (print) {
+        printRows(rows, print, fromUs, count);
+    } else {
+        listColumns(rows);
+    }
+    return EXIT_SUCCESS;
+}